@@ -0,0 +1,50 @@
+#ifndef MAW_ARENA_H
+#define MAW_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Size of the blocks that allocations are carved from, larger allocations
+// get a block of their own
+#define MAW_ARENA_BLOCK_SIZE (64 * 1024)
+// Alignment of every allocation
+#define MAW_ARENA_ALIGN 16
+// Initial number of slots in the table of an interner
+#define MAW_INTERNER_INITIAL_SIZE 256
+
+#define MAW_ARENA_ROUND(size) \
+    (((size) + MAW_ARENA_ALIGN - 1) & ~((size_t)MAW_ARENA_ALIGN - 1))
+
+// Header of a block, the allocations follow it
+struct MawArenaBlock {
+    struct MawArenaBlock *next;
+    size_t size;
+    size_t used;
+} typedef MawArenaBlock;
+
+// Bump allocator, allocations are never released on their own but all at
+// once with `maw_arena_free()`
+struct MawArena {
+    MawArenaBlock *head;
+} typedef MawArena;
+
+// Set of strings copied into an arena, identical strings share storage and
+// can be compared by pointer
+struct MawInterner {
+    MawArena *arena;
+    // Open addressing (linear probing) table, always a power of two in size
+    char **slots;
+    size_t slot_count;
+    size_t count;
+} typedef MawInterner;
+
+void *maw_arena_alloc(MawArena *arena, size_t size)
+    __attribute__((warn_unused_result));
+char *maw_arena_strdup(MawArena *arena, const char *s)
+    __attribute__((warn_unused_result));
+void maw_arena_free(MawArena *arena);
+char *maw_intern(MawInterner *interner, const char *s)
+    __attribute__((warn_unused_result));
+void maw_interner_free(MawInterner *interner);
+
+#endif // MAW_ARENA_H
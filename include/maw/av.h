@@ -1,6 +1,7 @@
 #ifndef MAW_AV_H
 #define MAW_AV_H
 
+#include "maw/cover.h"
 #include "maw/maw.h"
 
 #pragma GCC diagnostic push
@@ -11,11 +12,29 @@
 #include <libavfilter/avfilter.h>
 #include <libavformat/avformat.h>
 
+// Decoder, encoder and filter graph used to crop covers with the same
+// parameters. Idle pipelines are kept in a per-thread pool so that they can be
+// reused for the next file handled by the same thread.
+struct MawCropPipeline {
+    enum AVCodecID codec_id;
+    int width;
+    int height;
+    int pix_fmt;
+    AVCodecContext *dec_codec_ctx;
+    // The encoder and filter graph are only created when a crop is needed
+    AVCodecContext *enc_codec_ctx;
+    AVFilterGraph *filter_graph;
+    AVFilterContext *filter_buffersrc_ctx;
+    AVFilterContext *filter_buffersink_ctx;
+    TAILQ_ENTRY(MawCropPipeline) entry;
+} typedef MawCropPipeline;
+
 struct MawAVContext {
     const char *output_filepath;
     const MediaFile *mediafile;
     AVFormatContext *input_fmt_ctx;
-    AVFormatContext *cover_fmt_ctx;
+    // Only set when COVER_POLICY_PATH is used
+    MawCover *cover;
     AVFormatContext *output_fmt_ctx;
     ssize_t audio_input_stream_index;
     ssize_t video_input_stream_index;
@@ -25,6 +44,17 @@ struct MawAVContext {
     AVFilterContext *filter_buffersink_ctx;
     AVCodecContext *dec_codec_ctx;
     AVCodecContext *enc_codec_ctx;
+    // Pooled pipeline that the filtering variables were taken from
+    MawCropPipeline *crop_pipeline;
+    // Scratch objects, kept when the context is reused for another file
+    AVPacket *pkt;
+    AVFrame *frame;
+    AVFrame *filtered_frame;
+    // Allow metadata only changes to be written directly to the input file
+    bool patch_inplace;
+    // Set if the input file was patched in place, there is no output file to
+    // replace the input file with in this case.
+    bool patched;
 } typedef MawAVContext;
 
 // The final output file is identical to the input file if all
@@ -35,12 +65,40 @@ enum MawAVResult {
     MAW_AV_RESULT_ERROR = 0x1 << 1,
 };
 
+// Changes that `maw_av_remux()` would make to a media file
+enum MawAVChange {
+    MAW_AV_CHANGE_TITLE = 0x1,
+    MAW_AV_CHANGE_ARTIST = 0x1 << 1,
+    MAW_AV_CHANGE_ALBUM = 0x1 << 2,
+    // Fields that are removed by CLEAN_POLICY_TRUE
+    MAW_AV_CHANGE_CLEAN = 0x1 << 3,
+    // The cover is added, replaced or removed
+    MAW_AV_CHANGE_COVER = 0x1 << 4,
+    MAW_AV_CHANGE_CROP = 0x1 << 5,
+    // Streams other than the audio stream and the cover are dropped
+    MAW_AV_CHANGE_STREAMS = 0x1 << 6,
+};
+
+#define MAW_AV_CHANGE_LAST MAW_AV_CHANGE_STREAMS
+
+int maw_av_probe(const MediaFile *mediafile)
+    __attribute__((warn_unused_result));
+int maw_av_plan(const MediaFile *mediafile, unsigned int *changes)
+    __attribute__((warn_unused_result));
+const char *maw_av_change_tostr(enum MawAVChange change);
+int maw_av_prepare(MawAVContext *ctx) __attribute__((warn_unused_result));
 int maw_av_remux(MawAVContext *ctx) __attribute__((warn_unused_result));
 void maw_av_free_context(MawAVContext *ctx);
+void maw_av_thread_free(void);
 MawAVContext *maw_av_init_context(const MediaFile *mediafile,
                                   const char *output_filepath)
     __attribute__((warn_unused_result));
 
+// Bump when the fingerprint of a configuration no longer describes what is
+// written to media files
+#define MAW_AV_FINGERPRINT_VERSION 1
+#define MAW_AV_FINGERPRINT_SIZE    32
+
 #define CROP_ACCEPTED_WIDTH  1280
 #define CROP_ACCEPTED_HEIGHT 720
 #define CROP_DESIRED_WIDTH   720
@@ -35,6 +35,8 @@ struct YamlContext {
     yaml_token_type_t next_token_type;
     enum YamlKey keypath[MAW_CFG_MAX_DEPTH];
     ssize_t key_count;
+    // Values are interned into the arena of the configuration
+    MawInterner interner;
 } typedef YamlContext;
 
 const char *maw_cfg_clean_policy_tostr(enum CleanPolicy key);
@@ -42,5 +44,7 @@ const char *maw_cfg_cover_policy_tostr(enum CoverPolicy key);
 void maw_cfg_free(MawConfig *cfg);
 int maw_cfg_parse(const char *filepath, MawConfig **cfg)
     __attribute__((warn_unused_result));
+int maw_cfg_load(const char *filepath, MawConfig **cfg)
+    __attribute__((warn_unused_result));
 
 #endif // MAW_CFG_H
@@ -0,0 +1,75 @@
+#ifndef MAW_CFGCACHE_H
+#define MAW_CFGCACHE_H
+
+#include "maw/maw.h"
+
+#include <stdint.h>
+
+// Bump when the file format or the way that the YAML configuration is
+// interpreted changes, a cache with another version is ignored.
+#define MAW_CFGCACHE_VERSION 1
+#define MAW_CFGCACHE_MAGIC   "MAWCFGC"
+// Offset into the string table for fields that are unset
+#define MAW_CFGCACHE_NULL UINT32_MAX
+// Initial number of slots in the string table used while compiling
+#define MAW_CFGCACHE_INITIAL_SIZE 256
+
+// Identifies the contents of the YAML file that a cache was compiled from
+struct MawCfgCacheKey {
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t digest;
+} typedef MawCfgCacheKey;
+
+// On-disk header of the cache, followed by the metadata entries, the
+// playlists, the offsets of all playlist paths and finally a table of
+// NUL-terminated strings. Strings are referenced by their offset into the
+// table and every distinct string is only stored once.
+struct MawCfgCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    MawCfgCacheKey key;
+    uint32_t art_dir;
+    uint32_t music_dir;
+    uint32_t metadata_count;
+    uint32_t playlist_count;
+    uint32_t playlist_path_count;
+    uint32_t strings_size;
+} typedef MawCfgCacheHeader;
+
+struct MawCfgCacheMetadata {
+    uint32_t pattern;
+    uint32_t title;
+    uint32_t album;
+    uint32_t artist;
+    uint32_t cover_path;
+    int32_t cover_policy;
+    int32_t clean_policy;
+    uint32_t reserved;
+} typedef MawCfgCacheMetadata;
+
+// The paths of a playlist follow the paths of the previous playlist
+struct MawCfgCachePlaylist {
+    uint32_t name;
+    uint32_t path_count;
+} typedef MawCfgCachePlaylist;
+
+// Mapping of a cache that a configuration was loaded from, all strings of
+// the configuration point into it
+struct MawCfgCache {
+    void *map;
+    size_t map_size;
+} typedef MawCfgCache;
+
+int maw_cfgcache_path(const char *config_path, char *out, size_t size)
+    __attribute__((warn_unused_result));
+int maw_cfgcache_key(const char *config_path, MawCfgCacheKey *key)
+    __attribute__((warn_unused_result));
+int maw_cfgcache_load(const char *path, const MawCfgCacheKey *key,
+                      MawConfig **cfg) __attribute__((warn_unused_result));
+int maw_cfgcache_save(const char *path, const MawCfgCacheKey *key,
+                      const MawConfig *cfg) __attribute__((warn_unused_result));
+void maw_cfgcache_free(MawCfgCache *cache);
+
+#endif // MAW_CFGCACHE_H
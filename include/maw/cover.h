@@ -0,0 +1,59 @@
+#ifndef MAW_COVER_H
+#define MAW_COVER_H
+
+#include "maw/maw.h"
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wconversion"
+#include <libavcodec/avcodec.h>
+#pragma GCC diagnostic pop
+
+#include <libavutil/buffer.h>
+#include <time.h>
+
+// Maximum number of finished crops that are kept, the least recently used
+// crop is evicted first
+#define MAW_CROP_CACHE_SIZE    64
+// Number of hash buckets for the crop cache, must be a power of two
+#define MAW_CROP_CACHE_BUCKETS 64
+
+// A cover art file that has been loaded into memory, shared between all
+// media files (and threads) that use the same `cover_path`.
+struct MawCover {
+    char *path;
+    // Cache key, the cover is reloaded if the file is modified during a run
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+    // Raw bytes of the cover file, used as is for the attached_pic packet
+    AVBufferRef *buf;
+    uint64_t digest;
+    AVCodecParameters *codecpar;
+    // One reference is held by the cache itself
+    size_t refcount;
+    TAILQ_ENTRY(MawCover) entry;
+} typedef MawCover;
+
+// The result of cropping an attached_pic, shared between all media files that
+// have an identical cover.
+struct MawCrop {
+    uint64_t digest;
+    // Copy of the original packet data to compare against on a match, the
+    // buffer of the input packet itself is not kept
+    AVBufferRef *input;
+    // Cropped and encoded packet data, NULL while the crop is pending
+    AVBufferRef *output;
+    // Least recently used order
+    TAILQ_ENTRY(MawCrop) entry;
+    LIST_ENTRY(MawCrop) bucket_entry;
+} typedef MawCrop;
+
+int maw_cover_get(const char *path, MawCover **out)
+    __attribute__((warn_unused_result));
+void maw_cover_put(MawCover *cover);
+int maw_cover_crop_get(const AVPacket *pkt, AVBufferRef **out,
+                       MawCrop **pending) __attribute__((warn_unused_result));
+void maw_cover_crop_set(MawCrop *pending, const AVPacket *pkt);
+void maw_cover_cache_free(void);
+
+#endif // MAW_COVER_H
@@ -0,0 +1,66 @@
+#ifndef MAW_MATCH_H
+#define MAW_MATCH_H
+
+#include "maw/maw.h"
+
+// Maximum number of path segments in a pattern or a matched path
+#define MAW_MATCH_MAX_DEPTH 64
+
+// One path segment of a metadata pattern. Segments that contain a '*' are
+// matched with fnmatch(3), all others are compared as is.
+struct MatchNode {
+    char *segment;
+    bool wildcard;
+    // Set if neither this segment nor any parent segment is a wildcard, the
+    // pattern then also matches everything beneath the path.
+    bool literal;
+    // Indices of the entries whose pattern ends at this node
+    size_t *indices;
+    size_t index_count;
+    TAILQ_HEAD(MatchNodeHead, MatchNode) children_head;
+    TAILQ_ENTRY(MatchNode) entry;
+} typedef MatchNode;
+
+struct MatchEntry {
+    MetadataEntry *metadata_entry;
+    const MatchNode *node;
+    // Number of files that matched the pattern
+    size_t hits;
+    // Set if the entry applies to one of the paths passed to
+    // `maw_match_select()`
+    bool selected;
+} typedef MatchEntry;
+
+// All metadata patterns compiled into a trie of path segments
+struct Matcher {
+    MatchNode *root;
+    // Entries in configuration order
+    MatchEntry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    // Set once `maw_match_select()` is used, only selected entries are
+    // checked by `maw_match_check()` in that case
+    bool scoped;
+} typedef Matcher;
+
+// Indices of the entries that matched a path, in configuration order
+struct MatchResult {
+    size_t *indices;
+    size_t count;
+    size_t capacity;
+} typedef MatchResult;
+
+int maw_match_add(Matcher *matcher, MetadataEntry *metadata_entry)
+    __attribute__((warn_unused_result));
+int maw_match_path(Matcher *matcher, const char *path, MatchResult *result)
+    __attribute__((warn_unused_result));
+int maw_match_normalize(const char *path, char *out, size_t size)
+    __attribute__((warn_unused_result));
+int maw_match_select(Matcher *matcher, const char *path, size_t *count)
+    __attribute__((warn_unused_result));
+int maw_match_check(const Matcher *matcher, const char *music_dir)
+    __attribute__((warn_unused_result));
+void maw_match_free(Matcher *matcher);
+void maw_match_result_free(MatchResult *result);
+
+#endif // MAW_MATCH_H
@@ -1,6 +1,8 @@
 #ifndef MAW_H
 #define MAW_H
 
+#include "maw/arena.h"
+
 #include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,9 +14,6 @@
 // -Wgnu-statement-expression-from-macro-expansion warnings on Linux,
 // TAILQ_LAST works fine on both Linux and BSD.
 
-// Maximum number of files to handle in one invocation
-#define MAW_MAX_FILES 1024
-
 // Maximum length of paths in configuration file etc.
 #define MAW_PATH_MAX 1024
 
@@ -55,6 +54,8 @@ enum MawResult {
     RESULT_UNSUPPORTED_INPUT_STREAMS = 51,
     // Error encountered in libyaml
     RESULT_ERR_YAML = 52,
+    // The MP4 box layout does not allow the metadata to be patched in place
+    RESULT_UNSUPPORTED_LAYOUT = 53,
 };
 
 struct Metadata {
@@ -69,10 +70,38 @@ struct Metadata {
 
 struct MediaFile {
     char *path;
+    // Destination in the output tree, NULL to update the file in place
+    char *output_path;
     const Metadata *metadata;
-    uint32_t path_digest;
+    uint64_t path_digest;
+    // Size of the file when it was discovered, used to schedule large files
+    // first
+    off_t size;
+    // Device that the file is stored on, the scheduler limits the number of
+    // in-flight files per device
+    dev_t dev;
+    ino_t ino;
+    // Modification time when the file was discovered, in nanoseconds
+    int64_t mtime_ns;
+    // Digest of the desired metadata, see `maw_state_digest()`
+    uint64_t metadata_digest;
+    // Set when the state cache shows that the file is already up to date
+    bool unchanged;
+    // Set by the worker threads once the file is up to date
+    bool done;
 } typedef MediaFile;
 
+// Growable list of media files with a hash set of their paths
+struct MediaFiles {
+    MediaFile *items;
+    size_t count;
+    size_t capacity;
+    // Open addressing (linear probing) table of indices into `items`, offset
+    // by one so that 0 marks a free slot. Always a power of two in size.
+    size_t *slots;
+    size_t slot_count;
+} typedef MediaFiles;
+
 struct PlaylistPath {
     char *path;
     TAILQ_ENTRY(PlaylistPath) entry;
@@ -99,14 +128,29 @@ struct MawConfig {
     char *music_dir;
     TAILQ_HEAD(PlaylistEntryHead, PlaylistEntry) playlists_head;
     TAILQ_HEAD(MetadataEntryHead, MetadataEntry) metadata_head;
+    // Owns all entries and, unless the configuration was loaded from its
+    // compiled cache, all strings
+    MawArena arena;
+    // Set if the configuration was loaded from its compiled cache, the
+    // strings then point into the cache.
+    struct MawCfgCache *cache;
 } typedef MawConfig;
 
 // CLI arguments
 struct MawArguments {
     char *config_path;
+    // MAW_THREADS_AUTO to adjust the number of threads at runtime
     size_t thread_count;
+    // Concurrency of the rewrite stage, 0 to use `thread_count`
+    size_t rewrite_thread_count;
+    // Maximum number of files per device processed at once, 0 for no limit
+    size_t device_limit;
     bool verbose;
     bool dry_run;
+    // Ignore the state cache from previous runs
+    bool force;
+    // Write updated media files to a mirror of the music directory
+    char *output_dir;
     int av_log_level;
 #ifdef MAW_TEST
     char *match_testcase;
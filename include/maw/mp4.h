@@ -0,0 +1,60 @@
+#ifndef MAW_MP4_H
+#define MAW_MP4_H
+
+#include "maw/maw.h"
+
+// Tags to write into the `moov/udta/meta/ilst` atom of a file.
+// A NULL value leaves the current tag as is, an empty value removes it.
+struct Mp4Tags {
+    const char *title;
+    const char *artist;
+    const char *album;
+    // Value for the maw fingerprint item, NULL leaves the current item as is
+    const char *fingerprint;
+    // Drop all items except the ones above, the encoder and the cover
+    bool clean;
+} typedef Mp4Tags;
+
+int maw_mp4_patch(const char *filepath, const Mp4Tags *tags, bool durable)
+    __attribute__((warn_unused_result));
+
+#define MP4_BOX_HEADER_SIZE      8
+#define MP4_LARGE_HEADER_SIZE    16
+#define MP4_DATA_HEADER_SIZE     16
+#define MP4_DATA_TYPE_UTF8       1
+// Header of the `mean` and `name` atoms in a freeform item
+#define MP4_FREEFORM_HEADER_SIZE 12
+// Refuse to load unreasonably large `moov` atoms into memory
+#define MP4_MAX_MOOV_SIZE        (64 * 1024 * 1024)
+// Free space left after a `moov` atom that is moved, in addition to room for
+// a copy of it, so that the next patch can be written without moving it again
+#define MP4_MOOV_PADDING         4096
+
+#define MP4_TYPE(a, b, c, d) \
+    ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | \
+     (uint32_t)(d))
+
+#define MP4_TYPE_MOOV MP4_TYPE('m', 'o', 'o', 'v')
+#define MP4_TYPE_MOOF MP4_TYPE('m', 'o', 'o', 'f')
+#define MP4_TYPE_MVEX MP4_TYPE('m', 'v', 'e', 'x')
+#define MP4_TYPE_UDTA MP4_TYPE('u', 'd', 't', 'a')
+#define MP4_TYPE_META MP4_TYPE('m', 'e', 't', 'a')
+#define MP4_TYPE_ILST MP4_TYPE('i', 'l', 's', 't')
+#define MP4_TYPE_DATA MP4_TYPE('d', 'a', 't', 'a')
+#define MP4_TYPE_FREE MP4_TYPE('f', 'r', 'e', 'e')
+#define MP4_TYPE_SKIP MP4_TYPE('s', 'k', 'i', 'p')
+#define MP4_TYPE_COVR MP4_TYPE('c', 'o', 'v', 'r')
+#define MP4_TYPE_NAM  MP4_TYPE(0xa9, 'n', 'a', 'm')
+#define MP4_TYPE_ART  MP4_TYPE(0xa9, 'A', 'R', 'T')
+#define MP4_TYPE_ALB  MP4_TYPE(0xa9, 'a', 'l', 'b')
+#define MP4_TYPE_TOO  MP4_TYPE(0xa9, 't', 'o', 'o')
+#define MP4_TYPE_MEAN MP4_TYPE('m', 'e', 'a', 'n')
+#define MP4_TYPE_NAME MP4_TYPE('n', 'a', 'm', 'e')
+
+// Freeform item that holds a digest of the configuration that maw applied,
+// libavformat exposes it with the `name` as key.
+#define MP4_TYPE_FREEFORM    MP4_TYPE('-', '-', '-', '-')
+#define MP4_FINGERPRINT_MEAN "maw"
+#define MP4_FINGERPRINT_NAME "maw_applied"
+
+#endif // MAW_MP4_H
@@ -0,0 +1,56 @@
+#ifndef MAW_STATE_H
+#define MAW_STATE_H
+
+#include "maw/maw.h"
+
+#include <stdint.h>
+
+// Bump when the file format or the way that media files are updated changes,
+// a state file with another version is ignored.
+#define MAW_STATE_VERSION 1
+#define MAW_STATE_MAGIC   "MAWSTATE"
+// Initial number of records that room is reserved for
+#define MAW_STATE_INITIAL_SIZE 64
+
+// On-disk header of the state file, followed by `count` records
+struct MawStateHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+} typedef MawStateHeader;
+
+// A media file that was up to date at the end of a previous run, identified
+// by its device and inode. The file is unchanged if its size and mtime are
+// the same and the desired metadata has the same digest.
+struct MawStateRecord {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_ns;
+    uint64_t metadata_digest;
+} typedef MawStateRecord;
+
+struct MawState {
+    MawStateRecord *records;
+    size_t count;
+    size_t capacity;
+    // Open addressing (linear probing) table of indices into `records`,
+    // offset by one so that 0 marks a free slot. Always a power of two in
+    // size.
+    size_t *slots;
+    size_t slot_count;
+} typedef MawState;
+
+int maw_state_path(char *out, size_t size) __attribute__((warn_unused_result));
+int maw_state_load(const char *path, MawState *state)
+    __attribute__((warn_unused_result));
+int maw_state_save(const char *path, const MawState *state)
+    __attribute__((warn_unused_result));
+uint64_t maw_state_digest(const Metadata *metadata);
+size_t maw_state_mark(const MawState *state, MediaFiles *mediafiles);
+int maw_state_record(MawState *state, const MediaFiles *mediafiles)
+    __attribute__((warn_unused_result));
+void maw_state_free(MawState *state);
+
+#endif // MAW_STATE_H
@@ -5,5 +5,6 @@
 
 bool maw_verify(const MediaFile *mediafile);
 bool maw_verify_file(const char *path, const char *expected_content);
+bool maw_verify_fingerprint(const char *path, char *out, size_t size);
 
 #endif
@@ -4,17 +4,127 @@
 #include "maw/maw.h"
 
 #include <pthread.h>
+#include <sys/types.h>
+
+// Files that need to be re-encoded are considered to be this much larger
+// than they are when ordering the work queue.
+#define MAW_THREADS_CROP_COST (32 * 1024 * 1024)
+
+// Number of pending rewrites that may be queued per rewrite thread
+#define MAW_THREADS_REWRITE_BACKLOG 4
+// Without an explicit rewrite job count, rewrites use this fraction of the jobs
+#define MAW_THREADS_REWRITE_DIVISOR 4
+
+// Passed as the thread count to pick the number of threads at runtime,
+// starting from the number of online CPUs.
+#define MAW_THREADS_AUTO 0
+// Upper bound for the number of threads per stage in auto mode, as a multiple
+// of the number of online CPUs.
+#define MAW_THREADS_AUTO_MAX_FACTOR 4
+// Length of one measurement window for the auto mode controller
+#define MAW_THREADS_WINDOW_MS 1000
+// Throughput changes below this fraction are treated as noise
+#define MAW_THREADS_TOLERANCE 0.05
+
+struct WorkItem {
+    uint64_t cost;
+    dev_t dev;
+    // Position on a rotational device, physical offset or inode number
+    uint64_t location;
+    size_t index;
+} typedef WorkItem;
+
+// Media files stored on one device, `items[start..end)` of the work queue
+struct DeviceQueue {
+    dev_t dev;
+    // Items are ordered by their location on the device instead of by cost
+    bool rotational;
+    size_t start;
+    size_t end;
+    // Index of the next item to hand out
+    size_t next;
+    // Number of media files from this device that are being processed
+    size_t inflight;
+} typedef DeviceQueue;
+
+// Media files that are waiting to be processed, shared by all threads
+struct WorkQueue {
+    // Each media file is only written to by the thread that it was handed
+    // out to
+    MediaFile *mediafiles;
+    // Indices into `mediafiles` grouped by device, the most expensive jobs of
+    // each device are handed out first
+    WorkItem *items;
+    size_t size;
+    DeviceQueue *devices;
+    size_t device_count;
+    // Maximum number of in-flight media files per device, 0 for no limit
+    size_t device_limit;
+    pthread_mutex_t lock;
+    // Signaled when a media file is done and its device has a free slot
+    pthread_cond_t available;
+} typedef WorkQueue;
+
+// Media files that passed the probe stage and need to be rewritten. Bounded so
+// that probe results do not pile up far ahead of the rewrite threads.
+struct RewriteQueue {
+    size_t *items;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    // Number of probe threads that can still push to the queue
+    size_t producers;
+    // Number of rewrite threads that are still popping from the queue
+    size_t consumers;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} typedef RewriteQueue;
+
+// Worker threads of one stage. Only the threads with a slot below `active`
+// take jobs, the others are parked until the controller raises the limit.
+struct ThreadStage {
+    const char *name;
+    // Adjust `active` at runtime based on the measured throughput
+    bool adaptive;
+    // Measure throughput in bytes instead of files
+    bool by_bytes;
+    // Set once a thread finds the stage's queue drained, parked threads are
+    // released
+    bool closed;
+    size_t spawned;
+    size_t running;
+    size_t active;
+    // Threads that failed, parked threads take over their slots
+    size_t failed;
+    uint64_t files;
+    uint64_t bytes;
+    // Controller state from the previous window
+    uint64_t last_amount;
+    double last_rate;
+    int direction;
+} typedef ThreadStage;
+
+struct ThreadControl {
+    ThreadStage probe;
+    ThreadStage rewrite;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} typedef ThreadControl;
 
 struct ThreadContext {
-    const MediaFile *mediafiles;
-    size_t index_start;
-    size_t index_end;
+    WorkQueue *queue;
+    RewriteQueue *rewrites;
+    ThreadControl *control;
+    ThreadStage *stage;
+    size_t slot;
     bool dry_run;
     bool exit_ok;
     bool spawned;
 } typedef ThreadContext;
 
-int maw_threads_launch(MediaFile mediafiles[], size_t size, size_t thread_count,
-                       bool dry_run) __attribute__((warn_unused_result));
+int maw_threads_launch(MediaFile mediafiles[], size_t size,
+                       const MawArguments *args)
+    __attribute__((warn_unused_result));
 
 #endif // MAW_THREADS_H
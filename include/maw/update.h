@@ -3,12 +3,20 @@
 
 #include "maw/maw.h"
 
-int maw_update_load(MawConfig *cfg, MawArguments *args,
-                    MediaFile mediafiles[MAW_MAX_FILES],
-                    size_t *mediafiles_count)
+// Initial number of media files that room is reserved for
+#define MAW_MEDIAFILES_INITIAL_SIZE 64
+
+int maw_update_load(MawConfig *cfg, MawArguments *args, MediaFiles *mediafiles)
+    __attribute__((warn_unused_result));
+void maw_update_dump(const MediaFiles *mediafiles);
+void maw_update_free(MediaFiles *mediafiles);
+int maw_update_check(const MediaFile *mediafile)
+    __attribute__((warn_unused_result));
+void maw_update_report(const MediaFile *mediafile, unsigned int changes);
+int maw_update_noop(const MediaFile *mediafile, bool dry_run)
+    __attribute__((warn_unused_result));
+int maw_update_apply(const MediaFile *mediafile, bool dry_run)
     __attribute__((warn_unused_result));
-void maw_update_dump(MediaFile mediafiles[MAW_MAX_FILES], size_t count);
-void maw_update_free(MediaFile mediafiles[MAW_MAX_FILES], size_t count);
 int maw_update(const MediaFile *mediafile, bool dry_run)
     __attribute__((warn_unused_result));
 
@@ -5,17 +5,51 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <unistd.h>
 
 size_t readfile(const char *filepath, char **out)
     __attribute__((warn_unused_result));
-int movefile(const char *src, const char *dst)
+// Method used by `linkfile()`, from fastest to slowest
+enum LinkStrategy {
+    LINK_STRATEGY_NONE = 0,
+    // Linux only
+    LINK_STRATEGY_REFLINK = 1,
+    LINK_STRATEGY_LINK = 2,
+    // Copies, when `src` and `dst` are on different filesystems
+    LINK_STRATEGY_COPY_FILE_RANGE = 3,
+    LINK_STRATEGY_SENDFILE = 4,
+    // Copy through a user space buffer
+    LINK_STRATEGY_BUFFER = 5,
+};
+
+int linkfile(const char *src, const char *dst, enum LinkStrategy *strategy)
+    __attribute__((warn_unused_result));
+const char *linkfile_strategy_tostr(enum LinkStrategy strategy);
+int mkparents(const char *path, mode_t mode)
+    __attribute__((warn_unused_result));
+int cachepath(const char *name, char *out, size_t size)
     __attribute__((warn_unused_result));
 bool isfile(const char *path);
-bool on_same_device(const char *path1, const char *path2);
+bool isrotational(dev_t dev);
+int physical_offset(const char *path, uint64_t *out)
+    __attribute__((warn_unused_result));
 uint32_t hash(const char *data);
+uint64_t hash64(const void *data, size_t size);
+uint64_t hash64_update(uint64_t digest, const void *data, size_t size);
+uint64_t hash64_update_str(uint64_t digest, const char *s);
 int basename_no_ext(const char *filepath, char *out, size_t outsize)
     __attribute__((warn_unused_result));
 const char *extname(const char *s);
 
+#ifdef __APPLE__
+#define STAT_MTIME_NSEC(s) ((s).st_mtimespec.tv_nsec)
+#else
+#define STAT_MTIME_NSEC(s) ((s).st_mtim.tv_nsec)
+#endif
+
+#define HASH64_INIT 14695981039346656037ULL
+
+#define MAW_COPY_BUFSIZE 1024 * 1024
+
 #endif // MAW_UTILS_H
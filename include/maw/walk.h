@@ -0,0 +1,53 @@
+#ifndef MAW_WALK_H
+#define MAW_WALK_H
+
+#include "maw/maw.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+// Number of threads that read directories, directory reads are latency bound
+// so this does not depend on the number of jobs.
+#define MAW_WALK_THREADS 8
+// Size of the buffer that directory entries are read into
+#define MAW_WALK_BUFSIZE (32 * 1024)
+// Initial number of entries that room is reserved for
+#define MAW_WALK_INITIAL_SIZE 64
+
+// A regular file found during a walk
+struct WalkEntry {
+    char *path;
+    struct stat stat;
+} typedef WalkEntry;
+
+// All regular files beneath a directory, sorted by path
+struct WalkResult {
+    WalkEntry *entries;
+    size_t count;
+    size_t capacity;
+} typedef WalkResult;
+
+// A directory that is waiting to be read
+struct WalkDir {
+    char *path;
+    TAILQ_ENTRY(WalkDir) entry;
+} typedef WalkDir;
+
+struct WalkContext {
+    // Only a failure to read the root directory is fatal, unreadable
+    // sub-directories and entries that vanish during the walk are skipped
+    const char *root;
+    TAILQ_HEAD(WalkDirHead, WalkDir) dirs_head;
+    // Number of directories that are queued or being read
+    size_t pending;
+    bool failed;
+    WalkResult *result;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} typedef WalkContext;
+
+int maw_walk(const char *root, WalkResult *result)
+    __attribute__((warn_unused_result));
+void maw_walk_free(WalkResult *result);
+
+#endif // MAW_WALK_H
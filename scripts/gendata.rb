@@ -131,6 +131,7 @@ end
 # @param artist [String, void]
 # @param cover_color [String, void]
 # @param cover_res [String, void]
+# @param faststart [Boolean] Place the moov box before the mdat box
 def generate_audio(outputfile,
                    title: nil,
                    album: nil,
@@ -138,7 +139,9 @@ def generate_audio(outputfile,
                    cover_color: nil,
                    cover_res: "1280x720",
                    duration: 30,
-                   random_metadata: true)
+                   random_metadata: true,
+                   faststart: false)
+    movflags = faststart ? ["-movflags", "+faststart"] : []
     system_run "ffmpeg", ["-y"] +
                          # Audio source
                          ["-f", "lavfi", "-i", "anullsrc=duration=#{duration}"] +
@@ -149,6 +152,7 @@ def generate_audio(outputfile,
                                            album: album,
                                            artist: artist,
                                            random: random_metadata) +
+                         (cover_color.nil? ? movflags : []) +
                          [outputfile]
     unless cover_color.nil?
         # Add the cover image separately to make sure that -frames:v does
@@ -164,6 +168,7 @@ def generate_audio(outputfile,
                 ["-map", "0", "-c", "copy"] +
                 # Image output
                 ["-map", "1", "-frames:v", "1", "-c:v", "png", "-disposition:1", "attached_pic"] +
+                movflags +
                 [outputfile]
         FileUtils.rm inputfile
     end
@@ -319,6 +324,30 @@ def setup
     generate_audio "#{TOP}/unit/noop_add_cover.m4a"
     generate_audio "#{TOP}/unit/noop_replace_cover.m4a",
                    cover_color: "#00ff00"
+    generate_audio "#{TOP}/unit/patch_inplace.m4a",
+                   cover_color: "#ff8c00"
+    generate_audio "#{TOP}/unit/patch_inplace_faststart.m4a",
+                   cover_color: "#ff8c00",
+                   faststart: true
+    generate_audio "#{TOP}/unit/probe.m4a",
+                   cover_color: "#ffd700"
+    generate_audio "#{TOP}/unit/fingerprint.m4a",
+                   cover_color: "#dc143c"
+    generate_audio "#{TOP}/unit/plan.m4a",
+                   title: "Plan",
+                   artist: "Artist",
+                   album: "Album",
+                   cover_color: "#20b2aa"
+    generate_audio "#{TOP}/unit/output.m4a",
+                   title: "output",
+                   cover_color: "#ff69b4"
+    generate_audio "#{TOP}/unit/keep_mode.m4a",
+                   cover_color: "#8a2be2"
+    (1..2).each do |i|
+        generate_audio "#{TOP}/unit/crop_reuse_#{i}.m4a",
+                       cover_color: "#4682b4",
+                       cover_res: "1280x720"
+    end
 
     # E2E testing data
     ALBUMS.each do |album|
@@ -0,0 +1,139 @@
+#include "maw/arena.h"
+#include "maw/log.h"
+#include "maw/utils.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char **maw_interner_find(char **slots, size_t slot_count,
+                                const char *s);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Allocations are zero-initialized like with calloc()
+void *maw_arena_alloc(MawArena *arena, size_t size) {
+    const size_t header_size = MAW_ARENA_ROUND(sizeof(MawArenaBlock));
+    MawArenaBlock *block = arena->head;
+    size_t block_size;
+    void *p;
+
+    if (size > SIZE_MAX - header_size - MAW_ARENA_ALIGN) {
+        MAW_LOGF(MAW_ERROR, "Arena allocation too large: %zu byte(s)", size);
+        return NULL;
+    }
+    size = MAW_ARENA_ROUND(size);
+
+    if (block == NULL || block->size - block->used < size) {
+        block_size = header_size + size;
+        if (block_size < MAW_ARENA_BLOCK_SIZE)
+            block_size = MAW_ARENA_BLOCK_SIZE;
+
+        block = malloc(block_size);
+        if (block == NULL) {
+            MAW_PERROR("malloc");
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = header_size;
+
+        // An oversized block is placed behind the current block so that the
+        // space left in the current block is still used
+        if (arena->head != NULL && block_size > MAW_ARENA_BLOCK_SIZE) {
+            block->next = arena->head->next;
+            arena->head->next = block;
+        }
+        else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+    }
+
+    p = (char *)block + block->used;
+    block->used += size;
+    memset(p, 0, size);
+
+    return p;
+}
+
+char *maw_arena_strdup(MawArena *arena, const char *s) {
+    size_t size = strlen(s) + 1;
+    char *out;
+
+    out = maw_arena_alloc(arena, size);
+    if (out == NULL)
+        return NULL;
+
+    memcpy(out, s, size);
+    return out;
+}
+
+void maw_arena_free(MawArena *arena) {
+    MawArenaBlock *block;
+
+    while (arena->head != NULL) {
+        block = arena->head;
+        arena->head = block->next;
+        free(block);
+    }
+}
+
+static char **maw_interner_find(char **slots, size_t slot_count,
+                                const char *s) {
+    size_t mask = slot_count - 1;
+    size_t i = (size_t)hash64(s, strlen(s)) & mask;
+
+    for (;;) {
+        if (slots[i] == NULL || strcmp(slots[i], s) == 0)
+            return &slots[i];
+
+        i = (i + 1) & mask;
+    }
+}
+
+// Returns the copy of `s` in the arena of the interner, `s` is only copied
+// the first time that it is seen
+char *maw_intern(MawInterner *interner, const char *s) {
+    char **slots;
+    char **slot;
+    size_t slot_count;
+
+    if ((interner->count + 1) * 2 > interner->slot_count) {
+        slot_count = interner->slot_count > 0 ? interner->slot_count * 2
+                                              : MAW_INTERNER_INITIAL_SIZE;
+        slots = calloc(slot_count, sizeof(char *));
+        if (slots == NULL) {
+            MAW_PERROR("calloc");
+            return NULL;
+        }
+
+        for (size_t i = 0; i < interner->slot_count; i++) {
+            if (interner->slots[i] == NULL)
+                continue;
+            slot = maw_interner_find(slots, slot_count, interner->slots[i]);
+            *slot = interner->slots[i];
+        }
+
+        free(interner->slots);
+        interner->slots = slots;
+        interner->slot_count = slot_count;
+    }
+
+    slot = maw_interner_find(interner->slots, interner->slot_count, s);
+    if (*slot == NULL) {
+        *slot = maw_arena_strdup(interner->arena, s);
+        if (*slot == NULL)
+            return NULL;
+        interner->count++;
+    }
+
+    return *slot;
+}
+
+// Only the table is released, the strings belong to the arena
+void maw_interner_free(MawInterner *interner) {
+    free(interner->slots);
+    interner->slots = NULL;
+    interner->slot_count = 0;
+    interner->count = 0;
+}
@@ -1,5 +1,6 @@
 #include "maw/av.h"
 #include "maw/log.h"
+#include "maw/mp4.h"
 #include "maw/utils.h"
 
 #include <libavfilter/buffersink.h>
@@ -10,66 +11,78 @@
 #include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
 #include <libavutil/rational.h>
+#include <inttypes.h>
+#include <pthread.h>
 
+static int maw_av_load_cover(MawAVContext *ctx);
 static int maw_av_demux_picture_file(MawAVContext *ctx);
 static int maw_av_filter_crop_cover(MawAVContext *ctx);
 static int maw_av_copy_metadata_fields(AVFormatContext *ctx,
                                        const MediaFile *mediafile);
+static bool maw_av_is_unclean_key(const char *key);
 static int maw_av_metadata_check(MawAVContext *ctx);
 static int maw_av_cover_check_crop(MawAVContext *ctx);
 static int maw_av_cover_check(MawAVContext *ctx);
+static int maw_av_fingerprint(MawAVContext *ctx, char *out, size_t size);
+static int maw_av_fingerprint_check(MawAVContext *ctx);
+static int maw_av_fingerprint_write(MawAVContext *ctx);
+static int maw_av_noop_check(MawAVContext *ctx);
+static bool maw_av_field_changes(MawAVContext *ctx, const char *key,
+                                 const char *value);
+static unsigned int maw_av_changes(MawAVContext *ctx);
 static int maw_av_set_metadata(MawAVContext *ctx);
 static int maw_av_demux(MawAVContext *ctx);
+static bool maw_av_metadata_only(MawAVContext *ctx);
+static int maw_av_patch(MawAVContext *ctx);
 static int maw_av_mux(MawAVContext *ctx);
 static int maw_av_init_dec_context(MawAVContext *ctx);
 static int maw_av_init_enc_context(MawAVContext *ctx);
+static bool maw_av_crop_frame(MawAVContext *ctx, AVFrame *frame);
+static int maw_av_filter_crop_frame(MawAVContext *ctx, AVFrame *frame,
+                                    AVFrame *filtered_frame);
+static void maw_av_crop_pipeline_free(MawCropPipeline *pipeline);
+static void maw_av_context_destroy(MawAVContext *ctx);
+static void maw_av_thread_destroy(void *arg);
+static void maw_av_thread_init(void);
+static struct MawAVThread *maw_av_thread(void);
+static int maw_av_crop_pipeline_acquire(MawAVContext *ctx);
+static void maw_av_crop_pipeline_release(MawAVContext *ctx, bool reuse);
+
+TAILQ_HEAD(MawCropPipelineHead, MawCropPipeline);
+
+// Objects owned by one thread that are reused for every file it handles
+struct MawAVThread {
+    // Idle crop pipelines
+    struct MawCropPipelineHead crop_pool;
+    // Context of the previous file, with its scratch packet and frames
+    MawAVContext *idle_ctx;
+} typedef MawAVThread;
+
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+static int thread_key_error = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 
+static int maw_av_load_cover(MawAVContext *ctx) {
+    if (ctx->cover != NULL)
+        return RESULT_OK;
+
+    return maw_cover_get(ctx->mediafile->metadata->cover_path, &ctx->cover);
+}
+
 static int maw_av_demux_picture_file(MawAVContext *ctx) {
     int r = RESULT_ERR_INTERNAL;
     AVStream *output_stream = NULL;
-    enum AVMediaType codec_type;
-
-    // Demux the input file
-    r = avformat_open_input(&(ctx->cover_fmt_ctx),
-                            ctx->mediafile->metadata->cover_path, NULL, NULL);
-    if (r != 0) {
-        MAW_AVERROR(r, ctx->mediafile->metadata->cover_path, NULL);
-        goto end;
-    }
-    r = avformat_find_stream_info(ctx->cover_fmt_ctx, NULL);
-    if (r != 0) {
-        MAW_AVERROR(r, ctx->mediafile->metadata->cover_path, NULL);
-        goto end;
-    }
 
-    if (ctx->cover_fmt_ctx->nb_streams == 0) {
-        MAW_LOGF(MAW_ERROR, "%s: Cover has no input streams",
-                 ctx->mediafile->metadata->cover_path);
-        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
-        goto end;
-    }
-    if (ctx->cover_fmt_ctx->nb_streams > 1) {
-        MAW_LOGF(MAW_ERROR, "%s: Cover has more than one input stream",
-                 ctx->mediafile->metadata->cover_path);
-        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
-        goto end;
-    }
-    codec_type = ctx->cover_fmt_ctx->streams[0]->codecpar->codec_type;
-    if (codec_type != AVMEDIA_TYPE_VIDEO) {
-        MAW_LOGF(MAW_ERROR,
-                 "%s: Cover does not contain a video stream (found %s)",
-                 ctx->mediafile->metadata->cover_path,
-                 av_get_media_type_string(codec_type));
-        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
+    // The cover is only demuxed once per run, see cover.c
+    r = maw_av_load_cover(ctx);
+    if (r != 0)
         goto end;
-    }
 
     output_stream = avformat_new_stream(ctx->output_fmt_ctx, NULL);
 
-    r = avcodec_parameters_copy(output_stream->codecpar,
-                                ctx->cover_fmt_ctx->streams[0]->codecpar);
+    r = avcodec_parameters_copy(output_stream->codecpar, ctx->cover->codecpar);
     if (r != 0) {
         MAW_AVERROR(r, ctx->mediafile->metadata->cover_path, NULL);
         goto end;
@@ -98,6 +111,12 @@ static int maw_av_filter_crop_cover(MawAVContext *ctx) {
         goto end;
     }
 
+    // Reuse the graph from a pooled pipeline
+    if (ctx->filter_graph != NULL) {
+        r = RESULT_OK;
+        goto end;
+    }
+
     ctx->filter_graph = avfilter_graph_alloc();
     if (ctx == NULL) {
         r = AVERROR(ENOMEM);
@@ -171,11 +190,6 @@ static int maw_av_filter_crop_cover(MawAVContext *ctx) {
         goto end;
     }
 
-    // Update relevant values in the output format
-    VIDEO_OUTPUT_STREAM(ctx)->codecpar->width = CROP_DESIRED_WIDTH;
-    VIDEO_OUTPUT_STREAM(ctx)->codecpar->height = CROP_DESIRED_HEIGHT;
-    VIDEO_OUTPUT_STREAM(ctx)->disposition = AV_DISPOSITION_ATTACHED_PIC;
-
     r = RESULT_OK;
 end:
     return r;
@@ -216,6 +230,15 @@ end:
     return r;
 }
 
+// Fields that are removed when CLEAN_POLICY_TRUE is set
+static bool maw_av_is_unclean_key(const char *key) {
+    return !STR_EQ("title", key) && !STR_EQ("artist", key) &&
+           !STR_EQ("album", key) && !STR_EQ("major_brand", key) &&
+           !STR_EQ("minor_version", key) &&
+           !STR_EQ("compatible_brands", key) && !STR_EQ("encoder", key) &&
+           !STR_EQ(MP4_FINGERPRINT_NAME, key);
+}
+
 // Returns `RESULT_NOOP` if the media file already has the desired metadata set.
 static int maw_av_metadata_check(MawAVContext *ctx) {
     int r = RESULT_ERR_INTERNAL;
@@ -252,10 +275,7 @@ static int maw_av_metadata_check(MawAVContext *ctx) {
             }
         }
         else if (ctx->mediafile->metadata->clean_policy == CLEAN_POLICY_TRUE &&
-                 strcmp(entry->key, "major_brand") != 0 &&
-                 strcmp(entry->key, "minor_version") != 0 &&
-                 strcmp(entry->key, "compatible_brands") != 0 &&
-                 strcmp(entry->key, "encoder") != 0) {
+                 maw_av_is_unclean_key(entry->key)) {
             already_configured = false;
         }
     }
@@ -271,19 +291,35 @@ end:
 }
 
 static int maw_av_cover_check_crop(MawAVContext *ctx) {
-    if (ctx->dec_codec_ctx->width == CROP_DESIRED_WIDTH &&
-        ctx->dec_codec_ctx->height == CROP_DESIRED_HEIGHT) {
+    int width;
+    int height;
+
+    // The header probe has no decoder context, the dimensions are only
+    // available from the codec parameters if the container provides them.
+    if (ctx->dec_codec_ctx != NULL) {
+        width = ctx->dec_codec_ctx->width;
+        height = ctx->dec_codec_ctx->height;
+    }
+    else {
+        width = VIDEO_INPUT_STREAM(ctx)->codecpar->width;
+        height = VIDEO_INPUT_STREAM(ctx)->codecpar->height;
+    }
+
+    if (width == 0 || height == 0) {
+        MAW_LOGF(MAW_DEBUG, "%s: Unknown cover dimensions",
+                 ctx->mediafile->path);
+        return RESULT_OK;
+    }
+    else if (width == CROP_DESIRED_WIDTH && height == CROP_DESIRED_HEIGHT) {
         MAW_LOGF(MAW_DEBUG, "%s: Crop filter has already been applied",
                  ctx->mediafile->path);
         return RESULT_NOOP;
     }
-    else if (ctx->dec_codec_ctx->width != CROP_ACCEPTED_WIDTH ||
-             ctx->dec_codec_ctx->height != CROP_ACCEPTED_HEIGHT) {
+    else if (width != CROP_ACCEPTED_WIDTH || height != CROP_ACCEPTED_HEIGHT) {
         MAW_LOGF(MAW_WARN,
                  "%s: Crop filter not applied: unsupported cover "
                  "dimensions: %dx%d",
-                 ctx->mediafile->path, ctx->dec_codec_ctx->width,
-                 ctx->dec_codec_ctx->height);
+                 ctx->mediafile->path, width, height);
         return RESULT_NOOP;
     }
 
@@ -293,17 +329,13 @@ static int maw_av_cover_check_crop(MawAVContext *ctx) {
 // Returns `RESULT_NOOP` if the media file already has the desired cover.
 static int maw_av_cover_check(MawAVContext *ctx) {
     int r = RESULT_ERR_INTERNAL;
-    char *cover_data = NULL;
     AVStream *stream = NULL;
-    size_t read_bytes;
 
     switch (ctx->mediafile->metadata->cover_policy) {
     case COVER_POLICY_PATH:
-        read_bytes =
-            readfile(ctx->mediafile->metadata->cover_path, &cover_data);
-        if (read_bytes == 0) {
+        r = maw_av_load_cover(ctx);
+        if (r != 0)
             goto end;
-        }
 
         if (ctx->input_fmt_ctx->nb_streams != 2) {
             MAW_LOGF(MAW_DEBUG, "%s: No pre-existing video stream",
@@ -317,14 +349,15 @@ static int maw_av_cover_check(MawAVContext *ctx) {
                      ctx->mediafile->path);
             break;
         }
-        if (stream->attached_pic.size != (int)read_bytes) {
+        if (stream->attached_pic.size != (int)ctx->cover->buf->size) {
             MAW_LOGF(MAW_DEBUG, "%s: Incorrect cover size: %d != %zu",
                      ctx->mediafile->path, stream->attached_pic.size,
-                     read_bytes);
+                     (size_t)ctx->cover->buf->size);
             break;
         }
 
-        r = memcmp(stream->attached_pic.data, cover_data, read_bytes);
+        r = memcmp(stream->attached_pic.data, ctx->cover->buf->data,
+                   ctx->cover->buf->size);
         if (r == 0) {
             MAW_LOGF(MAW_DEBUG, "%s: Video stream already configured",
                      ctx->mediafile->metadata->cover_path);
@@ -357,7 +390,149 @@ static int maw_av_cover_check(MawAVContext *ctx) {
 
     r = RESULT_OK;
 end:
-    free(cover_data);
+    return r;
+}
+
+// Digest of the resolved metadata that is applied to the media file, the
+// content of a custom cover is included but not its path.
+static int maw_av_fingerprint(MawAVContext *ctx, char *out, size_t size) {
+    int r = RESULT_ERR_INTERNAL;
+    char title[MAW_PATH_MAX];
+    const Metadata *metadata = ctx->mediafile->metadata;
+    uint64_t digest = HASH64_INIT;
+    int32_t policies[2];
+    uint64_t cover_digest = 0;
+
+    if (metadata->title == NULL) {
+        r = basename_no_ext(ctx->mediafile->path, title, sizeof title);
+        if (r != 0)
+            goto end;
+        digest = hash64_update_str(digest, title);
+    }
+    else {
+        digest = hash64_update_str(digest, metadata->title);
+    }
+    digest = hash64_update_str(digest, metadata->artist);
+    digest = hash64_update_str(digest, metadata->album);
+
+    policies[0] = (int32_t)metadata->cover_policy;
+    policies[1] = (int32_t)metadata->clean_policy;
+    digest = hash64_update(digest, policies, sizeof policies);
+
+    if (metadata->cover_policy == COVER_POLICY_PATH) {
+        r = maw_av_load_cover(ctx);
+        if (r != 0)
+            goto end;
+        cover_digest = ctx->cover->digest;
+    }
+    digest = hash64_update(digest, &cover_digest, sizeof cover_digest);
+
+    r = snprintf(out, size, "%d:%016" PRIx64, MAW_AV_FINGERPRINT_VERSION,
+                 digest);
+    if (r < 0 || (size_t)r >= size) {
+        MAW_LOGF(MAW_ERROR, "%s: Fingerprint truncated", ctx->mediafile->path);
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Returns `RESULT_NOOP` if the fingerprint that maw wrote to the input file
+// matches the current configuration, nothing else needs to be inspected.
+static int maw_av_fingerprint_check(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+    char fingerprint[MAW_AV_FINGERPRINT_SIZE];
+    const AVDictionaryEntry *entry = NULL;
+
+    entry = av_dict_get(ctx->input_fmt_ctx->metadata, MP4_FINGERPRINT_NAME,
+                        NULL, 0);
+    if (entry == NULL) {
+        r = RESULT_OK;
+        goto end;
+    }
+
+    r = maw_av_fingerprint(ctx, fingerprint, sizeof fingerprint);
+    if (r != 0)
+        goto end;
+
+    if (STR_EQ(fingerprint, entry->value)) {
+        MAW_LOGF(MAW_DEBUG, "%s: Fingerprint matches: %s", ctx->mediafile->path,
+                 fingerprint);
+        r = RESULT_NOOP;
+        goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// The mov muxer does not write freeform items, the fingerprint is added to the
+// finished output file instead. The muxer places `moov` last, so it is
+// rewritten where it is and padding is left for later patches.
+static int maw_av_fingerprint_write(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+    char fingerprint[MAW_AV_FINGERPRINT_SIZE];
+    Mp4Tags tags = {0};
+
+    r = maw_av_fingerprint(ctx, fingerprint, sizeof fingerprint);
+    if (r != 0)
+        goto end;
+
+    // Make sure that everything has been written before patching the file
+    r = avio_closep(&(ctx->output_fmt_ctx->pb));
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->output_filepath, "Failed to close output");
+        goto end;
+    }
+
+    tags.fingerprint = fingerprint;
+    // The output file is renamed into place afterwards, nothing is flushed
+    r = maw_mp4_patch(ctx->output_filepath, &tags, false);
+    if (r == RESULT_UNSUPPORTED_LAYOUT) {
+        MAW_LOGF(MAW_DEBUG, "%s: Fingerprint not written",
+                 ctx->mediafile->path);
+        r = RESULT_OK;
+    }
+end:
+    return r;
+}
+
+// Returns `RESULT_NOOP` if neither the metadata nor the streams of the input
+// file need to change. Only relies on information from the container header.
+static int maw_av_noop_check(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+
+    r = maw_av_fingerprint_check(ctx);
+    if (r != RESULT_OK)
+        goto end;
+
+    r = maw_av_metadata_check(ctx);
+    if (r != RESULT_NOOP)
+        goto end;
+
+    if (ctx->video_input_stream_index != -1) {
+        // Return NOOP if the video streams are already configured.
+        if (ctx->input_fmt_ctx->nb_streams != 2) {
+            r = RESULT_OK;
+            goto end;
+        }
+        r = maw_av_cover_check(ctx);
+    }
+    else {
+        // Return NOOP if we have the expected number of streams and
+        // do not need to change the metadata or cover.
+        if (ctx->input_fmt_ctx->nb_streams == 1 &&
+            ctx->mediafile->metadata->cover_policy != COVER_POLICY_PATH) {
+            r = RESULT_NOOP;
+            goto end;
+        }
+        r = RESULT_OK;
+    }
+end:
     return r;
 }
 
@@ -406,7 +581,6 @@ static int maw_av_demux(MawAVContext *ctx) {
     AVStream *input_stream = NULL;
     enum AVMediaType codec_type;
     bool is_attached_pic;
-    bool metadata_already_configured;
 
     // Always add the audio stream first, i.e. output stream 0 will always be
     // the audio stream!
@@ -482,11 +656,6 @@ static int maw_av_demux(MawAVContext *ctx) {
         output_stream->disposition = input_stream->disposition;
     }
 
-    r = maw_av_metadata_check(ctx);
-    if (r != RESULT_OK && r != RESULT_NOOP)
-        goto end;
-    metadata_already_configured = r == RESULT_NOOP;
-
     MAW_LOGF(MAW_DEBUG, "%s: Audio input stream #%ld", ctx->mediafile->path,
              ctx->audio_input_stream_index);
 
@@ -496,38 +665,167 @@ static int maw_av_demux(MawAVContext *ctx) {
 
         // Initialize decoder context for cropping
         if (ctx->mediafile->metadata->cover_policy == COVER_POLICY_CROP) {
-            r = maw_av_init_dec_context(ctx);
+            r = maw_av_crop_pipeline_acquire(ctx);
             if (r != 0)
                 goto end;
         }
-
-        // Return NOOP if the video streams are already configured.
-        if (metadata_already_configured &&
-            ctx->input_fmt_ctx->nb_streams == 2) {
-            r = maw_av_cover_check(ctx);
-            if (r == RESULT_NOOP) {
-                // OK: there is no need to remux this file
-                goto end;
-            }
-            else if (r != RESULT_OK) {
-                goto end;
-            }
-        }
     }
     else {
         MAW_LOGF(MAW_DEBUG, "%s: Video input stream (none)",
                  ctx->mediafile->path);
+    }
 
-        // Return NOOP if we have the expected number of streams and
-        // do not need to change the metadata or cover.
-        if (metadata_already_configured &&
-            ctx->input_fmt_ctx->nb_streams == 1 &&
-            ctx->mediafile->metadata->cover_policy != COVER_POLICY_PATH) {
-            r = RESULT_NOOP;
-            goto end;
+    r = maw_av_noop_check(ctx);
+    if (r != RESULT_OK)
+        goto end;
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Returns true if the streams of the input file can be kept exactly as they
+// are, i.e. only the title/artist/album tags need to change. Should only be
+// called after a successful `maw_av_demux()`.
+static bool maw_av_metadata_only(MawAVContext *ctx) {
+    int r;
+    const AVDictionaryEntry *entry = NULL;
+    unsigned int kept_streams =
+        ctx->video_input_stream_index != -1 ? 2 : 1;
+
+    // All input streams need to be part of the output
+    if (ctx->input_fmt_ctx->nb_streams != kept_streams)
+        return false;
+
+    // Fields that need to be removed are left to the remux
+    if (ctx->mediafile->metadata->clean_policy == CLEAN_POLICY_TRUE) {
+        while ((entry = av_dict_iterate(ctx->input_fmt_ctx->metadata, entry))) {
+            if (maw_av_is_unclean_key(entry->key))
+                return false;
         }
     }
 
+    switch (ctx->mediafile->metadata->cover_policy) {
+    case COVER_POLICY_PATH:
+        if (ctx->video_input_stream_index == -1)
+            return false;
+        r = maw_av_cover_check(ctx);
+        return r == RESULT_NOOP;
+    case COVER_POLICY_CROP:
+        if (ctx->video_input_stream_index == -1)
+            return true;
+        r = maw_av_cover_check_crop(ctx);
+        return r == RESULT_NOOP;
+    case COVER_POLICY_CLEAR:
+        return ctx->video_input_stream_index == -1;
+    case COVER_POLICY_UNSPECIFIED:
+    case COVER_POLICY_KEEP:
+        return true;
+    }
+
+    return false;
+}
+
+// Write the configured tags directly into the input file, the same tag values
+// are used as in `maw_av_copy_metadata_fields()`.
+static int maw_av_patch(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+    char title[MAW_PATH_MAX];
+    char fingerprint[MAW_AV_FINGERPRINT_SIZE];
+    const Metadata *metadata = ctx->mediafile->metadata;
+    Mp4Tags tags = {
+        .title = metadata->title,
+        .fingerprint = fingerprint,
+        // Unset fields are removed, like `av_dict_set()` with a NULL value
+        .artist = metadata->artist == NULL ? "" : metadata->artist,
+        .album = metadata->album == NULL ? "" : metadata->album,
+        .clean = metadata->clean_policy == CLEAN_POLICY_TRUE,
+    };
+
+    if (tags.title == NULL) {
+        r = basename_no_ext(ctx->mediafile->path, title, sizeof title);
+        if (r != 0)
+            goto end;
+        tags.title = title;
+    }
+
+    r = maw_av_fingerprint(ctx, fingerprint, sizeof fingerprint);
+    if (r != 0)
+        goto end;
+
+    r = maw_mp4_patch(ctx->mediafile->path, &tags, true);
+end:
+    return r;
+}
+
+// Crop the decoded frame in place by moving the plane pointers and reducing
+// the dimensions, no pixels are copied. Returns false if the pixel format does
+// not allow this, the frame is left unmodified in that case.
+static bool maw_av_crop_frame(MawAVContext *ctx, AVFrame *frame) {
+    int r;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    size_t x_offset = (CROP_ACCEPTED_WIDTH - CROP_DESIRED_WIDTH) / 2;
+
+    // `av_frame_apply_cropping()` ignores the left/top crop for these
+    if (desc == NULL ||
+        desc->flags & (AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))
+        return false;
+
+    if (frame->width != CROP_ACCEPTED_WIDTH ||
+        frame->height != CROP_ACCEPTED_HEIGHT)
+        return false;
+
+    frame->crop_left = x_offset;
+    frame->crop_right = CROP_ACCEPTED_WIDTH - CROP_DESIRED_WIDTH - x_offset;
+    frame->crop_top = 0;
+    frame->crop_bottom = CROP_ACCEPTED_HEIGHT - CROP_DESIRED_HEIGHT;
+
+    r = av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED);
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->mediafile->path, "Failed to crop frame");
+        frame->crop_left = 0;
+        frame->crop_right = 0;
+        frame->crop_bottom = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Fallback for `maw_av_crop_frame()`: push the frame through the crop filter
+// graph, the graph is created on first use.
+static int maw_av_filter_crop_frame(MawAVContext *ctx, AVFrame *frame,
+                                    AVFrame *filtered_frame) {
+    int r = RESULT_ERR_INTERNAL;
+
+    MAW_LOGF(MAW_DEBUG, "%s: Applying crop filter", ctx->mediafile->path);
+
+    // Initialize a filter to crop the existing video stream
+    r = maw_av_filter_crop_cover(ctx);
+    if (r != 0)
+        goto end;
+
+    // Push the frame into the filter graph
+    r = av_buffersrc_add_frame(ctx->filter_buffersrc_ctx, frame);
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->mediafile->path, "Error feeding the filtergraph");
+        goto end;
+    }
+
+    // Pull filtered frames from the filtergraph
+    r = av_buffersink_get_frame(ctx->filter_buffersink_ctx, filtered_frame);
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->mediafile->path, "Failed to read filtered frame");
+        goto end;
+    }
+
+    // Verify that there are not more filtered frames to process
+    r = av_buffersink_get_frame(ctx->filter_buffersink_ctx, NULL);
+    if (r != AVERROR(EAGAIN)) {
+        MAW_LOG(MAW_ERROR, "Did not read all frames from stream");
+        goto end;
+    }
+
     r = RESULT_OK;
 end:
     return r;
@@ -537,15 +835,44 @@ static int maw_av_mux_crop(MawAVContext *ctx, AVPacket *pkt) {
     int r = RESULT_ERR_INTERNAL;
     AVFrame *filtered_frame = NULL;
     AVFrame *frame = NULL;
+    AVFrame *output_frame = NULL;
+    AVBufferRef *cropped = NULL;
+    MawCrop *pending = NULL;
+
+    // Files with the same cover only need to be cropped once
+    r = maw_cover_crop_get(pkt, &cropped, &pending);
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->mediafile->path, "Failed to look up crop");
+        goto end;
+    }
+
+    if (cropped != NULL) {
+        MAW_LOGF(MAW_DEBUG, "%s: Reusing cropped cover", ctx->mediafile->path);
+        av_packet_unref(pkt);
+        pkt->buf = cropped;
+        pkt->data = cropped->data;
+        pkt->size = (int)cropped->size;
+        pkt->flags |= AV_PKT_FLAG_KEY;
+        pkt->pos = -1;
+        pkt->pts = AV_NOPTS_VALUE;
+        pkt->stream_index = VIDEO_OUTPUT_STREAM_INDEX;
+        r = RESULT_OK;
+        goto end;
+    }
 
-    // Create an encoder context to translate the output frames from the
-    // filtergraph back into packets
+    // Create an encoder context to translate the cropped frames back into
+    // packets
     r = maw_av_init_enc_context(ctx);
     if (r != 0)
         goto end;
 
-    frame = av_frame_alloc();
-    filtered_frame = av_frame_alloc();
+    // The frames are kept in the context and reused for the next file
+    if (ctx->frame == NULL)
+        ctx->frame = av_frame_alloc();
+    if (ctx->filtered_frame == NULL)
+        ctx->filtered_frame = av_frame_alloc();
+    frame = ctx->frame;
+    filtered_frame = ctx->filtered_frame;
     if (frame == NULL || filtered_frame == NULL) {
         r = AVERROR(ENOMEM);
         MAW_AVERROR(r, ctx->mediafile->path,
@@ -572,28 +899,25 @@ static int maw_av_mux_crop(MawAVContext *ctx, AVPacket *pkt) {
         goto end;
     }
 
-    // Push the frame into the filter graph
-    r = av_buffersrc_add_frame(ctx->filter_buffersrc_ctx, frame);
-    if (r != 0) {
-        MAW_AVERROR(r, ctx->mediafile->path, "Error feeding the filtergraph");
-        goto end;
+    // Crop the decoded frame directly, the filter graph is only used for
+    // pixel formats that do not support it.
+    if (ctx->filter_graph == NULL && maw_av_crop_frame(ctx, frame)) {
+        MAW_LOGF(MAW_DEBUG, "%s: Cropped frame in place", ctx->mediafile->path);
+        output_frame = frame;
     }
-    av_frame_free(&frame);
-
-    // Pull filtered frames from the filtergraph
-    r = av_buffersink_get_frame(ctx->filter_buffersink_ctx, filtered_frame);
-    if (r != 0) {
-        MAW_AVERROR(r, ctx->mediafile->path, "Failed to read filtered frame");
-        goto end;
+    else {
+        r = maw_av_filter_crop_frame(ctx, frame, filtered_frame);
+        if (r != 0)
+            goto end;
+        output_frame = filtered_frame;
     }
 
     // Encode the frame into a packet
-    r = avcodec_send_frame(ctx->enc_codec_ctx, filtered_frame);
+    r = avcodec_send_frame(ctx->enc_codec_ctx, output_frame);
     if (r != 0) {
         MAW_AVERROR(r, ctx->mediafile->path, "Error sending frame to encoder");
         goto end;
     }
-    av_frame_free(&filtered_frame);
 
     // Read back the encoded packet
     av_packet_unref(pkt);
@@ -608,17 +932,17 @@ static int maw_av_mux_crop(MawAVContext *ctx, AVPacket *pkt) {
     pkt->pts = AV_NOPTS_VALUE;
     pkt->stream_index = VIDEO_OUTPUT_STREAM_INDEX;
 
-    // Verify that there are not more filtered frames to process
-    r = av_buffersink_get_frame(ctx->filter_buffersink_ctx, filtered_frame);
-    if (r != AVERROR(EAGAIN)) {
-        MAW_LOG(MAW_ERROR, "Did not read all frames from stream");
-        goto end;
-    }
+    maw_cover_crop_set(pending, pkt);
+    pending = NULL;
 
     r = RESULT_OK;
 end:
-    av_frame_free(&frame);
-    av_frame_free(&filtered_frame);
+    if (pending != NULL)
+        maw_cover_crop_set(pending, NULL);
+    if (frame != NULL)
+        av_frame_unref(frame);
+    if (filtered_frame != NULL)
+        av_frame_unref(filtered_frame);
     return r;
 }
 
@@ -632,14 +956,23 @@ static int maw_av_mux(MawAVContext *ctx) {
     // actual raw data. Filters can not be applied directly on packets, we
     // need to decode them into frames and re-encode them back into packets.
     AVPacket *pkt = NULL;
+    AVDictionary *options = NULL;
     bool should_crop =
         ctx->mediafile->metadata->cover_policy == COVER_POLICY_CROP &&
         ctx->video_input_stream_index != -1 &&
         ctx->dec_codec_ctx->width == CROP_ACCEPTED_WIDTH &&
         ctx->dec_codec_ctx->height == CROP_ACCEPTED_HEIGHT;
 
-    r = avio_open(&(ctx->output_fmt_ctx->pb), ctx->output_filepath,
-                  AVIO_FLAG_WRITE);
+    // The output file has already been created (and preallocated) by the
+    // caller, truncating it would release the preallocated space.
+    r = av_dict_set(&options, "truncate", "0", 0);
+    if (r != 0) {
+        MAW_AVERROR(r, ctx->mediafile->path, NULL);
+        goto end;
+    }
+
+    r = avio_open2(&(ctx->output_fmt_ctx->pb), ctx->output_filepath,
+                   AVIO_FLAG_WRITE, NULL, &options);
     if (r != 0) {
         MAW_AVERROR(r, ctx->mediafile->path, NULL);
         goto end;
@@ -651,7 +984,10 @@ static int maw_av_mux(MawAVContext *ctx) {
         goto end;
     }
 
-    pkt = av_packet_alloc();
+    // The packet is kept in the context and reused for the next file
+    if (ctx->pkt == NULL)
+        ctx->pkt = av_packet_alloc();
+    pkt = ctx->pkt;
     if (pkt == NULL) {
         MAW_LOGF(MAW_ERROR, "%s: Failed to allocate packet",
                  ctx->mediafile->path);
@@ -725,27 +1061,26 @@ static int maw_av_mux(MawAVContext *ctx) {
         // http://dranger.com/ffmpeg/tutorial05.html
     }
 
-    // Mux streams from cover
-    while (ctx->cover_fmt_ctx != NULL) {
-        r = av_read_frame(ctx->cover_fmt_ctx, pkt);
-        if (r != 0) {
-            break; // No more frames
-        }
-
-        if (pkt->stream_index != 0) {
-            r = RESULT_ERR_INTERNAL;
-            MAW_LOGF(MAW_ERROR, "Unexpected packet from cover stream #%d",
-                     pkt->stream_index);
+    // Mux the cover straight from the cached file contents
+    if (ctx->cover != NULL) {
+        pkt->buf = av_buffer_ref(ctx->cover->buf);
+        if (pkt->buf == NULL) {
+            r = AVERROR(ENOMEM);
+            MAW_AVERROR(r, ctx->mediafile->path, "Failed to reference cover");
             goto end;
         }
-
+        pkt->data = pkt->buf->data;
+        pkt->size = (int)pkt->buf->size;
+        pkt->pts = 0;
+        pkt->dts = 0;
+        pkt->flags |= AV_PKT_FLAG_KEY;
         pkt->stream_index = VIDEO_OUTPUT_STREAM_INDEX;
         pkt->pos = -1;
 
         r = av_interleaved_write_frame(ctx->output_fmt_ctx, pkt);
         if (r != 0) {
             MAW_AVERROR(r, ctx->mediafile->path, "Failed to mux packet");
-            break;
+            goto end;
         }
     }
 
@@ -757,7 +1092,9 @@ static int maw_av_mux(MawAVContext *ctx) {
 
     r = RESULT_OK;
 end:
-    av_packet_free(&pkt);
+    av_dict_free(&options);
+    if (pkt != NULL)
+        av_packet_unref(pkt);
     return r;
 }
 
@@ -811,6 +1148,12 @@ static int maw_av_init_enc_context(MawAVContext *ctx) {
     int r = RESULT_ERR_INTERNAL;
     const AVCodec *enc_codec = NULL;
 
+    // Reuse the encoder from a pooled pipeline
+    if (ctx->enc_codec_ctx != NULL) {
+        r = RESULT_OK;
+        goto end;
+    }
+
     enc_codec =
         avcodec_find_encoder(VIDEO_INPUT_STREAM(ctx)->codecpar->codec_id);
     if (enc_codec == NULL) {
@@ -847,9 +1190,360 @@ end:
     return r;
 }
 
-// The remux process only applies a filter when COVER_POLICY_CROP is set,
-// otherwise a "Stream copy", see ffmpeg(1), is performed.
-int maw_av_remux(MawAVContext *ctx) {
+// Lightweight check that only parses the container header with the mov demuxer,
+// i.e. `avformat_find_stream_info()` is never called. Returns `RESULT_NOOP`
+// if the media file is known to be up to date, `RESULT_OK` if the file needs
+// an update or if the probe cannot decide, errors are left for the full
+// remux to report.
+int maw_av_probe(const MediaFile *mediafile) {
+    int r = RESULT_ERR_INTERNAL;
+    MawAVContext ctx = {0};
+    const AVInputFormat *input_fmt = NULL;
+    AVStream *stream = NULL;
+
+    ctx.mediafile = mediafile;
+    ctx.audio_input_stream_index = -1;
+    ctx.video_input_stream_index = -1;
+
+    input_fmt = av_find_input_format("mov");
+    if (input_fmt == NULL) {
+        r = RESULT_OK;
+        goto end;
+    }
+
+    r = avformat_open_input(&ctx.input_fmt_ctx, mediafile->path, input_fmt,
+                            NULL);
+    if (r != 0) {
+        MAW_LOGF(MAW_DEBUG, "%s: Header probe failed", mediafile->path);
+        r = RESULT_OK;
+        goto end;
+    }
+
+    // Select streams the same way as `maw_av_demux()`
+    for (ssize_t i = 0; i < ctx.input_fmt_ctx->nb_streams; i++) {
+        stream = ctx.input_fmt_ctx->streams[i];
+        if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (ctx.audio_input_stream_index == -1)
+                ctx.audio_input_stream_index = i;
+        }
+        else if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+                 stream->disposition == AV_DISPOSITION_ATTACHED_PIC &&
+                 mediafile->metadata->cover_policy != COVER_POLICY_CLEAR) {
+            if (ctx.video_input_stream_index == -1)
+                ctx.video_input_stream_index = i;
+        }
+    }
+
+    if (ctx.audio_input_stream_index == -1) {
+        r = RESULT_OK;
+        goto end;
+    }
+
+    r = maw_av_noop_check(&ctx);
+    if (r != RESULT_NOOP)
+        r = RESULT_OK;
+end:
+    maw_cover_put(ctx.cover);
+    avformat_close_input(&ctx.input_fmt_ctx);
+    return r;
+}
+
+// Returns true if `key` would be set to another value than it has now, unset
+// fields are kept as is like in `maw_av_metadata_check()`.
+static bool maw_av_field_changes(MawAVContext *ctx, const char *key,
+                                 const char *value) {
+    const AVDictionaryEntry *entry = NULL;
+
+    entry = av_dict_get(ctx->input_fmt_ctx->metadata, key, NULL, 0);
+    return !LHS_EMPTY_OR_EQ(value, entry == NULL ? "" : entry->value);
+}
+
+// Should only be called after `maw_av_demux()` found that changes are needed
+static unsigned int maw_av_changes(MawAVContext *ctx) {
+    int r;
+    unsigned int changes = 0;
+    char title[MAW_PATH_MAX];
+    const Metadata *metadata = ctx->mediafile->metadata;
+    const AVDictionaryEntry *entry = NULL;
+    const AVStream *stream;
+
+    if (metadata->title != NULL) {
+        if (maw_av_field_changes(ctx, "title", metadata->title))
+            changes |= MAW_AV_CHANGE_TITLE;
+    }
+    else if (basename_no_ext(ctx->mediafile->path, title, sizeof title) == 0 &&
+             maw_av_field_changes(ctx, "title", title)) {
+        changes |= MAW_AV_CHANGE_TITLE;
+    }
+    if (maw_av_field_changes(ctx, "artist", metadata->artist))
+        changes |= MAW_AV_CHANGE_ARTIST;
+    if (maw_av_field_changes(ctx, "album", metadata->album))
+        changes |= MAW_AV_CHANGE_ALBUM;
+
+    if (metadata->clean_policy == CLEAN_POLICY_TRUE) {
+        while ((entry = av_dict_iterate(ctx->input_fmt_ctx->metadata, entry))) {
+            if (maw_av_is_unclean_key(entry->key)) {
+                changes |= MAW_AV_CHANGE_CLEAN;
+                break;
+            }
+        }
+    }
+
+    for (ssize_t i = 0; i < ctx->input_fmt_ctx->nb_streams; i++) {
+        stream = ctx->input_fmt_ctx->streams[i];
+        if (i == ctx->audio_input_stream_index ||
+            i == ctx->video_input_stream_index) {
+            continue;
+        }
+        if (metadata->cover_policy == COVER_POLICY_CLEAR &&
+            stream->disposition == AV_DISPOSITION_ATTACHED_PIC) {
+            changes |= MAW_AV_CHANGE_COVER;
+        }
+        else {
+            changes |= MAW_AV_CHANGE_STREAMS;
+        }
+    }
+
+    switch (metadata->cover_policy) {
+    case COVER_POLICY_PATH:
+        r = maw_av_cover_check(ctx);
+        if (r != RESULT_NOOP)
+            changes |= MAW_AV_CHANGE_COVER;
+        break;
+    case COVER_POLICY_CROP:
+        if (ctx->video_input_stream_index != -1 &&
+            maw_av_cover_check_crop(ctx) == RESULT_OK) {
+            changes |= MAW_AV_CHANGE_CROP;
+        }
+        break;
+    case COVER_POLICY_CLEAR:
+    case COVER_POLICY_UNSPECIFIED:
+    case COVER_POLICY_KEEP:
+        break;
+    }
+
+    return changes;
+}
+
+// Work out what `maw_av_remux()` would change without writing anything.
+// Stops after the same checks as `maw_av_demux()`, `changes` is set to a
+// combination of `MawAVChange` flags.
+int maw_av_plan(const MediaFile *mediafile, unsigned int *changes) {
+    int r = RESULT_ERR_INTERNAL;
+    MawAVContext *ctx = NULL;
+
+    *changes = 0;
+
+    // The output context is only used to guess the format, nothing is opened
+    ctx = maw_av_init_context(mediafile, mediafile->path);
+    if (ctx == NULL)
+        goto end;
+    ctx->output_filepath = NULL;
+
+    r = maw_av_demux(ctx);
+    if (r != RESULT_OK)
+        goto end;
+
+    *changes = maw_av_changes(ctx);
+    if (*changes == 0) {
+        r = RESULT_NOOP;
+        goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    if (ctx != NULL)
+        maw_av_crop_pipeline_release(ctx, r == RESULT_OK || r == RESULT_NOOP);
+    maw_av_free_context(ctx);
+    return r;
+}
+
+const char *maw_av_change_tostr(enum MawAVChange change) {
+    switch (change) {
+    case MAW_AV_CHANGE_TITLE:
+        return "title";
+    case MAW_AV_CHANGE_ARTIST:
+        return "artist";
+    case MAW_AV_CHANGE_ALBUM:
+        return "album";
+    case MAW_AV_CHANGE_CLEAN:
+        return "clean";
+    case MAW_AV_CHANGE_COVER:
+        return "cover";
+    case MAW_AV_CHANGE_CROP:
+        return "crop";
+    case MAW_AV_CHANGE_STREAMS:
+        return "streams";
+    }
+    return "unknown";
+}
+
+static void maw_av_crop_pipeline_free(MawCropPipeline *pipeline) {
+    avcodec_free_context(&pipeline->enc_codec_ctx);
+    avcodec_free_context(&pipeline->dec_codec_ctx);
+    avfilter_graph_free(&pipeline->filter_graph);
+    free(pipeline);
+}
+
+static void maw_av_context_destroy(MawAVContext *ctx) {
+    if (ctx == NULL)
+        return;
+
+    av_packet_free(&ctx->pkt);
+    av_frame_free(&ctx->frame);
+    av_frame_free(&ctx->filtered_frame);
+    free(ctx);
+}
+
+static void maw_av_thread_destroy(void *arg) {
+    MawAVThread *thread = arg;
+    MawCropPipeline *pipeline = NULL;
+
+    while ((pipeline = TAILQ_FIRST(&thread->crop_pool)) != NULL) {
+        TAILQ_REMOVE(&thread->crop_pool, pipeline, entry);
+        maw_av_crop_pipeline_free(pipeline);
+    }
+    maw_av_context_destroy(thread->idle_ctx);
+    free(thread);
+}
+
+static void maw_av_thread_init(void) {
+    thread_key_error = pthread_key_create(&thread_key, maw_av_thread_destroy);
+}
+
+// Returns the state of the calling thread, NULL if reuse is unavailable
+static MawAVThread *maw_av_thread(void) {
+    MawAVThread *thread = NULL;
+
+    if (pthread_once(&thread_once, maw_av_thread_init) != 0 ||
+        thread_key_error != 0)
+        return NULL;
+
+    thread = pthread_getspecific(thread_key);
+    if (thread != NULL)
+        return thread;
+
+    thread = calloc(1, sizeof(MawAVThread));
+    if (thread == NULL)
+        return NULL;
+    TAILQ_INIT(&thread->crop_pool);
+
+    if (pthread_setspecific(thread_key, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+// Take a pipeline that matches the video input stream from the pool of the
+// calling thread, a new pipeline with a decoder is created if there is none.
+static int maw_av_crop_pipeline_acquire(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+    MawAVThread *thread = NULL;
+    struct MawCropPipelineHead *pool = NULL;
+    MawCropPipeline *pipeline = NULL;
+    const AVCodecParameters *codecpar = VIDEO_INPUT_STREAM(ctx)->codecpar;
+
+    thread = maw_av_thread();
+    pool = thread != NULL ? &thread->crop_pool : NULL;
+    if (pool != NULL) {
+        TAILQ_FOREACH(pipeline, pool, entry) {
+            if (pipeline->codec_id == codecpar->codec_id &&
+                pipeline->width == codecpar->width &&
+                pipeline->height == codecpar->height &&
+                pipeline->pix_fmt == codecpar->format)
+                break;
+        }
+    }
+
+    if (pipeline != NULL) {
+        TAILQ_REMOVE(pool, pipeline, entry);
+        MAW_LOGF(MAW_DEBUG, "%s: Reusing crop pipeline", ctx->mediafile->path);
+
+        ctx->dec_codec_ctx = pipeline->dec_codec_ctx;
+        ctx->enc_codec_ctx = pipeline->enc_codec_ctx;
+        ctx->filter_graph = pipeline->filter_graph;
+        ctx->filter_buffersrc_ctx = pipeline->filter_buffersrc_ctx;
+        ctx->filter_buffersink_ctx = pipeline->filter_buffersink_ctx;
+        ctx->crop_pipeline = pipeline;
+        r = RESULT_OK;
+        goto end;
+    }
+
+    pipeline = calloc(1, sizeof(MawCropPipeline));
+    if (pipeline == NULL) {
+        r = AVERROR(ENOMEM);
+        MAW_AVERROR(r, ctx->mediafile->path,
+                    "Failed to allocate crop pipeline");
+        goto end;
+    }
+    pipeline->codec_id = codecpar->codec_id;
+    pipeline->width = codecpar->width;
+    pipeline->height = codecpar->height;
+    pipeline->pix_fmt = codecpar->format;
+    ctx->crop_pipeline = pipeline;
+
+    r = maw_av_init_dec_context(ctx);
+end:
+    return r;
+}
+
+// Hand the filtering variables back to the pool of the calling thread, the
+// pipeline is freed instead if it can not be reused, e.g. after an error.
+static void maw_av_crop_pipeline_release(MawAVContext *ctx, bool reuse) {
+    MawAVThread *thread = NULL;
+    struct MawCropPipelineHead *pool = NULL;
+    MawCropPipeline *pipeline = ctx->crop_pipeline;
+
+    if (pipeline == NULL)
+        return;
+
+    pipeline->dec_codec_ctx = ctx->dec_codec_ctx;
+    pipeline->enc_codec_ctx = ctx->enc_codec_ctx;
+    pipeline->filter_graph = ctx->filter_graph;
+    pipeline->filter_buffersrc_ctx = ctx->filter_buffersrc_ctx;
+    pipeline->filter_buffersink_ctx = ctx->filter_buffersink_ctx;
+
+    ctx->dec_codec_ctx = NULL;
+    ctx->enc_codec_ctx = NULL;
+    ctx->filter_graph = NULL;
+    ctx->filter_buffersrc_ctx = NULL;
+    ctx->filter_buffersink_ctx = NULL;
+    ctx->crop_pipeline = NULL;
+
+    thread = reuse ? maw_av_thread() : NULL;
+    pool = thread != NULL ? &thread->crop_pool : NULL;
+    if (pool == NULL || pipeline->dec_codec_ctx == NULL) {
+        maw_av_crop_pipeline_free(pipeline);
+        return;
+    }
+
+    // Drop any state left from the previous file
+    avcodec_flush_buffers(pipeline->dec_codec_ctx);
+    TAILQ_INSERT_TAIL(pool, pipeline, entry);
+}
+
+// Free the reusable objects of the calling thread, the objects of other
+// threads are freed when they exit.
+void maw_av_thread_free(void) {
+    MawAVThread *thread = NULL;
+
+    if (pthread_once(&thread_once, maw_av_thread_init) != 0 ||
+        thread_key_error != 0)
+        return;
+
+    thread = pthread_getspecific(thread_key);
+    if (thread == NULL)
+        return;
+
+    maw_av_thread_destroy(thread);
+    (void)pthread_setspecific(thread_key, NULL);
+}
+
+// First stage of a remux: demux the input file and patch it in place if only
+// the metadata changes. `ctx->patched` is set if that succeeded, otherwise the
+// caller creates the output file and continues with `maw_av_remux()`.
+int maw_av_prepare(MawAVContext *ctx) {
     int r = RESULT_ERR_INTERNAL;
 
     // Find the indices of the video and audio stream and create
@@ -863,6 +1557,33 @@ int maw_av_remux(MawAVContext *ctx) {
         goto end;
     }
 
+    // Rewrite the tags in place if the streams do not need to change
+    if (ctx->patch_inplace && maw_av_metadata_only(ctx)) {
+        r = maw_av_patch(ctx);
+        if (r == RESULT_OK) {
+            ctx->patched = true;
+            goto end;
+        }
+        else if (r != RESULT_UNSUPPORTED_LAYOUT) {
+            goto end;
+        }
+        MAW_LOGF(MAW_DEBUG, "%s: Cannot patch in place, remuxing",
+                 ctx->mediafile->path);
+    }
+
+    r = RESULT_OK;
+end:
+    if (r != RESULT_OK || ctx->patched)
+        maw_av_crop_pipeline_release(ctx, r == RESULT_OK || r == RESULT_NOOP);
+    return r;
+}
+
+// The remux process only applies a filter when COVER_POLICY_CROP is set,
+// otherwise a "Stream copy", see ffmpeg(1), is performed. Should only be
+// called after `maw_av_prepare()` with `ctx->output_filepath` set.
+int maw_av_remux(MawAVContext *ctx) {
+    int r = RESULT_ERR_INTERNAL;
+
     // Only try to crop if there is a valid input video stream...
     if (ctx->mediafile->metadata->cover_policy == COVER_POLICY_CROP &&
         ctx->video_input_stream_index != -1) {
@@ -870,12 +1591,13 @@ int maw_av_remux(MawAVContext *ctx) {
         r = maw_av_cover_check_crop(ctx);
 
         if (r == RESULT_OK) {
-            MAW_LOGF(MAW_DEBUG, "%s: Applying crop filter",
-                     ctx->mediafile->path);
-            // Initialize a filter to crop the existing video stream
-            r = maw_av_filter_crop_cover(ctx);
-            if (r != 0)
-                goto end;
+            // The filter graph is only created in `maw_av_mux_crop()` if the
+            // cover has not been cropped already, the output dimensions need
+            // to be known before the header is written.
+            VIDEO_OUTPUT_STREAM(ctx)->codecpar->width = CROP_DESIRED_WIDTH;
+            VIDEO_OUTPUT_STREAM(ctx)->codecpar->height = CROP_DESIRED_HEIGHT;
+            VIDEO_OUTPUT_STREAM(ctx)->disposition =
+                AV_DISPOSITION_ATTACHED_PIC;
         }
     }
     else if (ctx->mediafile->metadata->cover_policy == COVER_POLICY_PATH) {
@@ -898,12 +1620,24 @@ int maw_av_remux(MawAVContext *ctx) {
     if (r != 0)
         goto end;
 
+    r = maw_av_fingerprint_write(ctx);
+    if (r != 0)
+        goto end;
+
     r = RESULT_OK;
 end:
+    maw_av_crop_pipeline_release(ctx, r == RESULT_OK || r == RESULT_NOOP);
     return r;
 }
 
+// The context is kept by the calling thread for the next file, only the
+// per-file state is released.
 void maw_av_free_context(MawAVContext *ctx) {
+    MawAVThread *thread = NULL;
+    AVPacket *pkt;
+    AVFrame *frame;
+    AVFrame *filtered_frame;
+
     if (ctx == NULL)
         return;
 
@@ -912,10 +1646,7 @@ void maw_av_free_context(MawAVContext *ctx) {
         avformat_free_context(ctx->input_fmt_ctx);
     }
 
-    avformat_close_input(&ctx->cover_fmt_ctx);
-    if (ctx->cover_fmt_ctx != NULL) {
-        avformat_free_context(ctx->cover_fmt_ctx);
-    }
+    maw_cover_put(ctx->cover);
 
     if (ctx->output_fmt_ctx != NULL) {
         if (ctx->output_fmt_ctx->oformat != NULL &&
@@ -925,17 +1656,39 @@ void maw_av_free_context(MawAVContext *ctx) {
         avformat_free_context(ctx->output_fmt_ctx);
     }
 
+    maw_av_crop_pipeline_release(ctx, false);
     avcodec_free_context(&ctx->enc_codec_ctx);
     avcodec_free_context(&ctx->dec_codec_ctx);
     avfilter_graph_free(&ctx->filter_graph);
 
-    free(ctx);
+    thread = maw_av_thread();
+    if (thread == NULL || thread->idle_ctx != NULL) {
+        maw_av_context_destroy(ctx);
+        return;
+    }
+
+    pkt = ctx->pkt;
+    frame = ctx->frame;
+    filtered_frame = ctx->filtered_frame;
+    if (pkt != NULL)
+        av_packet_unref(pkt);
+    if (frame != NULL)
+        av_frame_unref(frame);
+    if (filtered_frame != NULL)
+        av_frame_unref(filtered_frame);
+
+    memset(ctx, 0, sizeof(MawAVContext));
+    ctx->pkt = pkt;
+    ctx->frame = frame;
+    ctx->filtered_frame = filtered_frame;
+    thread->idle_ctx = ctx;
 }
 
 MawAVContext *maw_av_init_context(const MediaFile *mediafile,
                                   const char *output_filepath) {
     int r;
     MawAVContext *ctx = NULL;
+    MawAVThread *thread = NULL;
     AVFormatContext *input_fmt_ctx = NULL;
     AVFormatContext *output_fmt_ctx = NULL;
 
@@ -961,11 +1714,19 @@ MawAVContext *maw_av_init_context(const MediaFile *mediafile,
         goto end;
     }
 
-    ctx = calloc(1, sizeof(MawAVContext));
-    if (ctx == NULL) {
-        r = AVERROR(ENOMEM);
-        MAW_AVERROR(r, ctx->mediafile->path, "Failed to allocate context");
-        goto end;
+    // Reuse the context of the previous file handled by this thread
+    thread = maw_av_thread();
+    if (thread != NULL && thread->idle_ctx != NULL) {
+        ctx = thread->idle_ctx;
+        thread->idle_ctx = NULL;
+    }
+    else {
+        ctx = calloc(1, sizeof(MawAVContext));
+        if (ctx == NULL) {
+            r = AVERROR(ENOMEM);
+            MAW_AVERROR(r, mediafile->path, "Failed to allocate context");
+            goto end;
+        }
     }
 
     ctx->input_fmt_ctx = input_fmt_ctx;
@@ -974,12 +1735,16 @@ MawAVContext *maw_av_init_context(const MediaFile *mediafile,
     ctx->video_input_stream_index = -1;
     ctx->mediafile = mediafile;
     ctx->output_filepath = output_filepath;
+    ctx->cover = NULL;
     // Filtering variables
     ctx->filter_graph = NULL;
     ctx->filter_buffersrc_ctx = NULL;
     ctx->filter_buffersink_ctx = NULL;
     ctx->dec_codec_ctx = NULL;
     ctx->enc_codec_ctx = NULL;
+    ctx->crop_pipeline = NULL;
+    ctx->patch_inplace = false;
+    ctx->patched = false;
 end:
     return ctx;
 }
@@ -1,6 +1,7 @@
 #include <glob.h>
 
 #include "maw/cfg.h"
+#include "maw/cfgcache.h"
 #include "maw/log.h"
 #include "maw/utils.h"
 
@@ -16,7 +17,8 @@ static enum YamlKey maw_cfg_parse_key_to_enum(YamlContext *ctx,
 static int maw_cfg_set_metadata_field(MawConfig *cfg, YamlContext *ctx,
                                       yaml_token_t *token, Metadata *metadata,
                                       const char *value);
-static int maw_cfg_add_to_playlist(Playlist *playlist, const char *value);
+static int maw_cfg_add_to_playlist(MawConfig *cfg, YamlContext *ctx,
+                                   Playlist *playlist, const char *value);
 static int maw_cfg_parse_key(MawConfig *cfg, YamlContext *ctx,
                              yaml_token_t *token);
 static int maw_cfg_parse_value(MawConfig *cfg, YamlContext *ctx,
@@ -105,7 +107,7 @@ const char *maw_cfg_cover_policy_tostr(enum CoverPolicy key) {
     }
 }
 
-static int maw_cfg_glob(const char *instr, char **outstr) {
+static int maw_cfg_glob(YamlContext *ctx, const char *instr, char **outstr) {
     int r = RESULT_ERR_INTERNAL;
     glob_t glob_result;
     bool has_glob_result = false;
@@ -122,7 +124,11 @@ static int maw_cfg_glob(const char *instr, char **outstr) {
         goto end;
     }
 
-    *outstr = strdup(glob_result.gl_pathv[0]);
+    *outstr = maw_intern(&ctx->interner, glob_result.gl_pathv[0]);
+    if (*outstr == NULL) {
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
 
     r = RESULT_OK;
 end:
@@ -198,14 +204,18 @@ static int maw_cfg_set_metadata_field(MawConfig *cfg, YamlContext *ctx,
                                       yaml_token_t *token, Metadata *metadata,
                                       const char *value) {
     int r = RESULT_ERR_INTERNAL;
-    char *cover_path = NULL;
+    char cover_path[MAW_PATH_MAX];
 
     switch (ctx->keypath[2]) {
     case KEY_ALBUM:
-        metadata->album = strdup(value);
+        metadata->album = maw_intern(&ctx->interner, value);
+        if (metadata->album == NULL)
+            goto end;
         break;
     case KEY_ARTIST:
-        metadata->artist = strdup(value);
+        metadata->artist = maw_intern(&ctx->interner, value);
+        if (metadata->artist == NULL)
+            goto end;
         break;
     case KEY_COVER:
         if (STR_CASE_EQ("keep", value)) {
@@ -227,15 +237,9 @@ static int maw_cfg_set_metadata_field(MawConfig *cfg, YamlContext *ctx,
                 goto end;
             }
 
-            cover_path = calloc(MAW_PATH_MAX, sizeof(char));
-            if (cover_path == NULL) {
-                MAW_PERROR("calloc");
-                goto end;
-            }
-
-            MAW_STRLCPY_SIZE(cover_path, cfg->art_dir, (size_t)MAW_PATH_MAX);
-            MAW_STRLCAT_SIZE(cover_path, "/", (size_t)MAW_PATH_MAX);
-            MAW_STRLCAT_SIZE(cover_path, value, (size_t)MAW_PATH_MAX);
+            MAW_STRLCPY(cover_path, cfg->art_dir);
+            MAW_STRLCAT(cover_path, "/");
+            MAW_STRLCAT(cover_path, value);
 
             if (!isfile(cover_path)) {
                 MAW_LOGF(MAW_ERROR, "Got cover='%s': File not found: %s", value,
@@ -244,7 +248,9 @@ static int maw_cfg_set_metadata_field(MawConfig *cfg, YamlContext *ctx,
             }
 
             metadata->cover_policy = COVER_POLICY_PATH;
-            metadata->cover_path = cover_path;
+            metadata->cover_path = maw_intern(&ctx->interner, cover_path);
+            if (metadata->cover_path == NULL)
+                goto end;
         }
         break;
     case KEY_CLEAN:
@@ -262,17 +268,18 @@ end:
     return r;
 }
 
-static int maw_cfg_add_to_playlist(Playlist *playlist, const char *value) {
+static int maw_cfg_add_to_playlist(MawConfig *cfg, YamlContext *ctx,
+                                   Playlist *playlist, const char *value) {
     int r = RESULT_ERR_INTERNAL;
     PlaylistPath *ppath = NULL;
 
-    ppath = calloc(1, sizeof(PlaylistPath));
-    if (ppath == NULL) {
-        MAW_PERROR("calloc");
+    ppath = maw_arena_alloc(&cfg->arena, sizeof(PlaylistPath));
+    if (ppath == NULL)
         goto end;
-    }
 
-    ppath->path = strdup(value);
+    ppath->path = maw_intern(&ctx->interner, value);
+    if (ppath->path == NULL)
+        goto end;
     TAILQ_INSERT_TAIL(&playlist->playlist_paths_head, ppath, entry);
 
     MAW_LOGF(MAW_DEBUG, ".%s.m3u added: %s", playlist->name, ppath->path);
@@ -301,30 +308,30 @@ static int maw_cfg_parse_key(MawConfig *cfg, YamlContext *ctx,
         switch (ctx->keypath[0]) {
         case KEY_METADATA:
             // New entry under 'metadata'
-            metadata_entry = calloc(1, sizeof(MetadataEntry));
-            if (metadata_entry == NULL) {
-                MAW_PERROR("calloc");
+            metadata_entry = maw_arena_alloc(&cfg->arena, sizeof(MetadataEntry));
+            if (metadata_entry == NULL)
                 goto end;
-            }
             metadata_entry->value.title = NULL;
             metadata_entry->value.album = NULL;
             metadata_entry->value.artist = NULL;
             metadata_entry->value.cover_path = NULL;
             metadata_entry->value.cover_policy = COVER_POLICY_UNSPECIFIED;
             metadata_entry->value.clean_policy = CLEAN_POLICY_UNSPECIFIED;
-            metadata_entry->pattern = strdup(key);
+            metadata_entry->pattern = maw_arena_strdup(&cfg->arena, key);
+            if (metadata_entry->pattern == NULL)
+                goto end;
             TAILQ_INSERT_TAIL(&cfg->metadata_head, metadata_entry, entry);
             break;
         case KEY_PLAYLISTS:
             // New entry under 'playlists'
-            playlist_entry = calloc(1, sizeof(PlaylistEntry));
-            if (playlist_entry == NULL) {
-                MAW_PERROR("calloc");
+            playlist_entry = maw_arena_alloc(&cfg->arena, sizeof(PlaylistEntry));
+            if (playlist_entry == NULL)
                 goto end;
-            }
             // Initialize the list of paths
             TAILQ_INIT(&playlist_entry->value.playlist_paths_head);
-            playlist_entry->value.name = strdup(key);
+            playlist_entry->value.name = maw_arena_strdup(&cfg->arena, key);
+            if (playlist_entry->value.name == NULL)
+                goto end;
             TAILQ_INSERT_TAIL(&cfg->playlists_head, playlist_entry, entry);
             break;
         default:
@@ -373,7 +380,7 @@ static int maw_cfg_parse_value(MawConfig *cfg, YamlContext *ctx,
             goto end;
         }
 
-        r = maw_cfg_glob(value, key);
+        r = maw_cfg_glob(ctx, value, key);
         if (r != 0)
             goto end;
 
@@ -385,7 +392,7 @@ static int maw_cfg_parse_value(MawConfig *cfg, YamlContext *ctx,
         case KEY_PLAYLISTS:
             playlist =
                 &TAILQ_LAST(&cfg->playlists_head, PlaylistEntryHead)->value;
-            r = maw_cfg_add_to_playlist(playlist, value);
+            r = maw_cfg_add_to_playlist(cfg, ctx, playlist, value);
             if (r != 0)
                 goto end;
             // XXX: Parent key is popped during YAML_BLOCK_END_TOKEN event
@@ -464,45 +471,13 @@ static void maw_cfg_dump(MawConfig *cfg) {
     }
 }
 
+// All entries and strings are released at once with the arena
 void maw_cfg_free(MawConfig *cfg) {
-    MetadataEntry *m;
-    PlaylistEntry *p;
-    PlaylistPath *pp;
-
     if (cfg == NULL)
         return;
 
-    free(cfg->music_dir);
-    free(cfg->art_dir);
-
-    while (!TAILQ_EMPTY(&(cfg->metadata_head))) {
-        m = TAILQ_FIRST(&(cfg->metadata_head));
-        free((void *)m->pattern);
-        free((void *)m->value.title);
-        free((void *)m->value.album);
-        free((void *)m->value.artist);
-        free((void *)m->value.cover_path);
-
-        TAILQ_REMOVE(&(cfg->metadata_head), m, entry);
-        free(m);
-    }
-
-    while (!TAILQ_EMPTY(&(cfg->playlists_head))) {
-        p = TAILQ_FIRST(&(cfg->playlists_head));
-
-        while (!TAILQ_EMPTY(&(p->value.playlist_paths_head))) {
-            pp = TAILQ_FIRST(&(p->value.playlist_paths_head));
-            free((void *)pp->path);
-
-            TAILQ_REMOVE(&(p->value.playlist_paths_head), pp, entry);
-            free(pp);
-        }
-
-        TAILQ_REMOVE(&(cfg->playlists_head), p, entry);
-        free((void *)p->value.name);
-        free(p);
-    }
-
+    maw_cfgcache_free(cfg->cache);
+    maw_arena_free(&cfg->arena);
     free(cfg);
 }
 
@@ -536,6 +511,7 @@ int maw_cfg_parse(const char *filepath, MawConfig **cfg) {
     (*cfg)->music_dir = NULL;
     TAILQ_INIT(&(*cfg)->metadata_head);
     TAILQ_INIT(&(*cfg)->playlists_head);
+    ctx.interner.arena = &(*cfg)->arena;
 
     r = maw_cfg_yaml_init(ctx.filepath, &parser, &fp);
     if (r != 0) {
@@ -603,6 +579,45 @@ int maw_cfg_parse(const char *filepath, MawConfig **cfg) {
 
     r = RESULT_OK;
 end:
+    maw_interner_free(&ctx.interner);
     maw_cfg_yaml_deinit(parser, fp);
     return r;
 }
+
+// Load the configuration from its compiled cache if the YAML file has not
+// changed since the last run, the cache is rebuilt otherwise. Problems with
+// the cache are never fatal, the YAML file is parsed instead.
+int maw_cfg_load(const char *filepath, MawConfig **cfg) {
+    int r = RESULT_ERR_INTERNAL;
+    char cache_path[MAW_PATH_MAX];
+    MawCfgCacheKey key;
+    bool use_cache;
+
+    *cfg = NULL;
+
+    // The key is taken before parsing, a cache compiled from a file that was
+    // modified during the parse is then never used
+    use_cache =
+        maw_cfgcache_path(filepath, cache_path, sizeof cache_path) == 0 &&
+        maw_cfgcache_key(filepath, &key) == 0;
+
+    if (use_cache) {
+        r = maw_cfgcache_load(cache_path, &key, cfg);
+        if (r == RESULT_OK && *cfg != NULL) {
+            maw_cfg_dump(*cfg);
+            goto end;
+        }
+    }
+
+    r = maw_cfg_parse(filepath, cfg);
+    if (r != 0)
+        goto end;
+
+    if (use_cache && maw_cfgcache_save(cache_path, &key, *cfg) != 0) {
+        MAW_LOGF(MAW_WARN, "%s: Failed to save config cache", cache_path);
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
@@ -0,0 +1,626 @@
+#include "maw/cfgcache.h"
+#include "maw/log.h"
+#include "maw/utils.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// String table that is built while compiling a cache
+struct MawCfgCacheStrings {
+    char *data;
+    size_t size;
+    size_t capacity;
+    size_t count;
+    // Open addressing (linear probing) table of offsets into `data`, offset
+    // by one so that 0 marks a free slot. Always a power of two in size.
+    uint32_t *slots;
+    size_t slot_count;
+} typedef MawCfgCacheStrings;
+
+static uint32_t *maw_cfgcache_strings_find(const MawCfgCacheStrings *strings,
+                                           const char *s);
+static bool maw_cfgcache_strings_add(MawCfgCacheStrings *strings,
+                                     const char *s, uint32_t *offset);
+static void maw_cfgcache_strings_free(MawCfgCacheStrings *strings);
+static void maw_cfgcache_sections(void *map,
+                                  const MawCfgCacheMetadata **metadata,
+                                  const MawCfgCachePlaylist **playlists,
+                                  const uint32_t **paths, char **strings);
+static bool maw_cfgcache_offset_valid(const MawCfgCacheHeader *header,
+                                      uint32_t offset);
+static bool maw_cfgcache_valid(const char *path, void *map, size_t size,
+                               const MawCfgCacheKey *key);
+static char *maw_cfgcache_str(char *strings, uint32_t offset);
+static bool maw_cfgcache_isdir(const char *path);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t *maw_cfgcache_strings_find(const MawCfgCacheStrings *strings,
+                                           const char *s) {
+    size_t mask = strings->slot_count - 1;
+    size_t i = (size_t)hash64(s, strlen(s)) & mask;
+
+    for (;;) {
+        if (strings->slots[i] == 0 ||
+            strcmp(strings->data + strings->slots[i] - 1, s) == 0)
+            return &strings->slots[i];
+
+        i = (i + 1) & mask;
+    }
+}
+
+// Offset of `s` in the string table, `s` is only added if the table does not
+// hold the same string already.
+static bool maw_cfgcache_strings_add(MawCfgCacheStrings *strings,
+                                     const char *s, uint32_t *offset) {
+    char *data;
+    uint32_t *slots;
+    uint32_t *slot;
+    size_t capacity;
+    size_t slot_count;
+    size_t len;
+
+    if (s == NULL) {
+        *offset = MAW_CFGCACHE_NULL;
+        return true;
+    }
+
+    if ((strings->count + 1) * 2 > strings->slot_count) {
+        slot_count = strings->slot_count > 0 ? strings->slot_count * 2
+                                             : MAW_CFGCACHE_INITIAL_SIZE;
+        slots = calloc(slot_count, sizeof(uint32_t));
+        if (slots == NULL) {
+            MAW_PERROR("calloc");
+            return false;
+        }
+
+        free(strings->slots);
+        strings->slots = slots;
+        strings->slot_count = slot_count;
+
+        for (size_t i = 0; i < strings->size;
+             i += strlen(strings->data + i) + 1) {
+            slot = maw_cfgcache_strings_find(strings, strings->data + i);
+            *slot = (uint32_t)i + 1;
+        }
+    }
+
+    slot = maw_cfgcache_strings_find(strings, s);
+    if (*slot != 0) {
+        *offset = *slot - 1;
+        return true;
+    }
+
+    len = strlen(s) + 1;
+    if (strings->size + len >= MAW_CFGCACHE_NULL) {
+        MAW_LOG(MAW_ERROR, "Too many strings for the config cache");
+        return false;
+    }
+
+    if (strings->size + len > strings->capacity) {
+        capacity = strings->capacity > 0 ? strings->capacity : MAW_PATH_MAX;
+        while (capacity < strings->size + len)
+            capacity *= 2;
+
+        data = realloc(strings->data, capacity);
+        if (data == NULL) {
+            MAW_PERROR("realloc");
+            return false;
+        }
+        strings->data = data;
+        strings->capacity = capacity;
+    }
+
+    memcpy(strings->data + strings->size, s, len);
+    *offset = (uint32_t)strings->size;
+    *slot = *offset + 1;
+    strings->size += len;
+    strings->count++;
+
+    return true;
+}
+
+static void maw_cfgcache_strings_free(MawCfgCacheStrings *strings) {
+    free(strings->data);
+    free(strings->slots);
+    memset(strings, 0, sizeof(MawCfgCacheStrings));
+}
+
+static void maw_cfgcache_sections(void *map,
+                                  const MawCfgCacheMetadata **metadata,
+                                  const MawCfgCachePlaylist **playlists,
+                                  const uint32_t **paths, char **strings) {
+    const MawCfgCacheHeader *header = map;
+    char *data = map;
+
+    data += sizeof(MawCfgCacheHeader);
+    *metadata = (void *)data;
+    data += header->metadata_count * sizeof(MawCfgCacheMetadata);
+    *playlists = (void *)data;
+    data += header->playlist_count * sizeof(MawCfgCachePlaylist);
+    *paths = (void *)data;
+    data += header->playlist_path_count * sizeof(uint32_t);
+    *strings = data;
+}
+
+static bool maw_cfgcache_offset_valid(const MawCfgCacheHeader *header,
+                                      uint32_t offset) {
+    return offset == MAW_CFGCACHE_NULL || offset < header->strings_size;
+}
+
+// Check that the cache was compiled from the current configuration and that
+// all offsets are within the file, the cache is not trusted beyond that.
+static bool maw_cfgcache_valid(const char *path, void *map, size_t size,
+                               const MawCfgCacheKey *key) {
+    const MawCfgCacheHeader *header = map;
+    const MawCfgCacheMetadata *metadata;
+    const MawCfgCachePlaylist *playlists;
+    const uint32_t *paths;
+    char *strings;
+    uint64_t expected_size;
+    uint64_t path_count = 0;
+
+    if (size < sizeof(MawCfgCacheHeader) ||
+        memcmp(header->magic, MAW_CFGCACHE_MAGIC, sizeof header->magic) != 0 ||
+        header->version != MAW_CFGCACHE_VERSION ||
+        header->header_size != sizeof(MawCfgCacheHeader))
+        goto invalid;
+
+    if (memcmp(&header->key, key, sizeof(MawCfgCacheKey)) != 0) {
+        MAW_LOGF(MAW_DEBUG, "%s: Configuration changed since the last run",
+                 path);
+        return false;
+    }
+
+    expected_size =
+        sizeof(MawCfgCacheHeader) +
+        (uint64_t)header->metadata_count * sizeof(MawCfgCacheMetadata) +
+        (uint64_t)header->playlist_count * sizeof(MawCfgCachePlaylist) +
+        (uint64_t)header->playlist_path_count * sizeof(uint32_t) +
+        header->strings_size;
+    if (expected_size != size)
+        goto invalid;
+
+    maw_cfgcache_sections(map, &metadata, &playlists, &paths, &strings);
+
+    if (header->strings_size > 0 && strings[header->strings_size - 1] != '\0')
+        goto invalid;
+
+    if (!maw_cfgcache_offset_valid(header, header->art_dir) ||
+        !maw_cfgcache_offset_valid(header, header->music_dir))
+        goto invalid;
+
+    for (uint32_t i = 0; i < header->metadata_count; i++) {
+        if (metadata[i].pattern == MAW_CFGCACHE_NULL ||
+            !maw_cfgcache_offset_valid(header, metadata[i].pattern) ||
+            !maw_cfgcache_offset_valid(header, metadata[i].title) ||
+            !maw_cfgcache_offset_valid(header, metadata[i].album) ||
+            !maw_cfgcache_offset_valid(header, metadata[i].artist) ||
+            !maw_cfgcache_offset_valid(header, metadata[i].cover_path) ||
+            metadata[i].cover_policy < COVER_POLICY_UNSPECIFIED ||
+            metadata[i].cover_policy > COVER_POLICY_CROP ||
+            metadata[i].clean_policy < CLEAN_POLICY_UNSPECIFIED ||
+            metadata[i].clean_policy > CLEAN_POLICY_TRUE)
+            goto invalid;
+    }
+
+    for (uint32_t i = 0; i < header->playlist_count; i++) {
+        if (playlists[i].name == MAW_CFGCACHE_NULL ||
+            !maw_cfgcache_offset_valid(header, playlists[i].name))
+            goto invalid;
+        path_count += playlists[i].path_count;
+    }
+    if (path_count != header->playlist_path_count)
+        goto invalid;
+
+    for (uint32_t i = 0; i < header->playlist_path_count; i++) {
+        if (paths[i] == MAW_CFGCACHE_NULL ||
+            !maw_cfgcache_offset_valid(header, paths[i]))
+            goto invalid;
+    }
+
+    return true;
+invalid:
+    MAW_LOGF(MAW_WARN, "%s: Ignoring invalid config cache", path);
+    return false;
+}
+
+static char *maw_cfgcache_str(char *strings, uint32_t offset) {
+    return offset == MAW_CFGCACHE_NULL ? NULL : strings + offset;
+}
+
+// Unset directories have nothing to check
+static bool maw_cfgcache_isdir(const char *path) {
+    struct stat s;
+    if (path == NULL)
+        return true;
+    return stat(path, &s) == 0 && S_ISDIR(s.st_mode);
+}
+
+// One cache per configuration file, named after its absolute path
+int maw_cfgcache_path(const char *config_path, char *out, size_t size) {
+    int r = RESULT_ERR_INTERNAL;
+    char abspath[MAW_PATH_MAX];
+    char name[64];
+
+    if (realpath(config_path, abspath) == NULL) {
+        MAW_PERRORF("realpath", config_path);
+        goto end;
+    }
+
+    (void)snprintf(name, sizeof name, "config-%016" PRIx64,
+                   hash64(abspath, strlen(abspath)));
+
+    r = cachepath(name, out, size);
+end:
+    return r;
+}
+
+int maw_cfgcache_key(const char *config_path, MawCfgCacheKey *key) {
+    int r = RESULT_ERR_INTERNAL;
+    char cwd[MAW_PATH_MAX];
+    int fd = -1;
+    void *data = MAP_FAILED;
+    size_t size = 0;
+    struct stat s;
+
+    fd = open(config_path, O_RDONLY);
+    if (fd < 0) {
+        MAW_PERRORF("open", config_path);
+        goto end;
+    }
+
+    if (fstat(fd, &s) != 0) {
+        MAW_PERRORF("fstat", config_path);
+        goto end;
+    }
+
+    key->size = (int64_t)s.st_size;
+    key->mtime_ns = (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+    key->digest = HASH64_INIT;
+
+    size = (size_t)s.st_size;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            MAW_PERRORF("mmap", config_path);
+            goto end;
+        }
+        key->digest = hash64_update(key->digest, data, size);
+    }
+
+    // Paths in the configuration can start with '~'
+    key->digest = hash64_update_str(key->digest, getenv("HOME"));
+
+    // Relative directory globs are resolved from the working directory
+    if (getcwd(cwd, sizeof cwd) == NULL) {
+        MAW_PERROR("getcwd");
+        goto end;
+    }
+    key->digest = hash64_update_str(key->digest, cwd);
+
+    r = RESULT_OK;
+end:
+    if (data != MAP_FAILED)
+        (void)munmap(data, size);
+    if (fd >= 0)
+        (void)close(fd);
+    return r;
+}
+
+// Map a compiled configuration, `*cfg` is left as NULL if there is no usable
+// cache for `key` or if one of the cached directories is gone. Cover paths are
+// not checked again, a missing cover is reported when the media files that
+// use it are updated.
+int maw_cfgcache_load(const char *path, const MawCfgCacheKey *key,
+                      MawConfig **cfg) {
+    int r = RESULT_ERR_INTERNAL;
+    int fd = -1;
+    struct stat s;
+    MawCfgCache *cache = NULL;
+    const MawCfgCacheHeader *header;
+    const MawCfgCacheMetadata *metadata;
+    const MawCfgCachePlaylist *playlists;
+    const uint32_t *paths;
+    char *strings;
+    MetadataEntry *m;
+    PlaylistEntry *p;
+    PlaylistPath *pp;
+    MetadataEntry *metadata_entries;
+    PlaylistEntry *playlist_entries;
+    PlaylistPath *playlist_paths;
+    size_t path_index = 0;
+
+    *cfg = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            MAW_LOGF(MAW_DEBUG, "%s: No config cache from previous runs",
+                     path);
+            r = RESULT_OK;
+        }
+        else {
+            MAW_PERRORF("open", path);
+        }
+        goto end;
+    }
+
+    if (fstat(fd, &s) != 0) {
+        MAW_PERRORF("fstat", path);
+        goto end;
+    }
+    if ((size_t)s.st_size < sizeof(MawCfgCacheHeader)) {
+        MAW_LOGF(MAW_WARN, "%s: Ignoring invalid config cache", path);
+        r = RESULT_OK;
+        goto end;
+    }
+
+    cache = calloc(1, sizeof(MawCfgCache));
+    if (cache == NULL) {
+        MAW_PERROR("calloc");
+        goto end;
+    }
+
+    cache->map_size = (size_t)s.st_size;
+    cache->map = mmap(NULL, cache->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (cache->map == MAP_FAILED) {
+        MAW_PERRORF("mmap", path);
+        cache->map = NULL;
+        goto end;
+    }
+
+    if (!maw_cfgcache_valid(path, cache->map, cache->map_size, key)) {
+        r = RESULT_OK;
+        goto end;
+    }
+
+    header = cache->map;
+    maw_cfgcache_sections(cache->map, &metadata, &playlists, &paths, &strings);
+
+    // The globs that produced these may no longer match, parse the
+    // configuration again to report it
+    if (!maw_cfgcache_isdir(maw_cfgcache_str(strings, header->art_dir)) ||
+        !maw_cfgcache_isdir(maw_cfgcache_str(strings, header->music_dir))) {
+        MAW_LOGF(MAW_DEBUG,
+                 "%s: Ignoring config cache with missing directories", path);
+        r = RESULT_OK;
+        goto end;
+    }
+
+    *cfg = calloc(1, sizeof(MawConfig));
+    if (*cfg == NULL) {
+        MAW_PERROR("calloc");
+        goto end;
+    }
+    (*cfg)->art_dir = maw_cfgcache_str(strings, header->art_dir);
+    (*cfg)->music_dir = maw_cfgcache_str(strings, header->music_dir);
+    TAILQ_INIT(&(*cfg)->metadata_head);
+    TAILQ_INIT(&(*cfg)->playlists_head);
+
+    // All entries of a kind are allocated at once
+    metadata_entries = maw_arena_alloc(
+        &(*cfg)->arena, header->metadata_count * sizeof(MetadataEntry));
+    playlist_entries = maw_arena_alloc(
+        &(*cfg)->arena, header->playlist_count * sizeof(PlaylistEntry));
+    playlist_paths = maw_arena_alloc(
+        &(*cfg)->arena, header->playlist_path_count * sizeof(PlaylistPath));
+    if (metadata_entries == NULL || playlist_entries == NULL ||
+        playlist_paths == NULL)
+        goto end;
+
+    for (uint32_t i = 0; i < header->metadata_count; i++) {
+        m = &metadata_entries[i];
+        m->pattern = maw_cfgcache_str(strings, metadata[i].pattern);
+        m->value.title = maw_cfgcache_str(strings, metadata[i].title);
+        m->value.album = maw_cfgcache_str(strings, metadata[i].album);
+        m->value.artist = maw_cfgcache_str(strings, metadata[i].artist);
+        m->value.cover_path = maw_cfgcache_str(strings, metadata[i].cover_path);
+        m->value.cover_policy = (enum CoverPolicy)metadata[i].cover_policy;
+        m->value.clean_policy = (enum CleanPolicy)metadata[i].clean_policy;
+        TAILQ_INSERT_TAIL(&(*cfg)->metadata_head, m, entry);
+    }
+
+    for (uint32_t i = 0; i < header->playlist_count; i++) {
+        p = &playlist_entries[i];
+        p->value.name = maw_cfgcache_str(strings, playlists[i].name);
+        TAILQ_INIT(&p->value.playlist_paths_head);
+
+        for (uint32_t j = 0; j < playlists[i].path_count; j++) {
+            pp = &playlist_paths[path_index];
+            pp->path = maw_cfgcache_str(strings, paths[path_index]);
+            TAILQ_INSERT_TAIL(&p->value.playlist_paths_head, pp, entry);
+            path_index++;
+        }
+
+        TAILQ_INSERT_TAIL(&(*cfg)->playlists_head, p, entry);
+    }
+
+    (*cfg)->cache = cache;
+    cache = NULL;
+
+    MAW_LOGF(MAW_DEBUG, "%s: Loaded %u metadata entries and %u playlist(s)",
+             path, header->metadata_count, header->playlist_count);
+    r = RESULT_OK;
+end:
+    if (cache != NULL) {
+        if (*cfg != NULL) {
+            maw_arena_free(&(*cfg)->arena);
+            free(*cfg);
+            *cfg = NULL;
+        }
+        maw_cfgcache_free(cache);
+    }
+    if (fd >= 0)
+        (void)close(fd);
+    return r;
+}
+
+// Compile a parsed configuration, the cache is written to a temporary file
+// that replaces `path` once it is complete.
+int maw_cfgcache_save(const char *path, const MawCfgCacheKey *key,
+                      const MawConfig *cfg) {
+    int r = RESULT_ERR_INTERNAL;
+    char tmpfile[MAW_PATH_MAX];
+    int fd = -1;
+    MawCfgCacheHeader header;
+    MawCfgCacheStrings strings = {0};
+    MawCfgCacheMetadata *metadata = NULL;
+    MawCfgCachePlaylist *playlists = NULL;
+    uint32_t *paths = NULL;
+    size_t metadata_count = 0;
+    size_t playlist_count = 0;
+    size_t path_count = 0;
+    size_t section_size;
+    const MetadataEntry *m;
+    const PlaylistEntry *p;
+    const PlaylistPath *pp;
+    size_t i;
+    size_t j;
+
+    tmpfile[0] = '\0';
+
+    TAILQ_FOREACH(m, &cfg->metadata_head, entry) {
+        metadata_count++;
+    }
+    TAILQ_FOREACH(p, &cfg->playlists_head, entry) {
+        playlist_count++;
+        TAILQ_FOREACH(pp, &p->value.playlist_paths_head, entry) {
+            path_count++;
+        }
+    }
+
+    if (metadata_count > UINT32_MAX || playlist_count > UINT32_MAX ||
+        path_count > UINT32_MAX) {
+        MAW_LOG(MAW_ERROR, "Too many entries for the config cache");
+        goto end;
+    }
+
+    metadata = calloc(metadata_count + 1, sizeof(MawCfgCacheMetadata));
+    playlists = calloc(playlist_count + 1, sizeof(MawCfgCachePlaylist));
+    paths = calloc(path_count + 1, sizeof(uint32_t));
+    if (metadata == NULL || playlists == NULL || paths == NULL) {
+        MAW_PERROR("calloc");
+        goto end;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MAW_CFGCACHE_MAGIC, sizeof header.magic);
+    header.version = MAW_CFGCACHE_VERSION;
+    header.header_size = sizeof(MawCfgCacheHeader);
+    header.key = *key;
+    header.metadata_count = (uint32_t)metadata_count;
+    header.playlist_count = (uint32_t)playlist_count;
+    header.playlist_path_count = (uint32_t)path_count;
+
+    if (!maw_cfgcache_strings_add(&strings, cfg->art_dir, &header.art_dir) ||
+        !maw_cfgcache_strings_add(&strings, cfg->music_dir, &header.music_dir))
+        goto end;
+
+    i = 0;
+    TAILQ_FOREACH(m, &cfg->metadata_head, entry) {
+        if (!maw_cfgcache_strings_add(&strings, m->pattern,
+                                      &metadata[i].pattern) ||
+            !maw_cfgcache_strings_add(&strings, m->value.title,
+                                      &metadata[i].title) ||
+            !maw_cfgcache_strings_add(&strings, m->value.album,
+                                      &metadata[i].album) ||
+            !maw_cfgcache_strings_add(&strings, m->value.artist,
+                                      &metadata[i].artist) ||
+            !maw_cfgcache_strings_add(&strings, m->value.cover_path,
+                                      &metadata[i].cover_path))
+            goto end;
+        metadata[i].cover_policy = (int32_t)m->value.cover_policy;
+        metadata[i].clean_policy = (int32_t)m->value.clean_policy;
+        i++;
+    }
+
+    i = 0;
+    j = 0;
+    TAILQ_FOREACH(p, &cfg->playlists_head, entry) {
+        if (!maw_cfgcache_strings_add(&strings, p->value.name,
+                                      &playlists[i].name))
+            goto end;
+        TAILQ_FOREACH(pp, &p->value.playlist_paths_head, entry) {
+            if (!maw_cfgcache_strings_add(&strings, pp->path, &paths[j]))
+                goto end;
+            playlists[i].path_count++;
+            j++;
+        }
+        i++;
+    }
+    header.strings_size = (uint32_t)strings.size;
+
+    r = mkparents(path, 0700);
+    if (r != 0)
+        goto end;
+    r = RESULT_ERR_INTERNAL;
+
+    MAW_STRLCPY(tmpfile, path);
+    MAW_STRLCAT(tmpfile, ".XXXXXX");
+
+    fd = mkstemp(tmpfile);
+    if (fd < 0) {
+        MAW_PERRORF("mkstemp", tmpfile);
+        tmpfile[0] = '\0';
+        goto end;
+    }
+
+    MAW_WRITE(fd, &header, sizeof header);
+    section_size = metadata_count * sizeof(MawCfgCacheMetadata);
+    if (section_size > 0) {
+        MAW_WRITE(fd, metadata, section_size);
+    }
+    section_size = playlist_count * sizeof(MawCfgCachePlaylist);
+    if (section_size > 0) {
+        MAW_WRITE(fd, playlists, section_size);
+    }
+    section_size = path_count * sizeof(uint32_t);
+    if (section_size > 0) {
+        MAW_WRITE(fd, paths, section_size);
+    }
+    if (strings.size > 0) {
+        MAW_WRITE(fd, strings.data, strings.size);
+    }
+
+    if (close(fd) != 0) {
+        fd = -1;
+        MAW_PERRORF("close", tmpfile);
+        goto end;
+    }
+    fd = -1;
+
+    if (rename(tmpfile, path) != 0) {
+        MAW_PERRORF("rename", path);
+        goto end;
+    }
+    tmpfile[0] = '\0';
+
+    MAW_LOGF(MAW_DEBUG, "%s: Saved %zu unique string(s)", path, strings.count);
+    r = RESULT_OK;
+end:
+    if (fd >= 0)
+        (void)close(fd);
+    if (tmpfile[0] != '\0')
+        (void)unlink(tmpfile);
+    maw_cfgcache_strings_free(&strings);
+    free(metadata);
+    free(playlists);
+    free(paths);
+    return r;
+}
+
+void maw_cfgcache_free(MawCfgCache *cache) {
+    if (cache == NULL)
+        return;
+
+    if (cache->map != NULL)
+        (void)munmap(cache->map, cache->map_size);
+    free(cache);
+}
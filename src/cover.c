@@ -0,0 +1,407 @@
+#include "maw/cover.h"
+#include "maw/log.h"
+#include "maw/utils.h"
+
+#include <inttypes.h>
+#include <libavformat/avformat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void maw_cover_buffer_free(void *opaque, uint8_t *data);
+static void maw_cover_free(MawCover *cover);
+static void maw_cover_unref(MawCover *cover);
+static int maw_cover_load_codecpar(MawCover *cover);
+static int maw_cover_load(const char *path, const struct stat *s,
+                          MawCover **out);
+static AVBufferRef *maw_cover_packet_ref(const AVPacket *pkt, bool copy);
+static void maw_cover_crop_free(MawCrop *crop);
+static void maw_cover_crop_remove(MawCrop *crop);
+static void maw_cover_crop_evict(void);
+static MawCrop *maw_cover_crop_find(const AVPacket *pkt, uint64_t digest);
+
+// Covers that have been loaded during this run, entries are never modified
+// after they have been inserted (except for the refcount).
+static TAILQ_HEAD(, MawCover) cover_cache_head =
+    TAILQ_HEAD_INITIALIZER(cover_cache_head);
+static pthread_mutex_t cover_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Cropped covers, keyed by the digest of the original attached_pic. Threads
+// that find a pending crop wait on `crop_cache_cond` until it is done.
+// The queue is kept in least recently used order, pending crops are never
+// evicted.
+static TAILQ_HEAD(, MawCrop) crop_cache_head =
+    TAILQ_HEAD_INITIALIZER(crop_cache_head);
+static LIST_HEAD(, MawCrop) crop_cache_buckets[MAW_CROP_CACHE_BUCKETS];
+static size_t crop_cache_count = 0;
+static pthread_mutex_t crop_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crop_cache_cond = PTHREAD_COND_INITIALIZER;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void maw_cover_buffer_free(void *opaque, uint8_t *data) {
+    (void)opaque;
+    free(data);
+}
+
+static void maw_cover_free(MawCover *cover) {
+    free(cover->path);
+    av_buffer_unref(&cover->buf);
+    avcodec_parameters_free(&cover->codecpar);
+    free(cover);
+}
+
+// Must be called with the `cover_cache_lock` held
+static void maw_cover_unref(MawCover *cover) {
+    cover->refcount--;
+    if (cover->refcount == 0)
+        maw_cover_free(cover);
+}
+
+// Probe the cover once to find the codec parameters for the output stream
+static int maw_cover_load_codecpar(MawCover *cover) {
+    int r = RESULT_ERR_INTERNAL;
+    AVFormatContext *fmt_ctx = NULL;
+    enum AVMediaType codec_type;
+
+    r = avformat_open_input(&fmt_ctx, cover->path, NULL, NULL);
+    if (r != 0) {
+        MAW_AVERROR(r, cover->path, NULL);
+        goto end;
+    }
+    r = avformat_find_stream_info(fmt_ctx, NULL);
+    if (r != 0) {
+        MAW_AVERROR(r, cover->path, NULL);
+        goto end;
+    }
+
+    if (fmt_ctx->nb_streams == 0) {
+        MAW_LOGF(MAW_ERROR, "%s: Cover has no input streams", cover->path);
+        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
+        goto end;
+    }
+    if (fmt_ctx->nb_streams > 1) {
+        MAW_LOGF(MAW_ERROR, "%s: Cover has more than one input stream",
+                 cover->path);
+        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
+        goto end;
+    }
+    codec_type = fmt_ctx->streams[0]->codecpar->codec_type;
+    if (codec_type != AVMEDIA_TYPE_VIDEO) {
+        MAW_LOGF(MAW_ERROR,
+                 "%s: Cover does not contain a video stream (found %s)",
+                 cover->path, av_get_media_type_string(codec_type));
+        r = RESULT_UNSUPPORTED_INPUT_STREAMS;
+        goto end;
+    }
+
+    cover->codecpar = avcodec_parameters_alloc();
+    if (cover->codecpar == NULL) {
+        r = AVERROR(ENOMEM);
+        MAW_AVERROR(r, cover->path, NULL);
+        goto end;
+    }
+
+    r = avcodec_parameters_copy(cover->codecpar, fmt_ctx->streams[0]->codecpar);
+    if (r != 0) {
+        MAW_AVERROR(r, cover->path, NULL);
+        goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    avformat_close_input(&fmt_ctx);
+    return r;
+}
+
+static int maw_cover_load(const char *path, const struct stat *s,
+                          MawCover **out) {
+    int r = RESULT_ERR_INTERNAL;
+    MawCover *cover = NULL;
+    char *data = NULL;
+    size_t size;
+
+    cover = calloc(1, sizeof(MawCover));
+    if (cover == NULL) {
+        r = AVERROR(ENOMEM);
+        MAW_AVERROR(r, path, "Failed to allocate cover");
+        goto end;
+    }
+
+    cover->path = strdup(path);
+    if (cover->path == NULL) {
+        r = AVERROR(ENOMEM);
+        MAW_AVERROR(r, path, "Failed to allocate cover");
+        goto end;
+    }
+    cover->size = s->st_size;
+    cover->mtime = s->st_mtime;
+    cover->mtime_nsec = STAT_MTIME_NSEC(*s);
+
+    r = maw_cover_load_codecpar(cover);
+    if (r != 0)
+        goto end;
+
+    // The image demuxers emit the complete file as one packet, the raw bytes
+    // can therefore be muxed directly as the attached_pic.
+    size = readfile(path, &data);
+    if (size == 0) {
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+
+    cover->buf =
+        av_buffer_create((uint8_t *)data, size, maw_cover_buffer_free, NULL, 0);
+    if (cover->buf == NULL) {
+        r = AVERROR(ENOMEM);
+        MAW_AVERROR(r, path, "Failed to allocate cover buffer");
+        goto end;
+    }
+    data = NULL;
+
+    cover->digest = hash64(cover->buf->data, cover->buf->size);
+    MAW_LOGF(MAW_DEBUG, "%s: Loaded cover [%zu byte(s)] [%016" PRIx64 "]",
+             path, size, cover->digest);
+
+    *out = cover;
+    cover = NULL;
+    r = RESULT_OK;
+end:
+    free(data);
+    if (cover != NULL)
+        maw_cover_free(cover);
+    return r;
+}
+
+// Return a reference to the cover at `path`, the cover is loaded from disk
+// if it is not cached already. The caller must release the reference with
+// `maw_cover_put()`.
+int maw_cover_get(const char *path, MawCover **out) {
+    int r = RESULT_ERR_INTERNAL;
+    MawCover *cover = NULL;
+    struct stat s;
+
+    *out = NULL;
+
+    if (stat(path, &s) != 0) {
+        r = AVERROR(errno);
+        MAW_AVERROR(r, path, NULL);
+        return r;
+    }
+
+    r = pthread_mutex_lock(&cover_cache_lock);
+    if (r != 0) {
+        MAW_LOGF(MAW_ERROR, "pthread_mutex_lock: %s", strerror(r));
+        return RESULT_ERR_INTERNAL;
+    }
+
+    TAILQ_FOREACH(cover, &cover_cache_head, entry) {
+        if (STR_EQ(cover->path, path))
+            break;
+    }
+
+    if (cover != NULL && (cover->size != s.st_size ||
+                          cover->mtime != s.st_mtime ||
+                          cover->mtime_nsec != STAT_MTIME_NSEC(s))) {
+        // Stale entry, current users keep their reference
+        MAW_LOGF(MAW_DEBUG, "%s: Cover modified, reloading", path);
+        TAILQ_REMOVE(&cover_cache_head, cover, entry);
+        maw_cover_unref(cover);
+        cover = NULL;
+    }
+
+    if (cover == NULL) {
+        // Covers are small, loading them while holding the lock ensures that
+        // every cover is only loaded once.
+        r = maw_cover_load(path, &s, &cover);
+        if (r != 0)
+            goto end;
+
+        cover->refcount = 1;
+        TAILQ_INSERT_TAIL(&cover_cache_head, cover, entry);
+    }
+
+    cover->refcount++;
+    *out = cover;
+
+    r = RESULT_OK;
+end:
+    (void)pthread_mutex_unlock(&cover_cache_lock);
+    return r;
+}
+
+void maw_cover_put(MawCover *cover) {
+    if (cover == NULL)
+        return;
+
+    (void)pthread_mutex_lock(&cover_cache_lock);
+    maw_cover_unref(cover);
+    (void)pthread_mutex_unlock(&cover_cache_lock);
+}
+
+// Return a buffer reference that covers exactly the data of `pkt`. The data is
+// copied if `pkt` is not reference counted or if `copy` is set.
+static AVBufferRef *maw_cover_packet_ref(const AVPacket *pkt, bool copy) {
+    AVBufferRef *ref = NULL;
+
+    if (pkt->buf != NULL && !copy) {
+        ref = av_buffer_ref(pkt->buf);
+        if (ref == NULL)
+            return NULL;
+        // The buffer may be larger than the packet data
+        ref->data = pkt->data;
+        ref->size = (size_t)pkt->size;
+        return ref;
+    }
+
+    ref = av_buffer_alloc((size_t)pkt->size);
+    if (ref == NULL)
+        return NULL;
+    memcpy(ref->data, pkt->data, (size_t)pkt->size);
+    return ref;
+}
+
+static void maw_cover_crop_free(MawCrop *crop) {
+    av_buffer_unref(&crop->input);
+    av_buffer_unref(&crop->output);
+    free(crop);
+}
+
+// Must be called with the `crop_cache_lock` held
+static void maw_cover_crop_remove(MawCrop *crop) {
+    TAILQ_REMOVE(&crop_cache_head, crop, entry);
+    LIST_REMOVE(crop, bucket_entry);
+    crop_cache_count--;
+    maw_cover_crop_free(crop);
+}
+
+// Must be called with the `crop_cache_lock` held
+static void maw_cover_crop_evict(void) {
+    MawCrop *crop = NULL;
+    MawCrop *next = NULL;
+
+    for (crop = TAILQ_FIRST(&crop_cache_head);
+         crop != NULL && crop_cache_count > MAW_CROP_CACHE_SIZE; crop = next) {
+        next = TAILQ_NEXT(crop, entry);
+        if (crop->output != NULL)
+            maw_cover_crop_remove(crop);
+    }
+}
+
+// Must be called with the `crop_cache_lock` held
+static MawCrop *maw_cover_crop_find(const AVPacket *pkt, uint64_t digest) {
+    MawCrop *crop = NULL;
+    size_t i = (size_t)digest & (MAW_CROP_CACHE_BUCKETS - 1);
+
+    LIST_FOREACH(crop, &crop_cache_buckets[i], bucket_entry) {
+        if (crop->digest == digest && crop->input->size == (size_t)pkt->size &&
+            memcmp(crop->input->data, pkt->data, crop->input->size) == 0)
+            return crop;
+    }
+    return NULL;
+}
+
+// Look up the cropped version of the attached_pic in `pkt`.
+// On a hit, `out` is set to a new reference to the cropped packet data.
+// Otherwise `pending` is set and the caller is responsible for the crop, the
+// result must be handed over with `maw_cover_crop_set()`, even on failure.
+int maw_cover_crop_get(const AVPacket *pkt, AVBufferRef **out,
+                       MawCrop **pending) {
+    int r = RESULT_ERR_INTERNAL;
+    MawCrop *crop = NULL;
+    uint64_t digest;
+
+    *out = NULL;
+    *pending = NULL;
+    digest = hash64(pkt->data, (size_t)pkt->size);
+
+    r = pthread_mutex_lock(&crop_cache_lock);
+    if (r != 0) {
+        MAW_LOGF(MAW_ERROR, "pthread_mutex_lock: %s", strerror(r));
+        return RESULT_ERR_INTERNAL;
+    }
+
+    // A failed crop is removed from the cache, the next waiter retries it
+    while ((crop = maw_cover_crop_find(pkt, digest)) != NULL &&
+           crop->output == NULL) {
+        (void)pthread_cond_wait(&crop_cache_cond, &crop_cache_lock);
+    }
+
+    if (crop != NULL) {
+        TAILQ_REMOVE(&crop_cache_head, crop, entry);
+        TAILQ_INSERT_TAIL(&crop_cache_head, crop, entry);
+        *out = av_buffer_ref(crop->output);
+        if (*out == NULL) {
+            r = AVERROR(ENOMEM);
+            goto end;
+        }
+        r = RESULT_OK;
+        goto end;
+    }
+
+    crop = calloc(1, sizeof(MawCrop));
+    if (crop == NULL) {
+        r = AVERROR(ENOMEM);
+        goto end;
+    }
+    crop->digest = digest;
+
+    // Copied so that the packet of the input file is not kept alive
+    crop->input = maw_cover_packet_ref(pkt, true);
+    if (crop->input == NULL) {
+        free(crop);
+        r = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    TAILQ_INSERT_TAIL(&crop_cache_head, crop, entry);
+    LIST_INSERT_HEAD(
+        &crop_cache_buckets[(size_t)digest & (MAW_CROP_CACHE_BUCKETS - 1)],
+        crop, bucket_entry);
+    crop_cache_count++;
+    *pending = crop;
+
+    r = RESULT_OK;
+end:
+    (void)pthread_mutex_unlock(&crop_cache_lock);
+    return r;
+}
+
+// Store the cropped packet for a pending crop, `pkt` is NULL if the crop
+// failed.
+void maw_cover_crop_set(MawCrop *pending, const AVPacket *pkt) {
+    (void)pthread_mutex_lock(&crop_cache_lock);
+
+    if (pkt != NULL)
+        pending->output = maw_cover_packet_ref(pkt, false);
+
+    if (pending->output != NULL) {
+        maw_cover_crop_evict();
+    }
+    else {
+        maw_cover_crop_remove(pending);
+    }
+
+    (void)pthread_cond_broadcast(&crop_cache_cond);
+    (void)pthread_mutex_unlock(&crop_cache_lock);
+}
+
+// Drop all cached covers and crops, covers that are still referenced are
+// freed by the last `maw_cover_put()`.
+void maw_cover_cache_free(void) {
+    MawCover *cover = NULL;
+    MawCrop *crop = NULL;
+
+    (void)pthread_mutex_lock(&cover_cache_lock);
+    while ((cover = TAILQ_FIRST(&cover_cache_head)) != NULL) {
+        TAILQ_REMOVE(&cover_cache_head, cover, entry);
+        maw_cover_unref(cover);
+    }
+    (void)pthread_mutex_unlock(&cover_cache_lock);
+
+    (void)pthread_mutex_lock(&crop_cache_lock);
+    while ((crop = TAILQ_FIRST(&crop_cache_head)) != NULL)
+        maw_cover_crop_remove(crop);
+    (void)pthread_mutex_unlock(&crop_cache_lock);
+}
@@ -29,14 +29,16 @@
 #define OPT_COLOR    "\033[1m"
 #define NO_COLOR     "\033[0m"
 
-#define _MAW_OPTS "c:j:l:hvn"
+#define _MAW_OPTS "c:j:r:d:o:l:hvnf"
 
 #ifdef MAW_TEST
 #include "maw/tests/maw_test.h"
 #define MAW_OPTS "m:" _MAW_OPTS
 #else
 #include "maw/cfg.h"
+#include "maw/cover.h"
 #include "maw/playlists.h"
+#include "maw/state.h"
 #include "maw/update.h"
 #define MAW_OPTS _MAW_OPTS
 static int set_config(MawArguments *args, char *config_path, size_t size);
@@ -49,9 +51,13 @@ static void usage(void);
 
 static const struct option long_options[] = {
     {"config", required_argument, NULL, 'c'},
-    {"jobs", optional_argument, NULL, 'j'},
+    {"jobs", required_argument, NULL, 'j'},
+    {"rewrite-jobs", required_argument, NULL, 'r'},
+    {"device-jobs", required_argument, NULL, 'd'},
+    {"output", required_argument, NULL, 'o'},
     {"verbose", no_argument, NULL, 'v'},
     {"dry-run", no_argument, NULL, 'n'},
+    {"force", no_argument, NULL, 'f'},
     {"log", optional_argument, NULL, 'l'},
 #ifdef MAW_TEST
     {"match", optional_argument, NULL, 'm'},
@@ -62,9 +68,13 @@ static const struct option long_options[] = {
 // clang-format off
 static const char *long_options_usage[] = {
     "YAML configuration file to use",
-    "Number of parallel jobs to run",
+    "Number of parallel jobs to run, or 'auto'",
+    "Number of parallel rewrites to run (default: jobs / 4)",
+    "Number of parallel jobs per device (default: no limit)",
+    "Write updated files to a mirror of the music directory",
     "Verbose logging",
-    "Do not make any changes to media files",
+    "Print what would change in each media file, without writing anything",
+    "Check all media files, even if unchanged since the last run",
     "Log level for libav*",
 #ifdef MAW_TEST
     "Testcase to run",
@@ -81,7 +91,11 @@ int main(int argc, char *argv[]) {
         .config_path = NULL,
         .verbose = false,
         .dry_run = false,
+        .force = false,
+        .output_dir = NULL,
         .thread_count = 1,
+        .rewrite_thread_count = 0,
+        .device_limit = 0,
         .av_log_level = AV_LOG_QUIET,
 #ifdef MAW_TEST
         .match_testcase = NULL,
@@ -98,6 +112,9 @@ int main(int argc, char *argv[]) {
         case 'c':
             args.config_path = optarg;
             break;
+        case 'o':
+            args.output_dir = optarg;
+            break;
 #ifdef MAW_TEST
         case 'm':
             args.match_testcase = optarg;
@@ -109,7 +126,14 @@ int main(int argc, char *argv[]) {
         case 'n':
             args.dry_run = true;
             break;
+        case 'f':
+            args.force = true;
+            break;
         case 'j':
+            if (STR_CASE_EQ("auto", optarg)) {
+                args.thread_count = MAW_THREADS_AUTO;
+                break;
+            }
             thread_count = strtoul(optarg, NULL, 10);
             if (thread_count <= 0) {
                 printf("Invalid argument for job count: %s\n", optarg);
@@ -117,6 +141,22 @@ int main(int argc, char *argv[]) {
             }
             args.thread_count = (size_t)thread_count;
             break;
+        case 'r':
+            thread_count = strtoul(optarg, NULL, 10);
+            if (thread_count <= 0) {
+                printf("Invalid argument for rewrite job count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            args.rewrite_thread_count = (size_t)thread_count;
+            break;
+        case 'd':
+            thread_count = strtoul(optarg, NULL, 10);
+            if (thread_count <= 0) {
+                printf("Invalid argument for device job count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            args.device_limit = (size_t)thread_count;
+            break;
         case 'l':
             if (STR_CASE_EQ("debug", optarg)) {
                 args.av_log_level = AV_LOG_DEBUG;
@@ -243,32 +283,65 @@ end:
 
 static int run_update(MawArguments *args, MawConfig *cfg) {
     int r = EXIT_FAILURE;
-    MediaFile mediafiles[MAW_MAX_FILES];
-    size_t mediafiles_count = 0;
+    int status;
+    MediaFiles mediafiles = {0};
+    MawState state = {0};
+    char state_path[MAW_PATH_MAX];
+    size_t unchanged;
 
-    r = maw_update_load(cfg, args, mediafiles, &mediafiles_count);
+    r = maw_update_load(cfg, args, &mediafiles);
     if (r != 0)
         goto end;
 
-    if (mediafiles_count == 0) {
+    if (mediafiles.count == 0) {
         printf("No media files matched\n");
         fflush(stderr);
         goto end;
     }
 
     if (args->dry_run) {
-        maw_update_dump(mediafiles, mediafiles_count);
+        maw_update_dump(&mediafiles);
+    }
+
+    r = maw_state_path(state_path, sizeof state_path);
+    if (r != 0)
+        goto end;
+
+    // The state describes the files in the music directory, it does not say
+    // anything about the output tree
+    if (!args->force && args->output_dir == NULL) {
+        r = maw_state_load(state_path, &state);
+        if (r != 0)
+            goto end;
+    }
+
+    unchanged = maw_state_mark(&state, &mediafiles);
+    MAW_LOGF(MAW_INFO, "%zu of %zu file(s) unchanged since the last run",
+             unchanged, mediafiles.count);
+
+    status = maw_threads_launch(mediafiles.items, mediafiles.count, args);
+
+    // Files that were brought up to date before a failure are still recorded
+    if (!args->dry_run && args->output_dir == NULL) {
+        r = maw_state_record(&state, &mediafiles);
+        if (r == RESULT_OK) {
+            r = maw_state_save(state_path, &state);
+        }
+        if (r != RESULT_OK) {
+            MAW_LOGF(MAW_WARN, "%s: Failed to save state", state_path);
+        }
     }
 
-    r = maw_threads_launch(mediafiles, mediafiles_count, args->thread_count,
-                           args->dry_run);
+    r = status;
     if (r != 0)
         goto end;
 
     r = RESULT_OK;
 
 end:
-    maw_update_free(mediafiles, mediafiles_count);
+    maw_state_free(&state);
+    maw_cover_cache_free();
+    maw_update_free(&mediafiles);
     return r;
 }
 
@@ -289,7 +362,7 @@ static int run_program(MawArguments *args) {
     }
 
     if (STR_EQ("gen", args->cmd) || STR_EQ("generate", args->cmd)) {
-        r = maw_cfg_parse(config_path, &cfg);
+        r = maw_cfg_load(config_path, &cfg);
         if (r != 0)
             goto end;
         r = maw_playlists_gen(cfg);
@@ -297,7 +370,7 @@ static int run_program(MawArguments *args) {
             goto end;
     }
     else if (STR_EQ("up", args->cmd) || STR_EQ("update", args->cmd)) {
-        r = maw_cfg_parse(config_path, &cfg);
+        r = maw_cfg_load(config_path, &cfg);
         if (r != 0)
             goto end;
 
@@ -0,0 +1,420 @@
+#include "maw/match.h"
+#include "maw/log.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static int maw_match_split(char *path, char *segments[MAW_MATCH_MAX_DEPTH],
+                           size_t *count);
+static MatchNode *maw_match_node_new(const char *segment, bool literal);
+static void maw_match_node_free(MatchNode *node);
+static MatchNode *maw_match_child(MatchNode *node, const char *segment);
+static int maw_match_result_add(MatchResult *result, const MatchNode *node);
+static int maw_match_descend(const MatchNode *node, char **segments,
+                             size_t count, size_t depth, MatchResult *result);
+static int maw_match_cmp(const void *a, const void *b);
+static void maw_match_select_node(Matcher *matcher, const MatchNode *node,
+                                  size_t *count);
+static void maw_match_select_subtree(Matcher *matcher, const MatchNode *node,
+                                     size_t *count);
+static void maw_match_select_descend(Matcher *matcher, const MatchNode *node,
+                                     char **segments, size_t segment_count,
+                                     size_t depth, size_t *count);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Split a path into its segments in place, empty and '.' segments are
+// skipped.
+static int maw_match_split(char *path, char *segments[MAW_MATCH_MAX_DEPTH],
+                           size_t *count) {
+    char *saveptr = NULL;
+    char *segment;
+
+    *count = 0;
+    for (segment = strtok_r(path, "/", &saveptr); segment != NULL;
+         segment = strtok_r(NULL, "/", &saveptr)) {
+        if (STR_EQ(segment, "."))
+            continue;
+
+        if (*count == MAW_MATCH_MAX_DEPTH) {
+            MAW_LOGF(MAW_ERROR, "%s: Too many path segments", path);
+            return RESULT_ERR_INTERNAL;
+        }
+        segments[*count] = segment;
+        *count += 1;
+    }
+
+    return RESULT_OK;
+}
+
+static MatchNode *maw_match_node_new(const char *segment, bool literal) {
+    MatchNode *node;
+
+    node = calloc(1, sizeof(MatchNode));
+    if (node == NULL) {
+        MAW_PERROR("calloc");
+        return NULL;
+    }
+
+    if (segment != NULL) {
+        node->segment = strdup(segment);
+        if (node->segment == NULL) {
+            MAW_PERROR("strdup");
+            free(node);
+            return NULL;
+        }
+        node->wildcard = strchr(segment, '*') != NULL;
+    }
+    node->literal = literal && !node->wildcard;
+    TAILQ_INIT(&node->children_head);
+
+    return node;
+}
+
+static void maw_match_node_free(MatchNode *node) {
+    MatchNode *child;
+
+    if (node == NULL)
+        return;
+
+    while ((child = TAILQ_FIRST(&node->children_head)) != NULL) {
+        TAILQ_REMOVE(&node->children_head, child, entry);
+        maw_match_node_free(child);
+    }
+    free(node->segment);
+    free(node->indices);
+    free(node);
+}
+
+// Find or create the child of `node` for a pattern segment
+static MatchNode *maw_match_child(MatchNode *node, const char *segment) {
+    MatchNode *child;
+
+    TAILQ_FOREACH(child, &node->children_head, entry) {
+        if (STR_EQ(child->segment, segment))
+            return child;
+    }
+
+    child = maw_match_node_new(segment, node->literal);
+    if (child == NULL)
+        return NULL;
+
+    TAILQ_INSERT_TAIL(&node->children_head, child, entry);
+    return child;
+}
+
+// Entries should be added in configuration order
+int maw_match_add(Matcher *matcher, MetadataEntry *metadata_entry) {
+    int r = RESULT_ERR_INTERNAL;
+    char pattern[MAW_PATH_MAX];
+    char *segments[MAW_MATCH_MAX_DEPTH];
+    size_t count;
+    size_t *indices;
+    MatchEntry *entries;
+    MatchNode *node;
+    size_t capacity;
+
+    if (matcher->root == NULL) {
+        matcher->root = maw_match_node_new(NULL, true);
+        if (matcher->root == NULL)
+            goto end;
+    }
+
+    MAW_STRLCPY(pattern, metadata_entry->pattern);
+    r = maw_match_split(pattern, segments, &count);
+    if (r != 0)
+        goto end;
+
+    node = matcher->root;
+    for (size_t i = 0; i < count; i++) {
+        node = maw_match_child(node, segments[i]);
+        if (node == NULL) {
+            r = RESULT_ERR_INTERNAL;
+            goto end;
+        }
+    }
+
+    if (matcher->entry_count == matcher->entry_capacity) {
+        capacity = matcher->entry_capacity > 0 ? matcher->entry_capacity * 2
+                                               : MAW_MATCH_MAX_DEPTH;
+        entries = realloc(matcher->entries, capacity * sizeof(MatchEntry));
+        if (entries == NULL) {
+            MAW_PERROR("realloc");
+            r = RESULT_ERR_INTERNAL;
+            goto end;
+        }
+        matcher->entries = entries;
+        matcher->entry_capacity = capacity;
+    }
+
+    indices = realloc(node->indices, (node->index_count + 1) * sizeof(size_t));
+    if (indices == NULL) {
+        MAW_PERROR("realloc");
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+    node->indices = indices;
+    node->indices[node->index_count] = matcher->entry_count;
+    node->index_count++;
+
+    matcher->entries[matcher->entry_count].metadata_entry = metadata_entry;
+    matcher->entries[matcher->entry_count].node = node;
+    matcher->entries[matcher->entry_count].hits = 0;
+    matcher->entries[matcher->entry_count].selected = false;
+    matcher->entry_count++;
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+static int maw_match_result_add(MatchResult *result, const MatchNode *node) {
+    size_t *indices;
+    size_t capacity;
+
+    if (result->count + node->index_count > result->capacity) {
+        capacity = result->capacity > 0 ? result->capacity : 8;
+        while (capacity < result->count + node->index_count)
+            capacity *= 2;
+
+        indices = realloc(result->indices, capacity * sizeof(size_t));
+        if (indices == NULL) {
+            MAW_PERROR("realloc");
+            return RESULT_ERR_INTERNAL;
+        }
+        result->indices = indices;
+        result->capacity = capacity;
+    }
+
+    memcpy(&result->indices[result->count], node->indices,
+           node->index_count * sizeof(size_t));
+    result->count += node->index_count;
+
+    return RESULT_OK;
+}
+
+// A pattern matches a path if all of its segments match, patterns without
+// wildcards also match all paths beneath them, e.g. 'red' matches
+// 'red/audio.m4a'.
+static int maw_match_descend(const MatchNode *node, char **segments,
+                             size_t count, size_t depth, MatchResult *result) {
+    int r;
+    const MatchNode *child;
+
+    if (node->index_count > 0 && (depth == count || node->literal)) {
+        r = maw_match_result_add(result, node);
+        if (r != 0)
+            return r;
+    }
+
+    if (depth == count)
+        return RESULT_OK;
+
+    TAILQ_FOREACH(child, &node->children_head, entry) {
+        if (child->wildcard
+                ? fnmatch(child->segment, segments[depth], FNM_PERIOD) != 0
+                : !STR_EQ(child->segment, segments[depth]))
+            continue;
+
+        r = maw_match_descend(child, segments, count, depth + 1, result);
+        if (r != 0)
+            return r;
+    }
+
+    return RESULT_OK;
+}
+
+static int maw_match_cmp(const void *a, const void *b) {
+    size_t lhs = *(const size_t *)a;
+    size_t rhs = *(const size_t *)b;
+
+    if (lhs != rhs)
+        return lhs < rhs ? -1 : 1;
+    return 0;
+}
+
+// Find all entries that match `path`, relative to the music directory
+int maw_match_path(Matcher *matcher, const char *path, MatchResult *result) {
+    int r = RESULT_ERR_INTERNAL;
+    char buf[MAW_PATH_MAX];
+    char *segments[MAW_MATCH_MAX_DEPTH];
+    size_t count;
+
+    result->count = 0;
+    if (matcher->root == NULL)
+        return RESULT_OK;
+
+    MAW_STRLCPY(buf, path);
+    r = maw_match_split(buf, segments, &count);
+    if (r != 0)
+        goto end;
+
+    r = maw_match_descend(matcher->root, segments, count, 0, result);
+    if (r != 0)
+        goto end;
+
+    qsort(result->indices, result->count, sizeof(size_t), maw_match_cmp);
+    for (size_t i = 0; i < result->count; i++)
+        matcher->entries[result->indices[i]].hits++;
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Join the segments of `path` with single slashes, two spellings of the same
+// path are then equal, e.g. './red/' and 'red'. Paths that leave the
+// directory that they are relative to are rejected.
+int maw_match_normalize(const char *path, char *out, size_t size) {
+    int r = RESULT_ERR_INTERNAL;
+    char buf[MAW_PATH_MAX];
+    char *segments[MAW_MATCH_MAX_DEPTH];
+    size_t count;
+
+    MAW_STRLCPY(buf, path);
+    r = maw_match_split(buf, segments, &count);
+    if (r != 0)
+        goto end;
+    r = RESULT_ERR_INTERNAL;
+
+    out[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        if (STR_EQ(segments[i], "..")) {
+            MAW_LOGF(MAW_ERROR, "%s: Parent directories are not allowed", path);
+            goto end;
+        }
+        if (i > 0)
+            MAW_STRLCAT_SIZE(out, "/", size);
+        MAW_STRLCAT_SIZE(out, segments[i], size);
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+static void maw_match_select_node(Matcher *matcher, const MatchNode *node,
+                                  size_t *count) {
+    MatchEntry *entry;
+
+    for (size_t i = 0; i < node->index_count; i++) {
+        entry = &matcher->entries[node->indices[i]];
+        entry->selected = true;
+    }
+    *count += node->index_count;
+}
+
+static void maw_match_select_subtree(Matcher *matcher, const MatchNode *node,
+                                     size_t *count) {
+    const MatchNode *child;
+
+    maw_match_select_node(matcher, node, count);
+    TAILQ_FOREACH(child, &node->children_head, entry) {
+        maw_match_select_subtree(matcher, child, count);
+    }
+}
+
+// Follow the segments of a path down the trie, the same way as
+// `maw_match_descend()` does. Every pattern beneath the end of the path can
+// match files beneath it.
+static void maw_match_select_descend(Matcher *matcher, const MatchNode *node,
+                                     char **segments, size_t segment_count,
+                                     size_t depth, size_t *count) {
+    const MatchNode *child;
+
+    if (depth == segment_count) {
+        maw_match_select_subtree(matcher, node, count);
+        return;
+    }
+
+    if (node->literal)
+        maw_match_select_node(matcher, node, count);
+
+    TAILQ_FOREACH(child, &node->children_head, entry) {
+        if (child->wildcard
+                ? fnmatch(child->segment, segments[depth], FNM_PERIOD) != 0
+                : !STR_EQ(child->segment, segments[depth]))
+            continue;
+
+        maw_match_select_descend(matcher, child, segments, segment_count,
+                                 depth + 1, count);
+    }
+}
+
+// Select the entries that apply to `path` or anything beneath it, relative to
+// the music directory. Only the trie is consulted, the cost depends on the
+// depth of the path rather than on the number of entries. `count` is set to
+// the number of entries that apply.
+int maw_match_select(Matcher *matcher, const char *path, size_t *count) {
+    int r = RESULT_ERR_INTERNAL;
+    char buf[MAW_PATH_MAX];
+    char *segments[MAW_MATCH_MAX_DEPTH];
+    size_t segment_count;
+
+    *count = 0;
+    matcher->scoped = true;
+    if (matcher->root == NULL)
+        return RESULT_OK;
+
+    MAW_STRLCPY(buf, path);
+    r = maw_match_split(buf, segments, &segment_count);
+    if (r != 0)
+        goto end;
+
+    maw_match_select_descend(matcher, matcher->root, segments, segment_count,
+                             0, count);
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Report patterns that did not match anything, a pattern without wildcards
+// must refer to an existing file or directory.
+int maw_match_check(const Matcher *matcher, const char *music_dir) {
+    int r = RESULT_ERR_INTERNAL;
+    char path[MAW_PATH_MAX];
+    const MatchEntry *entry;
+    struct stat s;
+
+    for (size_t i = 0; i < matcher->entry_count; i++) {
+        entry = &matcher->entries[i];
+        if (entry->hits > 0 || (matcher->scoped && !entry->selected))
+            continue;
+
+        MAW_STRLCPY(path, music_dir);
+        MAW_STRLCAT(path, "/");
+        MAW_STRLCAT(path, entry->metadata_entry->pattern);
+
+        if (!entry->node->literal) {
+            MAW_LOGF(MAW_WARN, "No matches for %s", path);
+        }
+        else if (stat(path, &s) != 0) {
+            MAW_PERRORF("stat", path);
+            goto end;
+        }
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+void maw_match_free(Matcher *matcher) {
+    maw_match_node_free(matcher->root);
+    free(matcher->entries);
+    matcher->root = NULL;
+    matcher->entries = NULL;
+    matcher->entry_count = 0;
+    matcher->entry_capacity = 0;
+    matcher->scoped = false;
+}
+
+void maw_match_result_free(MatchResult *result) {
+    free(result->indices);
+    result->indices = NULL;
+    result->count = 0;
+    result->capacity = 0;
+}
@@ -0,0 +1,738 @@
+#include "maw/mp4.h"
+#include "maw/log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Mp4Box {
+    uint32_t type;
+    uint64_t offset;
+    uint64_t size;
+} typedef Mp4Box;
+
+// Location of the top level boxes that we care about
+struct Mp4Layout {
+    Mp4Box moov;
+    // Unused space around `moov`, i.e. the runs of free boxes directly before
+    // and after it. Equal to the bounds of `moov` if there are none.
+    uint64_t free_start;
+    uint64_t free_end;
+    // Set if only free boxes follow `moov`, the file can then be extended
+    // directly after it.
+    bool tail;
+    uint64_t filesize;
+    // Set if a box extends to the end of the file (size field == 0), we
+    // can not append anything to such files.
+    bool open_ended;
+} typedef Mp4Layout;
+
+struct Mp4Item {
+    uint32_t type;
+    const char *value;
+} typedef Mp4Item;
+
+static uint32_t maw_mp4_read_u32(const unsigned char *buf);
+static uint64_t maw_mp4_read_u64(const unsigned char *buf);
+static void maw_mp4_write_u32(unsigned char *buf, uint32_t value);
+static int maw_mp4_pread(int fd, unsigned char *buf, size_t size,
+                         uint64_t offset);
+static int maw_mp4_pwrite(int fd, const unsigned char *buf, size_t size,
+                          uint64_t offset);
+static int maw_mp4_scan(const char *filepath, int fd, Mp4Layout *layout);
+static int maw_mp4_write_free(int fd, uint64_t offset, uint64_t size);
+static int maw_mp4_sync(const char *filepath, int fd);
+static bool maw_mp4_find_child(const unsigned char *buf, size_t start,
+                               size_t end, uint32_t type, size_t *offset);
+static bool maw_mp4_keep_item(uint32_t type, const Mp4Item items[],
+                              size_t items_count, bool clean);
+static size_t maw_mp4_write_item(unsigned char *out, const Mp4Item *item);
+static bool maw_mp4_child_equals(const unsigned char *item, size_t item_size,
+                                 uint32_t type, const char *value);
+static bool maw_mp4_is_fingerprint(const unsigned char *item,
+                                   size_t item_size);
+static size_t maw_mp4_fingerprint_size(const char *value);
+static size_t maw_mp4_write_fingerprint(unsigned char *out, const char *value);
+static int maw_mp4_rebuild_moov(const char *filepath,
+                                const unsigned char *moov, size_t moov_size,
+                                const Mp4Tags *tags, unsigned char **out,
+                                size_t *out_size);
+static int maw_mp4_write_moov(const char *filepath, int fd,
+                              const Mp4Layout *layout,
+                              const unsigned char *moov, size_t moov_size,
+                              bool durable);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t maw_mp4_read_u32(const unsigned char *buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+           (uint32_t)buf[2] << 8 | (uint32_t)buf[3];
+}
+
+static uint64_t maw_mp4_read_u64(const unsigned char *buf) {
+    return (uint64_t)maw_mp4_read_u32(buf) << 32 | maw_mp4_read_u32(buf + 4);
+}
+
+static void maw_mp4_write_u32(unsigned char *buf, uint32_t value) {
+    buf[0] = (unsigned char)(value >> 24);
+    buf[1] = (unsigned char)(value >> 16);
+    buf[2] = (unsigned char)(value >> 8);
+    buf[3] = (unsigned char)value;
+}
+
+static int maw_mp4_pread(int fd, unsigned char *buf, size_t size,
+                         uint64_t offset) {
+    ssize_t read_bytes;
+    size_t done = 0;
+
+    while (done < size) {
+        read_bytes = pread(fd, buf + done, size - done, (off_t)(offset + done));
+        if (read_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            MAW_PERROR("pread");
+            return RESULT_ERR_INTERNAL;
+        }
+        if (read_bytes == 0) {
+            MAW_LOGF(MAW_ERROR, "pread: unexpected end of file at %llu",
+                     (unsigned long long)(offset + done));
+            return RESULT_ERR_INTERNAL;
+        }
+        done += (size_t)read_bytes;
+    }
+
+    return RESULT_OK;
+}
+
+static int maw_mp4_pwrite(int fd, const unsigned char *buf, size_t size,
+                          uint64_t offset) {
+    ssize_t write_bytes;
+    size_t done = 0;
+
+    while (done < size) {
+        write_bytes =
+            pwrite(fd, buf + done, size - done, (off_t)(offset + done));
+        if (write_bytes < 0) {
+            if (errno == EINTR)
+                continue;
+            MAW_PERROR("pwrite");
+            return RESULT_ERR_INTERNAL;
+        }
+        done += (size_t)write_bytes;
+    }
+
+    return RESULT_OK;
+}
+
+// Walk the top level boxes and record where `moov` is located
+static int maw_mp4_scan(const char *filepath, int fd, Mp4Layout *layout) {
+    int r = RESULT_ERR_INTERNAL;
+    unsigned char header[MP4_LARGE_HEADER_SIZE];
+    uint64_t offset = 0;
+    uint64_t size;
+    uint32_t type;
+    size_t header_size;
+    uint64_t run_start = 0;
+    bool in_run = false;
+    bool after_moov = false;
+    bool is_free;
+
+    while (offset < layout->filesize) {
+        header_size = layout->filesize - offset >= MP4_LARGE_HEADER_SIZE
+                          ? MP4_LARGE_HEADER_SIZE
+                          : MP4_BOX_HEADER_SIZE;
+        if (layout->filesize - offset < MP4_BOX_HEADER_SIZE) {
+            MAW_LOGF(MAW_DEBUG, "%s: Trailing garbage after last box",
+                     filepath);
+            r = RESULT_UNSUPPORTED_LAYOUT;
+            goto end;
+        }
+
+        r = maw_mp4_pread(fd, header, header_size, offset);
+        if (r != 0)
+            goto end;
+
+        size = maw_mp4_read_u32(header);
+        type = maw_mp4_read_u32(header + 4);
+
+        if (size == 1 && header_size == MP4_LARGE_HEADER_SIZE) {
+            size = maw_mp4_read_u64(header + 8);
+        }
+        else if (size == 0) {
+            size = layout->filesize - offset;
+            layout->open_ended = true;
+        }
+
+        if (size < MP4_BOX_HEADER_SIZE || size > layout->filesize - offset) {
+            MAW_LOGF(MAW_DEBUG, "%s: Invalid box size at %llu", filepath,
+                     (unsigned long long)offset);
+            r = RESULT_UNSUPPORTED_LAYOUT;
+            goto end;
+        }
+
+        // Track the runs of free boxes around `moov`
+        is_free = type == MP4_TYPE_FREE || type == MP4_TYPE_SKIP;
+        if (layout->moov.type != 0) {
+            if (after_moov && is_free)
+                layout->free_end += size;
+            else
+                after_moov = false;
+            if (!is_free)
+                layout->tail = false;
+        }
+        if (!in_run)
+            run_start = offset;
+        in_run = is_free;
+
+        if (type == MP4_TYPE_MOOF) {
+            MAW_LOGF(MAW_DEBUG, "%s: Fragmented files are not supported",
+                     filepath);
+            r = RESULT_UNSUPPORTED_LAYOUT;
+            goto end;
+        }
+        else if (type == MP4_TYPE_MOOV) {
+            if (layout->moov.type != 0) {
+                MAW_LOGF(MAW_DEBUG, "%s: More than one moov box", filepath);
+                r = RESULT_UNSUPPORTED_LAYOUT;
+                goto end;
+            }
+            // Only plain 32-bit sizes are supported for `moov`
+            if (maw_mp4_read_u32(header) != size) {
+                MAW_LOGF(MAW_DEBUG, "%s: Unsupported moov size field",
+                         filepath);
+                r = RESULT_UNSUPPORTED_LAYOUT;
+                goto end;
+            }
+            layout->moov.type = type;
+            layout->moov.offset = offset;
+            layout->moov.size = size;
+            layout->free_start = run_start;
+            layout->free_end = offset + size;
+            layout->tail = true;
+            after_moov = true;
+        }
+
+        offset += size;
+    }
+
+    if (layout->moov.type == 0) {
+        MAW_LOGF(MAW_DEBUG, "%s: No moov box found", filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    if (layout->moov.size > MP4_MAX_MOOV_SIZE) {
+        MAW_LOGF(MAW_DEBUG, "%s: moov box is too large: %llu byte(s)",
+                 filepath, (unsigned long long)layout->moov.size);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    // The unused space is merged into single free boxes, ignore it if it can
+    // not be described by one
+    if (layout->free_end - layout->free_start > UINT32_MAX) {
+        layout->free_start = layout->moov.offset;
+        layout->free_end = layout->moov.offset + layout->moov.size;
+        layout->tail = false;
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Find the first child box of `type` within buf[start,end), the offset of the
+// child box header is written to `offset`.
+static bool maw_mp4_find_child(const unsigned char *buf, size_t start,
+                               size_t end, uint32_t type, size_t *offset) {
+    size_t size;
+
+    while (end - start >= MP4_BOX_HEADER_SIZE) {
+        size = maw_mp4_read_u32(buf + start);
+        // 64-bit and open ended sizes are not expected below `moov`
+        if (size < MP4_BOX_HEADER_SIZE || size > end - start)
+            return false;
+
+        if (maw_mp4_read_u32(buf + start + 4) == type) {
+            *offset = start;
+            return true;
+        }
+        start += size;
+    }
+
+    return false;
+}
+
+static bool maw_mp4_keep_item(uint32_t type, const Mp4Item items[],
+                              size_t items_count, bool clean) {
+    for (size_t i = 0; i < items_count; i++) {
+        // Tags that we set are re-added after all other items
+        if (items[i].type == type)
+            return items[i].value == NULL;
+    }
+
+    if (clean) {
+        return type == MP4_TYPE_TOO || type == MP4_TYPE_COVR;
+    }
+
+    return true;
+}
+
+// Serialize an ilst item with one UTF-8 data atom, returns the number of bytes
+// written.
+static size_t maw_mp4_write_item(unsigned char *out, const Mp4Item *item) {
+    size_t len = strlen(item->value);
+    size_t data_size = MP4_DATA_HEADER_SIZE + len;
+    size_t item_size = MP4_BOX_HEADER_SIZE + data_size;
+
+    maw_mp4_write_u32(out, (uint32_t)item_size);
+    maw_mp4_write_u32(out + 4, item->type);
+    maw_mp4_write_u32(out + 8, (uint32_t)data_size);
+    maw_mp4_write_u32(out + 12, MP4_TYPE_DATA);
+    maw_mp4_write_u32(out + 16, MP4_DATA_TYPE_UTF8);
+    // Locale
+    maw_mp4_write_u32(out + 20, 0);
+    memcpy(out + 24, item->value, len);
+
+    return item_size;
+}
+
+// Returns true if the `mean` or `name` atom of a freeform item holds `value`
+static bool maw_mp4_child_equals(const unsigned char *item, size_t item_size,
+                                 uint32_t type, const char *value) {
+    size_t offset;
+    size_t len = strlen(value);
+
+    if (!maw_mp4_find_child(item, MP4_BOX_HEADER_SIZE, item_size, type,
+                            &offset))
+        return false;
+
+    return maw_mp4_read_u32(item + offset) == MP4_FREEFORM_HEADER_SIZE + len &&
+           memcmp(item + offset + MP4_FREEFORM_HEADER_SIZE, value, len) == 0;
+}
+
+static bool maw_mp4_is_fingerprint(const unsigned char *item,
+                                   size_t item_size) {
+    return maw_mp4_child_equals(item, item_size, MP4_TYPE_MEAN,
+                                MP4_FINGERPRINT_MEAN) &&
+           maw_mp4_child_equals(item, item_size, MP4_TYPE_NAME,
+                                MP4_FINGERPRINT_NAME);
+}
+
+static size_t maw_mp4_fingerprint_size(const char *value) {
+    return MP4_BOX_HEADER_SIZE + MP4_FREEFORM_HEADER_SIZE +
+           strlen(MP4_FINGERPRINT_MEAN) + MP4_FREEFORM_HEADER_SIZE +
+           strlen(MP4_FINGERPRINT_NAME) + MP4_DATA_HEADER_SIZE + strlen(value);
+}
+
+// Serialize the fingerprint as a `----` item with `mean`, `name` and `data`
+// atoms, returns the number of bytes written.
+static size_t maw_mp4_write_fingerprint(unsigned char *out, const char *value) {
+    const char *strings[] = {MP4_FINGERPRINT_MEAN, MP4_FINGERPRINT_NAME};
+    const uint32_t types[] = {MP4_TYPE_MEAN, MP4_TYPE_NAME};
+    size_t item_size = maw_mp4_fingerprint_size(value);
+    size_t pos = MP4_BOX_HEADER_SIZE;
+    size_t len;
+
+    maw_mp4_write_u32(out, (uint32_t)item_size);
+    maw_mp4_write_u32(out + 4, MP4_TYPE_FREEFORM);
+
+    for (size_t i = 0; i < 2; i++) {
+        len = strlen(strings[i]);
+        maw_mp4_write_u32(out + pos,
+                          (uint32_t)(MP4_FREEFORM_HEADER_SIZE + len));
+        maw_mp4_write_u32(out + pos + 4, types[i]);
+        // Version and flags
+        maw_mp4_write_u32(out + pos + 8, 0);
+        memcpy(out + pos + MP4_FREEFORM_HEADER_SIZE, strings[i], len);
+        pos += MP4_FREEFORM_HEADER_SIZE + len;
+    }
+
+    len = strlen(value);
+    maw_mp4_write_u32(out + pos, (uint32_t)(MP4_DATA_HEADER_SIZE + len));
+    maw_mp4_write_u32(out + pos + 4, MP4_TYPE_DATA);
+    maw_mp4_write_u32(out + pos + 8, MP4_DATA_TYPE_UTF8);
+    // Locale
+    maw_mp4_write_u32(out + pos + 12, 0);
+    memcpy(out + pos + MP4_DATA_HEADER_SIZE, value, len);
+
+    return item_size;
+}
+
+// Create a copy of the provided `moov` box with a new `ilst` box. The sizes of
+// all parent boxes are adjusted accordingly.
+static int maw_mp4_rebuild_moov(const char *filepath,
+                                const unsigned char *moov, size_t moov_size,
+                                const Mp4Tags *tags, unsigned char **out,
+                                size_t *out_size) {
+    int r = RESULT_ERR_INTERNAL;
+    const Mp4Item items[] = {
+        {.type = MP4_TYPE_NAM, .value = tags->title},
+        {.type = MP4_TYPE_ART, .value = tags->artist},
+        {.type = MP4_TYPE_ALB, .value = tags->album},
+    };
+    size_t items_count = sizeof(items) / sizeof(Mp4Item);
+    size_t parents[3];
+    size_t udta_offset, meta_offset, ilst_offset;
+    size_t meta_children;
+    size_t ilst_size, ilst_end;
+    size_t item_offset, item_size;
+    size_t new_ilst_size;
+    size_t pos;
+    uint64_t parent_size;
+    uint32_t type;
+    bool keep;
+    unsigned char *buf = NULL;
+
+    *out = NULL;
+
+    if (maw_mp4_find_child(moov, MP4_BOX_HEADER_SIZE, moov_size,
+                           MP4_TYPE_MVEX, &udta_offset)) {
+        MAW_LOGF(MAW_DEBUG, "%s: Fragmented files are not supported",
+                 filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    if (!maw_mp4_find_child(moov, MP4_BOX_HEADER_SIZE, moov_size,
+                            MP4_TYPE_UDTA, &udta_offset) ||
+        !maw_mp4_find_child(moov, udta_offset + MP4_BOX_HEADER_SIZE,
+                            udta_offset + maw_mp4_read_u32(moov + udta_offset),
+                            MP4_TYPE_META, &meta_offset)) {
+        MAW_LOGF(MAW_DEBUG, "%s: No moov/udta/meta box found", filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    // The iTunes style `meta` box is a full box with four bytes of
+    // version/flags, the QuickTime style box has no such field.
+    meta_children = meta_offset + MP4_BOX_HEADER_SIZE;
+    if (maw_mp4_read_u32(moov + meta_offset) >= MP4_BOX_HEADER_SIZE + 4 &&
+        maw_mp4_read_u32(moov + meta_children) == 0) {
+        meta_children += 4;
+    }
+
+    if (!maw_mp4_find_child(moov, meta_children,
+                            meta_offset + maw_mp4_read_u32(moov + meta_offset),
+                            MP4_TYPE_ILST, &ilst_offset)) {
+        MAW_LOGF(MAW_DEBUG, "%s: No moov/udta/meta/ilst box found", filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    ilst_size = maw_mp4_read_u32(moov + ilst_offset);
+    ilst_end = ilst_offset + ilst_size;
+
+    // Allocate enough space for the current ilst content and all new items
+    new_ilst_size = ilst_size;
+    for (size_t i = 0; i < items_count; i++) {
+        if (items[i].value == NULL)
+            continue;
+        if (strlen(items[i].value) > UINT32_MAX / 2) {
+            MAW_LOGF(MAW_ERROR, "%s: Tag value is too large", filepath);
+            goto end;
+        }
+        new_ilst_size +=
+            MP4_BOX_HEADER_SIZE + MP4_DATA_HEADER_SIZE + strlen(items[i].value);
+    }
+    if (tags->fingerprint != NULL) {
+        new_ilst_size += maw_mp4_fingerprint_size(tags->fingerprint);
+    }
+
+    buf = calloc(moov_size - ilst_size + new_ilst_size, sizeof(unsigned char));
+    if (buf == NULL) {
+        MAW_PERROR("calloc");
+        goto end;
+    }
+
+    // Everything up to and including the ilst header is kept as is
+    pos = ilst_offset + MP4_BOX_HEADER_SIZE;
+    memcpy(buf, moov, pos);
+
+    for (item_offset = pos; ilst_end - item_offset >= MP4_BOX_HEADER_SIZE;
+         item_offset += item_size) {
+        item_size = maw_mp4_read_u32(moov + item_offset);
+        if (item_size < MP4_BOX_HEADER_SIZE ||
+            item_size > ilst_end - item_offset) {
+            MAW_LOGF(MAW_DEBUG, "%s: Invalid ilst item size", filepath);
+            r = RESULT_UNSUPPORTED_LAYOUT;
+            goto end;
+        }
+        type = maw_mp4_read_u32(moov + item_offset + 4);
+
+        // Other freeform items are treated like any other tag
+        if (type == MP4_TYPE_FREEFORM &&
+            maw_mp4_is_fingerprint(moov + item_offset, item_size)) {
+            keep = tags->fingerprint == NULL;
+        }
+        else {
+            keep = maw_mp4_keep_item(type, items, items_count, tags->clean);
+        }
+
+        if (keep) {
+            memcpy(buf + pos, moov + item_offset, item_size);
+            pos += item_size;
+        }
+    }
+
+    for (size_t i = 0; i < items_count; i++) {
+        if (items[i].value == NULL || strlen(items[i].value) == 0)
+            continue;
+        pos += maw_mp4_write_item(buf + pos, &items[i]);
+    }
+    if (tags->fingerprint != NULL && strlen(tags->fingerprint) > 0) {
+        pos += maw_mp4_write_fingerprint(buf + pos, tags->fingerprint);
+    }
+
+    new_ilst_size = pos - ilst_offset;
+
+    // Copy the remainder of the moov box after the ilst
+    memcpy(buf + pos, moov + ilst_end, moov_size - ilst_end);
+    *out_size = pos + moov_size - ilst_end;
+
+    // Patch the size of all boxes on the path down to the ilst
+    parents[0] = 0;
+    parents[1] = udta_offset;
+    parents[2] = meta_offset;
+    for (size_t i = 0; i < sizeof(parents) / sizeof(size_t); i++) {
+        parent_size = (uint64_t)maw_mp4_read_u32(buf + parents[i]) +
+                      new_ilst_size - ilst_size;
+        if (parent_size > UINT32_MAX) {
+            MAW_LOGF(MAW_DEBUG, "%s: Box size overflow", filepath);
+            r = RESULT_UNSUPPORTED_LAYOUT;
+            goto end;
+        }
+        maw_mp4_write_u32(buf + parents[i], (uint32_t)parent_size);
+    }
+    maw_mp4_write_u32(buf + ilst_offset, (uint32_t)new_ilst_size);
+
+    *out = buf;
+    buf = NULL;
+    r = RESULT_OK;
+end:
+    free(buf);
+    return r;
+}
+
+static int maw_mp4_write_free(int fd, uint64_t offset, uint64_t size) {
+    unsigned char header[MP4_BOX_HEADER_SIZE];
+
+    maw_mp4_write_u32(header, (uint32_t)size);
+    maw_mp4_write_u32(header + 4, MP4_TYPE_FREE);
+    return maw_mp4_pwrite(fd, header, sizeof header, offset);
+}
+
+static int maw_mp4_sync(const char *filepath, int fd) {
+    if (fsync(fd) != 0) {
+        MAW_PERRORF("fsync", filepath);
+        return RESULT_ERR_INTERNAL;
+    }
+    return RESULT_OK;
+}
+
+// Write the new `moov` box to disk. The mdat box is never moved so none of
+// the chunk offsets inside `moov` need to change.
+//
+// The live `moov` box is never overwritten. The new box is written to unused
+// space first and flushed to disk, the switch is then made with a single box
+// header write. A crash before that write leaves the old box in effect,
+// demuxers only use the first `moov` box in a file. Afterwards all unused
+// space around the new box is merged into free boxes.
+//
+// The new box is placed into the free space after or before the old one if
+// it fits. Otherwise it is written after the old box if that is the last box
+// in the file, or appended to the file. Padding is left after a box that is
+// moved like this so that the next patch fits in the free space.
+//
+// Files that are not `durable` are not visible to anyone else yet, e.g. a
+// freshly remuxed output file. Their `moov` box is simply overwritten if the
+// new one fits and nothing is flushed.
+static int maw_mp4_write_moov(const char *filepath, int fd,
+                              const Mp4Layout *layout,
+                              const unsigned char *moov, size_t moov_size,
+                              bool durable) {
+    int r = RESULT_ERR_INTERNAL;
+    uint64_t moov_end = layout->moov.offset + layout->moov.size;
+    uint64_t after = layout->free_end - moov_end;
+    uint64_t before = layout->moov.offset - layout->free_start;
+    uint64_t inplace = layout->free_end - layout->moov.offset;
+    uint64_t offset;
+    uint64_t remaining;
+    uint64_t end;
+    bool first = false;
+    bool overwrite = false;
+
+    if (!durable && layout->tail) {
+        offset = layout->moov.offset;
+        remaining = moov_size + MP4_MOOV_PADDING;
+        overwrite = true;
+    }
+    else if (!durable && (inplace == moov_size ||
+                          inplace >= moov_size + MP4_BOX_HEADER_SIZE)) {
+        offset = layout->moov.offset;
+        remaining = inplace - moov_size;
+        overwrite = true;
+    }
+    else if (after == moov_size || after >= moov_size + MP4_BOX_HEADER_SIZE) {
+        MAW_LOGF(MAW_DEBUG, "%s: Writing moov box after current box",
+                 filepath);
+        offset = moov_end;
+        remaining = after - moov_size;
+    }
+    else if (before == moov_size ||
+             before >= moov_size + MP4_BOX_HEADER_SIZE) {
+        MAW_LOGF(MAW_DEBUG, "%s: Writing moov box before current box",
+                 filepath);
+        offset = layout->free_start;
+        remaining = before - moov_size;
+        first = true;
+    }
+    else if (layout->tail) {
+        MAW_LOGF(MAW_DEBUG, "%s: Extending file after moov box", filepath);
+        offset = moov_end;
+        remaining = moov_size + MP4_MOOV_PADDING;
+    }
+    else if (!layout->open_ended) {
+        MAW_LOGF(MAW_DEBUG, "%s: Moving moov box to end of file", filepath);
+        offset = layout->filesize;
+        remaining = moov_size + MP4_MOOV_PADDING;
+    }
+    else {
+        MAW_LOGF(MAW_DEBUG, "%s: Cannot append after open ended box",
+                 filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    // The padding is not written, only allocated. An overwritten last box
+    // may also be smaller than before.
+    end = offset + moov_size + remaining;
+    if ((end > layout->filesize || (overwrite && layout->tail)) &&
+        ftruncate(fd, (off_t)end) != 0) {
+        MAW_PERRORF("ftruncate", filepath);
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+
+    // The header is written last, a partially written box before the old
+    // one must not be mistaken for a `moov` box
+    if (remaining > 0) {
+        r = maw_mp4_write_free(fd, offset + moov_size, remaining);
+        if (r != 0)
+            goto end;
+    }
+    r = maw_mp4_pwrite(fd, moov + MP4_BOX_HEADER_SIZE,
+                       moov_size - MP4_BOX_HEADER_SIZE,
+                       offset + MP4_BOX_HEADER_SIZE);
+    if (r != 0)
+        goto end;
+
+    if (first && durable) {
+        r = maw_mp4_sync(filepath, fd);
+        if (r != 0)
+            goto end;
+    }
+
+    r = maw_mp4_pwrite(fd, moov, MP4_BOX_HEADER_SIZE, offset);
+    if (r != 0 || overwrite)
+        goto end;
+
+    if (durable) {
+        r = maw_mp4_sync(filepath, fd);
+        if (r != 0)
+            goto end;
+    }
+
+    // Turn the old box and the free space around it into one free box
+    if (first) {
+        r = maw_mp4_write_free(fd, offset + moov_size,
+                               layout->free_end - (offset + moov_size));
+    }
+    else {
+        r = maw_mp4_write_free(fd, layout->free_start,
+                               moov_end - layout->free_start);
+    }
+    if (r != 0)
+        goto end;
+
+    if (durable) {
+        r = maw_mp4_sync(filepath, fd);
+        if (r != 0)
+            goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Rewrite the metadata items in the `ilst` box of `filepath` without touching
+// the media data. Returns `RESULT_UNSUPPORTED_LAYOUT` if the file needs to be
+// remuxed instead.
+int maw_mp4_patch(const char *filepath, const Mp4Tags *tags, bool durable) {
+    int r = RESULT_ERR_INTERNAL;
+    int fd = -1;
+    struct stat s;
+    unsigned char *moov = NULL;
+    unsigned char *new_moov = NULL;
+    size_t new_moov_size;
+    Mp4Layout layout = {0};
+
+    fd = open(filepath, O_RDWR);
+    if (fd < 0) {
+        MAW_PERRORF("open", filepath);
+        goto end;
+    }
+
+    if (fstat(fd, &s) != 0) {
+        MAW_PERRORF("fstat", filepath);
+        goto end;
+    }
+
+    // Patching a file in place would modify all of its links, a remux only
+    // replaces the current one.
+    if (s.st_nlink > 1) {
+        MAW_LOGF(MAW_DEBUG, "%s: File has more than one link", filepath);
+        r = RESULT_UNSUPPORTED_LAYOUT;
+        goto end;
+    }
+
+    layout.filesize = (uint64_t)s.st_size;
+
+    r = maw_mp4_scan(filepath, fd, &layout);
+    if (r != 0)
+        goto end;
+
+    moov = calloc(layout.moov.size, sizeof(unsigned char));
+    if (moov == NULL) {
+        MAW_PERROR("calloc");
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+
+    r = maw_mp4_pread(fd, moov, layout.moov.size, layout.moov.offset);
+    if (r != 0)
+        goto end;
+
+    r = maw_mp4_rebuild_moov(filepath, moov, layout.moov.size, tags,
+                             &new_moov, &new_moov_size);
+    if (r != 0)
+        goto end;
+
+    r = maw_mp4_write_moov(filepath, fd, &layout, new_moov, new_moov_size,
+                           durable);
+    if (r != 0)
+        goto end;
+
+    MAW_LOGF(MAW_DEBUG, "%s: Patched metadata in place [%zu -> %zu byte(s)]",
+             filepath, (size_t)layout.moov.size, new_moov_size);
+    r = RESULT_OK;
+end:
+    free(moov);
+    free(new_moov);
+    if (fd >= 0)
+        (void)close(fd);
+    return r;
+}
@@ -0,0 +1,360 @@
+#include "maw/state.h"
+#include "maw/log.h"
+#include "maw/utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static size_t *maw_state_find(const MawState *state, uint64_t dev,
+                              uint64_t ino);
+static bool maw_state_insert(MawState *state, const MawStateRecord *record);
+static uint64_t maw_state_title_digest(uint64_t digest, const char *path);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static size_t *maw_state_find(const MawState *state, uint64_t dev,
+                              uint64_t ino) {
+    uint64_t key[2] = {dev, ino};
+    size_t mask = state->slot_count - 1;
+    size_t i = (size_t)hash64(key, sizeof key) & mask;
+    const MawStateRecord *record;
+
+    for (;;) {
+        if (state->slots[i] == 0)
+            return &state->slots[i];
+
+        record = &state->records[state->slots[i] - 1];
+        if (record->dev == dev && record->ino == ino)
+            return &state->slots[i];
+
+        i = (i + 1) & mask;
+    }
+}
+
+// Add a record or replace the record for the same file
+static bool maw_state_insert(MawState *state, const MawStateRecord *record) {
+    MawStateRecord *records;
+    size_t *slots;
+    size_t capacity;
+    size_t slot_count;
+    size_t *slot;
+
+    if (state->count == state->capacity) {
+        capacity = state->capacity > 0 ? state->capacity * 2
+                                       : MAW_STATE_INITIAL_SIZE;
+        records = realloc(state->records, capacity * sizeof(MawStateRecord));
+        if (records == NULL) {
+            MAW_PERROR("realloc");
+            return false;
+        }
+        state->records = records;
+        state->capacity = capacity;
+    }
+
+    if ((state->count + 1) * 2 > state->slot_count) {
+        slot_count = state->slot_count > 0 ? state->slot_count * 2
+                                           : MAW_STATE_INITIAL_SIZE * 2;
+        slots = calloc(slot_count, sizeof(size_t));
+        if (slots == NULL) {
+            MAW_PERROR("calloc");
+            return false;
+        }
+
+        free(state->slots);
+        state->slots = slots;
+        state->slot_count = slot_count;
+
+        for (size_t i = 0; i < state->count; i++) {
+            slot = maw_state_find(state, state->records[i].dev,
+                                  state->records[i].ino);
+            *slot = i + 1;
+        }
+    }
+
+    slot = maw_state_find(state, record->dev, record->ino);
+    if (*slot == 0) {
+        state->count++;
+        *slot = state->count;
+    }
+    state->records[*slot - 1] = *record;
+
+    return true;
+}
+
+int maw_state_path(char *out, size_t size) {
+    return cachepath("state", out, size);
+}
+
+// A missing or invalid state file is not an error, all files are then checked
+// as usual.
+int maw_state_load(const char *path, MawState *state) {
+    int r = RESULT_ERR_INTERNAL;
+    FILE *fp = NULL;
+    MawStateHeader header;
+    MawStateRecord record;
+
+    memset(state, 0, sizeof(MawState));
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        if (errno == ENOENT) {
+            MAW_LOGF(MAW_DEBUG, "%s: No state from previous runs", path);
+            r = RESULT_OK;
+        }
+        else {
+            MAW_PERRORF("fopen", path);
+        }
+        goto end;
+    }
+
+    if (fread(&header, sizeof header, 1, fp) != 1 ||
+        memcmp(header.magic, MAW_STATE_MAGIC, sizeof header.magic) != 0 ||
+        header.version != MAW_STATE_VERSION ||
+        header.record_size != sizeof(MawStateRecord)) {
+        MAW_LOGF(MAW_WARN, "%s: Ignoring invalid state file", path);
+        r = RESULT_OK;
+        goto end;
+    }
+
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (fread(&record, sizeof record, 1, fp) != 1) {
+            MAW_LOGF(MAW_WARN, "%s: Ignoring truncated state file", path);
+            maw_state_free(state);
+            r = RESULT_OK;
+            goto end;
+        }
+        if (!maw_state_insert(state, &record))
+            goto end;
+    }
+
+    MAW_LOGF(MAW_DEBUG, "%s: Loaded %zu record(s)", path, state->count);
+    r = RESULT_OK;
+end:
+    if (fp != NULL)
+        (void)fclose(fp);
+    return r;
+}
+
+// Write the state to a temporary file that replaces `path` once it is
+// complete, an interrupted run never leaves a partial state file behind.
+int maw_state_save(const char *path, const MawState *state) {
+    int r = RESULT_ERR_INTERNAL;
+    char tmpfile[MAW_PATH_MAX];
+    int fd = -1;
+    MawStateHeader header;
+    size_t records_size;
+
+    tmpfile[0] = '\0';
+
+    r = mkparents(path, 0700);
+    if (r != 0)
+        goto end;
+    r = RESULT_ERR_INTERNAL;
+
+    MAW_STRLCPY(tmpfile, path);
+    MAW_STRLCAT(tmpfile, ".XXXXXX");
+
+    fd = mkstemp(tmpfile);
+    if (fd < 0) {
+        MAW_PERRORF("mkstemp", tmpfile);
+        tmpfile[0] = '\0';
+        goto end;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, MAW_STATE_MAGIC, sizeof header.magic);
+    header.version = MAW_STATE_VERSION;
+    header.record_size = sizeof(MawStateRecord);
+    header.count = state->count;
+
+    MAW_WRITE(fd, &header, sizeof header);
+    records_size = state->count * sizeof(MawStateRecord);
+    if (records_size > 0) {
+        MAW_WRITE(fd, state->records, records_size);
+    }
+
+    if (close(fd) != 0) {
+        fd = -1;
+        MAW_PERRORF("close", tmpfile);
+        goto end;
+    }
+    fd = -1;
+
+    if (rename(tmpfile, path) != 0) {
+        MAW_PERRORF("rename", path);
+        goto end;
+    }
+    tmpfile[0] = '\0';
+
+    MAW_LOGF(MAW_DEBUG, "%s: Saved %zu record(s)", path, state->count);
+    r = RESULT_OK;
+end:
+    if (fd >= 0)
+        (void)close(fd);
+    if (tmpfile[0] != '\0')
+        (void)unlink(tmpfile);
+    return r;
+}
+
+// Digest of the desired metadata for a media file, a custom cover is
+// identified by the size and mtime of the cover file.
+uint64_t maw_state_digest(const Metadata *metadata) {
+    uint64_t digest = HASH64_INIT;
+    int32_t policies[2];
+    int64_t cover[2] = {0, 0};
+    struct stat s;
+
+    digest = hash64_update_str(digest, metadata->title);
+    digest = hash64_update_str(digest, metadata->album);
+    digest = hash64_update_str(digest, metadata->artist);
+    digest = hash64_update_str(digest, metadata->cover_path);
+
+    policies[0] = (int32_t)metadata->cover_policy;
+    policies[1] = (int32_t)metadata->clean_policy;
+    digest = hash64_update(digest, policies, sizeof policies);
+
+    if (metadata->cover_policy == COVER_POLICY_PATH &&
+        metadata->cover_path != NULL && stat(metadata->cover_path, &s) == 0) {
+        cover[0] = (int64_t)s.st_size;
+        cover[1] = (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+    }
+    digest = hash64_update(digest, cover, sizeof cover);
+
+    return digest;
+}
+
+// Media files without a configured title are named after the file, renaming
+// them keeps the inode, size and mtime so the resolved title is added.
+static uint64_t maw_state_title_digest(uint64_t digest, const char *path) {
+    char title[MAW_PATH_MAX];
+
+    // Such a path fails to update anyway
+    if (basename_no_ext(path, title, sizeof title) != 0)
+        return digest;
+
+    return hash64_update_str(digest, title);
+}
+
+// Set `metadata_digest` for all media files and mark the ones that are
+// unchanged since the last run, returns the number of unchanged files.
+size_t maw_state_mark(const MawState *state, MediaFiles *mediafiles) {
+    const Metadata *metadata = NULL;
+    uint64_t metadata_digest = 0;
+    const MawStateRecord *record;
+    MediaFile *mediafile;
+    size_t *slot;
+    size_t unchanged = 0;
+
+    for (size_t i = 0; i < mediafiles->count; i++) {
+        mediafile = &mediafiles->items[i];
+
+        // Media files that share a configuration entry are next to each
+        // other, the digest is rarely recomputed.
+        if (mediafile->metadata != metadata) {
+            metadata = mediafile->metadata;
+            metadata_digest = maw_state_digest(metadata);
+        }
+        mediafile->metadata_digest =
+            metadata->title != NULL
+                ? metadata_digest
+                : maw_state_title_digest(metadata_digest, mediafile->path);
+        mediafile->unchanged = false;
+
+        if (state->count == 0)
+            continue;
+
+        slot = maw_state_find(state, (uint64_t)mediafile->dev,
+                              (uint64_t)mediafile->ino);
+        if (*slot == 0)
+            continue;
+
+        record = &state->records[*slot - 1];
+        if (record->size == (int64_t)mediafile->size &&
+            record->mtime_ns == mediafile->mtime_ns &&
+            record->metadata_digest == mediafile->metadata_digest) {
+            mediafile->unchanged = true;
+            unchanged++;
+        }
+    }
+
+    return unchanged;
+}
+
+// Replace the records of all media files with their state after a run. Files
+// that were not brought up to date lose their record. Records of other files
+// are kept, they may be outside of the directories that were updated.
+int maw_state_record(MawState *state, const MediaFiles *mediafiles) {
+    int r = RESULT_ERR_INTERNAL;
+    MawState next = {0};
+    bool *claimed = NULL;
+    const MediaFile *mediafile;
+    MawStateRecord record;
+    struct stat s;
+    size_t *slot;
+
+    if (state->count > 0) {
+        claimed = calloc(state->count, sizeof(bool));
+        if (claimed == NULL) {
+            MAW_PERROR("calloc");
+            goto end;
+        }
+        for (size_t i = 0; i < mediafiles->count; i++) {
+            slot = maw_state_find(state, (uint64_t)mediafiles->items[i].dev,
+                                  (uint64_t)mediafiles->items[i].ino);
+            if (*slot != 0) {
+                claimed[*slot - 1] = true;
+            }
+        }
+        for (size_t i = 0; i < state->count; i++) {
+            if (!claimed[i] && !maw_state_insert(&next, &state->records[i]))
+                goto end;
+        }
+    }
+
+    for (size_t i = 0; i < mediafiles->count; i++) {
+        mediafile = &mediafiles->items[i];
+        if (!mediafile->done)
+            continue;
+
+        if (mediafile->unchanged) {
+            record.dev = (uint64_t)mediafile->dev;
+            record.ino = (uint64_t)mediafile->ino;
+            record.size = (int64_t)mediafile->size;
+            record.mtime_ns = mediafile->mtime_ns;
+        }
+        else {
+            // Rewritten files have a new inode and patched files a new mtime
+            if (stat(mediafile->path, &s) != 0) {
+                MAW_PERRORF("stat", mediafile->path);
+                continue;
+            }
+            record.dev = (uint64_t)s.st_dev;
+            record.ino = (uint64_t)s.st_ino;
+            record.size = (int64_t)s.st_size;
+            record.mtime_ns =
+                (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+        }
+        record.metadata_digest = mediafile->metadata_digest;
+
+        if (!maw_state_insert(&next, &record))
+            goto end;
+    }
+
+    maw_state_free(state);
+    *state = next;
+    memset(&next, 0, sizeof next);
+
+    r = RESULT_OK;
+end:
+    free(claimed);
+    maw_state_free(&next);
+    return r;
+}
+
+void maw_state_free(MawState *state) {
+    free(state->records);
+    free(state->slots);
+    memset(state, 0, sizeof(MawState));
+}
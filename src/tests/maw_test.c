@@ -1,12 +1,20 @@
 #include "maw/tests/maw_test.h"
+#include "maw/arena.h"
+#include "maw/av.h"
 #include "maw/cfg.h"
+#include "maw/cfgcache.h"
+#include "maw/cover.h"
+#include "maw/match.h"
 #include "maw/maw.h"
 #include "maw/playlists.h"
+#include "maw/state.h"
 #include "maw/tests/maw_verify.h"
 #include "maw/threads.h"
 #include "maw/update.h"
 #include "maw/utils.h"
+#include "maw/walk.h"
 
+#include <fcntl.h>
 #include <libavutil/error.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -244,6 +252,29 @@ static bool test_noop_cover_crop(const char *desc) {
     return true;
 }
 
+// The second file should be cropped with the pipeline (or the cached crop)
+// from the first one.
+static bool test_crop_reuse(const char *desc) {
+    int r;
+    const Metadata metadata = {
+        .cover_policy = COVER_POLICY_CROP,
+    };
+    const MediaFile mediafiles[] = {
+        {.path = "./.testenv/unit/crop_reuse_1.m4a", .metadata = &metadata},
+        {.path = "./.testenv/unit/crop_reuse_2.m4a", .metadata = &metadata},
+    };
+    (void)desc;
+
+    for (size_t i = 0; i < sizeof(mediafiles) / sizeof(MediaFile); i++) {
+        r = maw_update(&mediafiles[i], false);
+        MAW_ASSERT_EQ(RESULT_OK, r, mediafiles[i].path);
+        r = maw_verify(&mediafiles[i]);
+        MAW_ASSERT_EQ(true, r, mediafiles[i].path);
+    }
+
+    return true;
+}
+
 static bool test_noop_nocover_crop(const char *desc) {
     int r;
     const Metadata metadata = {
@@ -322,8 +353,335 @@ static bool test_noop_crop_unsupported(const char *desc) {
     return true;
 }
 
+// The output file replaces the input file with a rename, the permissions of
+// the input file should be kept.
+static bool test_keep_mode(const char *desc) {
+    int r;
+    struct stat s;
+    const Metadata metadata = {.title = "Keep mode",
+                               .cover_policy = COVER_POLICY_CLEAR};
+    const MediaFile mediafile = {.path = "./.testenv/unit/keep_mode.m4a",
+                                 .metadata = &metadata};
+    (void)desc;
+
+    if (chmod(mediafile.path, 0640) != 0) {
+        MAW_PERRORF("chmod", mediafile.path);
+        return false;
+    }
+
+    r = maw_update(&mediafile, false);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    if (stat(mediafile.path, &s) != 0) {
+        MAW_PERRORF("stat", mediafile.path);
+        return false;
+    }
+    MAW_ASSERT_EQ(0640, (int)(s.st_mode & 07777), "File mode has changed");
+
+    return true;
+}
+
+// In-place patching ///////////////////////////////////////////////////////////
+
+// Metadata only changes should be written to the original file, i.e. the inode
+// of the file should not change.
+#define PATCH_CHECK(m) \
+    do { \
+        struct stat s_before; \
+        struct stat s_after; \
+        if (stat(m.path, &s_before) != 0) { \
+            MAW_PERRORF("stat", m.path); \
+            return false; \
+        } \
+\
+        NOOP_CHECK(m); \
+\
+        if (stat(m.path, &s_after) != 0) { \
+            MAW_PERRORF("stat", m.path); \
+            return false; \
+        } \
+\
+        MAW_ASSERT_EQ((int)s_before.st_ino, (int)s_after.st_ino, \
+                      "File was replaced"); \
+    } while (0)
+
+static bool test_patch_inplace(const char *desc) {
+    int r;
+    const Metadata metadata = {
+        .title = "Patched title",
+        .album = "Patched album",
+        .artist = "Patched artist",
+        .cover_policy = COVER_POLICY_KEEP,
+    };
+    const MediaFile mediafile = {.path = "./.testenv/unit/patch_inplace.m4a",
+                                 .metadata = &metadata};
+    (void)desc;
+
+    PATCH_CHECK(mediafile);
+
+    return true;
+}
+
+static bool test_patch_inplace_faststart(const char *desc) {
+    int r;
+    const Metadata metadata = {
+        .title = "Patched title that is longer than the original one",
+        .album = "Patched album",
+        .cover_policy = COVER_POLICY_KEEP,
+    };
+    const MediaFile mediafile = {
+        .path = "./.testenv/unit/patch_inplace_faststart.m4a",
+        .metadata = &metadata};
+    (void)desc;
+
+    PATCH_CHECK(mediafile);
+
+    return true;
+}
+
+// The header probe should detect a pending cover change and report NOOP once
+// the file has been updated.
+static bool test_probe(const char *desc) {
+    int r;
+    const Metadata metadata = {
+        .title = "Probed title",
+        .cover_policy = COVER_POLICY_PATH,
+        .cover_path = "./.testenv/art/blue-1.png",
+        .clean_policy = CLEAN_POLICY_TRUE,
+    };
+    const MediaFile mediafile = {.path = "./.testenv/unit/probe.m4a",
+                                 .metadata = &metadata};
+    (void)desc;
+
+    r = maw_av_probe(&mediafile);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    r = maw_update(&mediafile, false);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    r = maw_av_probe(&mediafile);
+    MAW_ASSERT_EQ(RESULT_NOOP, r, desc);
+
+    return true;
+}
+
+// Updated files should carry a fingerprint of the applied configuration, it
+// should change whenever the metadata does.
+static bool test_fingerprint(const char *desc) {
+    int r;
+    bool ok;
+    char before[MAW_AV_FINGERPRINT_SIZE];
+    char after[MAW_AV_FINGERPRINT_SIZE];
+    Metadata metadata = {
+        .title = "Fingerprinted title",
+        .cover_policy = COVER_POLICY_CLEAR,
+        .clean_policy = CLEAN_POLICY_TRUE,
+    };
+    const MediaFile mediafile = {.path = "./.testenv/unit/fingerprint.m4a",
+                                 .metadata = &metadata};
+
+    // Remuxed files get a fingerprint, the next check only needs to read it
+    r = maw_update(&mediafile, false);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = maw_verify(&mediafile) &&
+         maw_verify_fingerprint(mediafile.path, before, sizeof before);
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    r = maw_av_probe(&mediafile);
+    MAW_ASSERT_EQ(RESULT_NOOP, r, desc);
+
+    // Patching in place replaces the fingerprint
+    metadata.title = "Fingerprinted title (patched)";
+    r = maw_av_probe(&mediafile);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    PATCH_CHECK(mediafile);
+
+    ok = maw_verify_fingerprint(mediafile.path, after, sizeof after) &&
+         !STR_EQ(before, after);
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    r = maw_av_probe(&mediafile);
+    MAW_ASSERT_EQ(RESULT_NOOP, r, desc);
+
+    return true;
+}
+
+static bool test_plan(const char *desc) {
+    int r;
+    unsigned int changes;
+    unsigned int expected;
+    struct stat s_before;
+    struct stat s_after;
+    Metadata metadata = {
+        .title = "Plan",
+        .artist = "Artist",
+        .album = "Album",
+        .cover_policy = COVER_POLICY_KEEP,
+    };
+    const MediaFile mediafile = {.path = "./.testenv/unit/plan.m4a",
+                                 .metadata = &metadata};
+
+    r = stat(mediafile.path, &s_before);
+    MAW_ASSERT_EQ(0, r, desc);
+
+    r = maw_av_plan(&mediafile, &changes);
+    MAW_ASSERT_EQ(RESULT_NOOP, r, desc);
+    MAW_ASSERT_EQ(0, (int)changes, desc);
+
+    metadata.artist = "Other artist";
+    metadata.cover_policy = COVER_POLICY_CROP;
+    metadata.clean_policy = CLEAN_POLICY_TRUE;
+    expected = MAW_AV_CHANGE_ARTIST | MAW_AV_CHANGE_CLEAN | MAW_AV_CHANGE_CROP;
+    r = maw_av_plan(&mediafile, &changes);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    MAW_ASSERT_EQ((int)expected, (int)changes, desc);
+
+    // Dry runs never write to the media file
+    r = maw_update(&mediafile, true);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = stat(mediafile.path, &s_after);
+    MAW_ASSERT_EQ(0, r, desc);
+    MAW_ASSERT_EQ((int)s_before.st_ino, (int)s_after.st_ino, desc);
+    MAW_ASSERT_EQ((int)s_before.st_mtime, (int)s_after.st_mtime, desc);
+
+    return true;
+}
+
+static bool test_output_tree(const char *desc) {
+    int r;
+    bool ok;
+    struct stat s_input;
+    struct stat s_before;
+    struct stat s_after;
+    Metadata metadata = {.cover_policy = COVER_POLICY_KEEP};
+    const MediaFile mediafile = {
+        .path = "./.testenv/unit/output.m4a",
+        .output_path = "./.testenv/output/unit/output.m4a",
+        .metadata = &metadata};
+    const MediaFile output = {.path = mediafile.output_path,
+                              .metadata = &metadata};
+
+    (void)unlink(mediafile.output_path);
+    r = stat(mediafile.path, &s_before);
+    MAW_ASSERT_EQ(0, r, desc);
+
+    // Unchanged files are placed in the output tree without a copy if the
+    // filesystem allows it
+    r = maw_update(&mediafile, false);
+    MAW_ASSERT_EQ(RESULT_NOOP, r, desc);
+    r = stat(mediafile.output_path, &s_after);
+    MAW_ASSERT_EQ(0, r, desc);
+    MAW_ASSERT_EQ((int)s_before.st_size, (int)s_after.st_size, desc);
+
+    // Changed files are written to the output tree only
+    metadata.title = "Mirrored title";
+    r = maw_update(&mediafile, false);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_verify(&output);
+    MAW_ASSERT_EQ(true, r, desc);
+
+    r = stat(mediafile.path, &s_input);
+    MAW_ASSERT_EQ(0, r, desc);
+    ok = s_input.st_ino == s_before.st_ino &&
+         s_input.st_mtime == s_before.st_mtime &&
+         s_input.st_nlink == 1;
+    MAW_ASSERT_EQ(true, ok, "Input file was modified");
+
+    return true;
+}
+
 // Covers //////////////////////////////////////////////////////////////////////
 
+// Covers with the same path should only be loaded once
+static bool test_cover_cache(const char *desc) {
+    int r;
+    MawCover *first = NULL;
+    MawCover *second = NULL;
+    char *data = NULL;
+    size_t size;
+    bool same;
+    const char *path = "./.testenv/art/blue-1.png";
+
+    r = maw_cover_get(path, &first);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_cover_get(path, &second);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    same = first == second;
+    MAW_ASSERT_EQ(true, same, "Cover was loaded twice");
+
+    size = readfile(path, &data);
+    same = size == first->buf->size && hash64(data, size) == first->digest;
+    free(data);
+    MAW_ASSERT_EQ(true, same, desc);
+
+    maw_cover_put(first);
+    maw_cover_put(second);
+
+    r = maw_cover_get("./does_not_exist", &first);
+    MAW_ASSERT_EQ(AVERROR(ENOENT), r, desc);
+
+    return true;
+}
+
+// A crop result should be returned for every packet with identical data, even
+// after the packets that the crop was created from have been freed
+static bool test_crop_cache(const char *desc) {
+    int r;
+    bool same;
+    const uint8_t input[] = "original cover";
+    const uint8_t other[] = "original cov3r";
+    const uint8_t output[] = "cropped cover";
+    AVPacket *pkt = NULL;
+    AVPacket *cropped_pkt = NULL;
+    AVBufferRef *cropped = NULL;
+    MawCrop *pending = NULL;
+
+    pkt = av_packet_alloc();
+    cropped_pkt = av_packet_alloc();
+    same = pkt != NULL && cropped_pkt != NULL &&
+           av_new_packet(pkt, (int)sizeof input) == 0 &&
+           av_new_packet(cropped_pkt, (int)sizeof output) == 0;
+    MAW_ASSERT_EQ(true, same, desc);
+    memcpy(pkt->data, input, sizeof input);
+    memcpy(cropped_pkt->data, output, sizeof output);
+
+    r = maw_cover_crop_get(pkt, &cropped, &pending);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    same = cropped == NULL && pending != NULL;
+    MAW_ASSERT_EQ(true, same, "Unexpected crop cache hit");
+
+    maw_cover_crop_set(pending, cropped_pkt);
+    av_packet_free(&cropped_pkt);
+
+    // The cache must not refer to the data of freed packets
+    memset(pkt->data, 0, sizeof input);
+    av_packet_unref(pkt);
+    r = av_new_packet(pkt, (int)sizeof input);
+    MAW_ASSERT_EQ(0, r, desc);
+    memcpy(pkt->data, input, sizeof input);
+
+    r = maw_cover_crop_get(pkt, &cropped, &pending);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    same = cropped != NULL && pending == NULL &&
+           cropped->size == sizeof output &&
+           memcmp(cropped->data, output, sizeof output) == 0;
+    av_buffer_unref(&cropped);
+    MAW_ASSERT_EQ(true, same, "Expected crop cache hit");
+
+    // Packets of the same size with different data are different covers
+    memcpy(pkt->data, other, sizeof other);
+    r = maw_cover_crop_get(pkt, &cropped, &pending);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    same = cropped == NULL && pending != NULL;
+    MAW_ASSERT_EQ(true, same, "Unexpected crop cache hit");
+    maw_cover_crop_set(pending, NULL);
+
+    av_packet_free(&pkt);
+
+    return true;
+}
+
 static bool test_bad_covers(const char *desc) {
     int r;
     // clang-format off
@@ -380,10 +738,137 @@ static bool test_threads_ok(const char *desc) {
         {.path = ".testenv/albums/red/audio_red_2.m4a",
          .metadata = &cfg_arr[3]},
     };
+    MawArguments args = {.thread_count = 1, .dry_run = false};
+    size_t mediafiles_count = sizeof(mediafiles) / sizeof(MediaFile);
+
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    for (size_t i = 0; i < mediafiles_count; i++) {
+        r = maw_verify(&mediafiles[i]);
+        MAW_ASSERT_EQ(true, r, desc);
+    }
+
+    return true;
+}
+
+// Threads without a job should exit as soon as the queue is empty
+static bool test_threads_idle(const char *desc) {
+    int r;
+    Metadata cfg_arr[] = {
+        {.title = "audio_red_0", .album = "Idle red"},
+        {.title = "audio_red_1", .album = "Idle red"},
+    };
+    MediaFile mediafiles[] = {
+        {.path = ".testenv/albums/red/audio_red_0.m4a",
+         .metadata = &cfg_arr[0]},
+        {.path = ".testenv/albums/red/audio_red_1.m4a",
+         .metadata = &cfg_arr[1]},
+    };
+    MawArguments args = {.thread_count = 8, .dry_run = false};
+    size_t mediafiles_count = sizeof(mediafiles) / sizeof(MediaFile);
+
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    for (size_t i = 0; i < mediafiles_count; i++) {
+        r = maw_verify(&mediafiles[i]);
+        MAW_ASSERT_EQ(true, r, desc);
+    }
+
+    return true;
+}
+
+// More probe threads than rewrite threads, every file that needs a change
+// has to go through the single rewrite thread.
+static bool test_threads_pipeline(const char *desc) {
+    int r;
+    Metadata cfg_arr[] = {
+        {.title = "audio_red_0", .album = "Pipeline red"},
+        {.title = "audio_red_1", .album = "Pipeline red"},
+        {.title = "audio_red_2", .album = "Pipeline red"},
+        {.title = "audio_red_3", .album = "Pipeline red"},
+    };
+    MediaFile mediafiles[] = {
+        {.path = ".testenv/albums/red/audio_red_0.m4a",
+         .metadata = &cfg_arr[0]},
+        {.path = ".testenv/albums/red/audio_red_1.m4a",
+         .metadata = &cfg_arr[1]},
+        {.path = ".testenv/albums/red/audio_red_2.m4a",
+         .metadata = &cfg_arr[2]},
+        {.path = ".testenv/albums/red/audio_red_3.m4a",
+         .metadata = &cfg_arr[3]},
+    };
+    MawArguments args = {
+        .thread_count = 4, .rewrite_thread_count = 1, .dry_run = false};
+    size_t mediafiles_count = sizeof(mediafiles) / sizeof(MediaFile);
+
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    for (size_t i = 0; i < mediafiles_count; i++) {
+        r = maw_verify(&mediafiles[i]);
+        MAW_ASSERT_EQ(true, r, desc);
+    }
+
+    // A second run should be decided by the probe stage alone
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    return true;
+}
+
+// The number of threads is picked at runtime
+static bool test_threads_auto(const char *desc) {
+    int r;
+    Metadata cfg_arr[] = {
+        {.title = "audio_red_0", .album = "Auto red"},
+        {.title = "audio_red_1", .album = "Auto red"},
+        {.title = "audio_red_2", .album = "Auto red"},
+    };
+    MediaFile mediafiles[] = {
+        {.path = ".testenv/albums/red/audio_red_0.m4a",
+         .metadata = &cfg_arr[0]},
+        {.path = ".testenv/albums/red/audio_red_1.m4a",
+         .metadata = &cfg_arr[1]},
+        {.path = ".testenv/albums/red/audio_red_2.m4a",
+         .metadata = &cfg_arr[2]},
+    };
+    MawArguments args = {.thread_count = MAW_THREADS_AUTO, .dry_run = false};
+    size_t mediafiles_count = sizeof(mediafiles) / sizeof(MediaFile);
 
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    for (size_t i = 0; i < mediafiles_count; i++) {
+        r = maw_verify(&mediafiles[i]);
+        MAW_ASSERT_EQ(true, r, desc);
+    }
+
+    return true;
+}
+
+// All files are on the same device, only one of them is processed at a time
+static bool test_threads_device_limit(const char *desc) {
+    int r;
+    Metadata cfg_arr[] = {
+        {.title = "audio_red_0", .album = "Device red"},
+        {.title = "audio_red_1", .album = "Device red"},
+        {.title = "audio_red_2", .album = "Device red"},
+    };
+    MediaFile mediafiles[] = {
+        {.path = ".testenv/albums/red/audio_red_0.m4a",
+         .metadata = &cfg_arr[0]},
+        {.path = ".testenv/albums/red/audio_red_1.m4a",
+         .metadata = &cfg_arr[1]},
+        {.path = ".testenv/albums/red/audio_red_2.m4a",
+         .metadata = &cfg_arr[2]},
+    };
+    MawArguments args = {
+        .thread_count = 4, .device_limit = 1, .dry_run = false};
     size_t mediafiles_count = sizeof(mediafiles) / sizeof(MediaFile);
 
-    r = maw_threads_launch(mediafiles, mediafiles_count, 1, false);
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
     for (size_t i = 0; i < mediafiles_count; i++) {
@@ -421,9 +906,10 @@ static bool test_threads_error(const char *desc) {
         {.path = ".testenv/albums/red/audio_red_3.m4a",
          .metadata = &cfg_arr[3]},
     };
+    MawArguments args = {.thread_count = 2, .dry_run = false};
     size_t mediafiles_count = sizeof(cfg_arr) / sizeof(Metadata);
 
-    r = maw_threads_launch(mediafiles, mediafiles_count, 2, false);
+    r = maw_threads_launch(mediafiles, mediafiles_count, &args);
     MAW_ASSERT_EQ(-1, r, desc);
 
     return true;
@@ -433,8 +919,7 @@ static bool test_update(const char *desc) {
     int r;
     const char *config_path = ".testenv/maw.yml";
     MawConfig *cfg = NULL;
-    MediaFile mediafiles[MAW_MAX_FILES];
-    size_t mediafiles_count = 0;
+    MediaFiles mediafiles = {0};
     char *folders[] = {"red"};
     size_t music_dir_pathlen;
     MawArguments args = {.cmd_args = folders,
@@ -445,27 +930,26 @@ static bool test_update(const char *desc) {
     r = maw_cfg_parse(config_path, &cfg);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
-    r = maw_update_load(cfg, &args, mediafiles, &mediafiles_count);
+    r = maw_update_load(cfg, &args, &mediafiles);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
     // Only paths starting with 'red' should have been included
     music_dir_pathlen = strlen(cfg->music_dir) + 1;
-    for (size_t i = 0; i < mediafiles_count; i++) {
-        r = STR_HAS_PREFIX(mediafiles[i].path + music_dir_pathlen, "red");
+    for (size_t i = 0; i < mediafiles.count; i++) {
+        r = STR_HAS_PREFIX(mediafiles.items[i].path + music_dir_pathlen, "red");
         MAW_ASSERT_EQ(true, r, desc);
     }
 
-    r = maw_threads_launch(mediafiles, mediafiles_count, args.thread_count,
-                           args.dry_run);
+    r = maw_threads_launch(mediafiles.items, mediafiles.count, &args);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
-    for (size_t i = 0; i < mediafiles_count; i++) {
-        r = maw_verify(&mediafiles[i]);
+    for (size_t i = 0; i < mediafiles.count; i++) {
+        r = maw_verify(&mediafiles.items[i]);
         MAW_ASSERT_EQ(true, r, desc);
     }
 
     maw_cfg_free(cfg);
-    maw_update_free(mediafiles, mediafiles_count);
+    maw_update_free(&mediafiles);
 
     return true;
 }
@@ -474,8 +958,7 @@ static bool test_update_override(const char *desc) {
     int r;
     const char *config_path = ".testenv/maw.yml";
     MawConfig *cfg = NULL;
-    MediaFile mediafiles[MAW_MAX_FILES];
-    size_t mediafiles_count = 0;
+    MediaFiles mediafiles = {0};
     size_t music_dir_pathlen;
     MawArguments args = {.cmd_args = NULL,
                          .cmd_args_count = 0,
@@ -485,32 +968,75 @@ static bool test_update_override(const char *desc) {
     r = maw_cfg_parse(config_path, &cfg);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
-    r = maw_update_load(cfg, &args, mediafiles, &mediafiles_count);
+    r = maw_update_load(cfg, &args, &mediafiles);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
     // Only paths starting with 'blue' should have been included
     music_dir_pathlen = strlen(cfg->music_dir) + 1;
-    for (size_t i = 0; i < mediafiles_count; i++) {
+    for (size_t i = 0; i < mediafiles.count; i++) {
         // The blue/audio_blue_2.m4a entry specifies the 'NONE' keyword for
         // 'cover', this should result in the original cover being kept.
-        if (STR_EQ(mediafiles[i].path + music_dir_pathlen,
+        if (STR_EQ(mediafiles.items[i].path + music_dir_pathlen,
                    "blue/audio_blue_2.m4a")) {
-            r = mediafiles[i].metadata->cover_policy == COVER_POLICY_KEEP;
+            r = mediafiles.items[i].metadata->cover_policy == COVER_POLICY_KEEP;
             MAW_ASSERT_EQ(true, r, desc);
         }
     }
 
-    r = maw_threads_launch(mediafiles, mediafiles_count, args.thread_count,
-                           args.dry_run);
+    r = maw_threads_launch(mediafiles.items, mediafiles.count, &args);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
-    for (size_t i = 0; i < mediafiles_count; i++) {
-        r = maw_verify(&mediafiles[i]);
+    for (size_t i = 0; i < mediafiles.count; i++) {
+        r = maw_verify(&mediafiles.items[i]);
         MAW_ASSERT_EQ(true, r, desc);
     }
 
     maw_cfg_free(cfg);
-    maw_update_free(mediafiles, mediafiles_count);
+    maw_update_free(&mediafiles);
+
+    return true;
+}
+
+static bool test_update_scoped(const char *desc) {
+    int r;
+    bool ok;
+    const char *config_path = ".testenv/maw.yml";
+    MawConfig *cfg = NULL;
+    MediaFiles mediafiles = {0};
+    char *paths[] = {"./red/audio_red_1.m4a", "blue/audio_blue_2.m4a",
+                     "red//audio_red_1.m4a"};
+    MawArguments args = {.cmd_args = paths, .cmd_args_count = 3};
+    const Metadata *metadata;
+    const char *path;
+    size_t music_dir_pathlen;
+
+    r = maw_cfg_parse(config_path, &cfg);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    r = maw_update_load(cfg, &args, &mediafiles);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    // Both spellings of the same path refer to one file
+    MAW_ASSERT_EQ(2, (int)mediafiles.count, desc);
+
+    // Entries for parent directories also apply to single files
+    music_dir_pathlen = strlen(cfg->music_dir) + 1;
+    for (size_t i = 0; i < mediafiles.count; i++) {
+        path = mediafiles.items[i].path + music_dir_pathlen;
+        metadata = mediafiles.items[i].metadata;
+        if (STR_EQ(path, "red/audio_red_1.m4a")) {
+            ok = STR_EQ("Red album", metadata->album);
+        }
+        else {
+            ok = STR_EQ(path, "blue/audio_blue_2.m4a") &&
+                 STR_EQ("Blue album", metadata->album) &&
+                 metadata->cover_policy == COVER_POLICY_KEEP;
+        }
+        MAW_ASSERT_EQ(true, ok, path);
+    }
+
+    maw_cfg_free(cfg);
+    maw_update_free(&mediafiles);
 
     return true;
 }
@@ -547,18 +1073,17 @@ static bool test_cfg_ok(const char *desc) {
     int r;
     const char *config_path = ".testenv/maw.yml";
     MawConfig *cfg = NULL;
-    MediaFile mediafiles[MAW_MAX_FILES];
-    size_t mediafiles_count = 0;
+    MediaFiles mediafiles = {0};
     MawArguments args = {0};
 
     r = maw_cfg_parse(config_path, &cfg);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
-    r = maw_update_load(cfg, &args, mediafiles, &mediafiles_count);
+    r = maw_update_load(cfg, &args, &mediafiles);
     MAW_ASSERT_EQ(RESULT_OK, r, desc);
 
     maw_cfg_free(cfg);
-    maw_update_free(mediafiles, mediafiles_count);
+    maw_update_free(&mediafiles);
 
     return true;
 }
@@ -588,6 +1113,325 @@ static bool test_cfg_error(const char *desc) {
     return true;
 }
 
+static bool str_eq_nullable(const char *lhs, const char *rhs) {
+    if (lhs == NULL || rhs == NULL)
+        return lhs == rhs;
+    return STR_EQ(lhs, rhs);
+}
+
+static bool test_cfg_cache(const char *desc) {
+    int r;
+    bool ok;
+    const char *config_path = ".testenv/maw.yml";
+    const char *cache_path = ".testenv/cfgcache/maw.cfgcache";
+    MawCfgCacheKey key;
+    MawConfig *parsed = NULL;
+    MawConfig *cached = NULL;
+    MetadataEntry *m1;
+    MetadataEntry *m2;
+    PlaylistEntry *p1;
+    PlaylistEntry *p2;
+    PlaylistPath *pp1;
+    PlaylistPath *pp2;
+
+    r = maw_cfgcache_key(config_path, &key);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_cfg_parse(config_path, &parsed);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    // Nothing is loaded without a previous run
+    (void)unlink(cache_path);
+    r = maw_cfgcache_load(cache_path, &key, &cached);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = cached == NULL;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    r = maw_cfgcache_save(cache_path, &key, parsed);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_cfgcache_load(cache_path, &key, &cached);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = cached != NULL;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    ok = str_eq_nullable(parsed->art_dir, cached->art_dir) &&
+         str_eq_nullable(parsed->music_dir, cached->music_dir);
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    // Entries are loaded in the order that they were parsed in
+    m2 = TAILQ_FIRST(&cached->metadata_head);
+    TAILQ_FOREACH(m1, &parsed->metadata_head, entry) {
+        ok = m2 != NULL && STR_EQ(m1->pattern, m2->pattern) &&
+             str_eq_nullable(m1->value.title, m2->value.title) &&
+             str_eq_nullable(m1->value.album, m2->value.album) &&
+             str_eq_nullable(m1->value.artist, m2->value.artist) &&
+             str_eq_nullable(m1->value.cover_path, m2->value.cover_path) &&
+             m1->value.cover_policy == m2->value.cover_policy &&
+             m1->value.clean_policy == m2->value.clean_policy;
+        MAW_ASSERT_EQ(true, ok, m1->pattern);
+        m2 = TAILQ_NEXT(m2, entry);
+    }
+    ok = m2 == NULL;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    p2 = TAILQ_FIRST(&cached->playlists_head);
+    TAILQ_FOREACH(p1, &parsed->playlists_head, entry) {
+        ok = p2 != NULL && STR_EQ(p1->value.name, p2->value.name);
+        MAW_ASSERT_EQ(true, ok, desc);
+
+        pp2 = TAILQ_FIRST(&p2->value.playlist_paths_head);
+        TAILQ_FOREACH(pp1, &p1->value.playlist_paths_head, entry) {
+            ok = pp2 != NULL && STR_EQ(pp1->path, pp2->path);
+            MAW_ASSERT_EQ(true, ok, p1->value.name);
+            pp2 = TAILQ_NEXT(pp2, entry);
+        }
+        ok = pp2 == NULL;
+        MAW_ASSERT_EQ(true, ok, desc);
+        p2 = TAILQ_NEXT(p2, entry);
+    }
+    ok = p2 == NULL;
+    MAW_ASSERT_EQ(true, ok, desc);
+    maw_cfg_free(cached);
+    cached = NULL;
+
+    // A cache for another version of the configuration is never used
+    key.digest++;
+    r = maw_cfgcache_load(cache_path, &key, &cached);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = cached == NULL;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    maw_cfg_free(parsed);
+
+    return true;
+}
+
+static bool test_linkfile(const char *desc) {
+    int r;
+    bool same;
+    enum LinkStrategy strategy;
+    char *expected = NULL;
+    char *actual = NULL;
+    size_t expected_size;
+    size_t actual_size;
+    const char *src = "./README.md";
+    const char *linked = "./.testenv/linkfile.linked";
+
+    r = linkfile(src, linked, &strategy);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    same = strategy != LINK_STRATEGY_NONE;
+    MAW_ASSERT_EQ(true, same, linkfile_strategy_tostr(strategy));
+
+    // Linking again should replace the file
+    r = linkfile(src, linked, &strategy);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    expected_size = readfile(src, &expected);
+    actual_size = readfile(linked, &actual);
+    same = expected_size > 0 && expected_size == actual_size &&
+           memcmp(expected, actual, expected_size) == 0;
+    free(expected);
+    free(actual);
+    (void)unlink(linked);
+    MAW_ASSERT_EQ(true, same, "Linked file differs");
+
+    return true;
+}
+
+// Every regular file beneath the root should be found, hidden files excluded
+static bool test_walk(const char *desc) {
+    int r;
+    bool ok;
+    WalkResult result = {0};
+
+    r = maw_walk(".testenv/albums", &result);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+
+    ok = result.count > 0;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    for (size_t i = 0; i < result.count; i++) {
+        ok = S_ISREG(result.entries[i].stat.st_mode) &&
+             strstr(result.entries[i].path, "/.") == NULL &&
+             (i == 0 ||
+              strcmp(result.entries[i - 1].path, result.entries[i].path) < 0);
+        MAW_ASSERT_EQ(true, ok, result.entries[i].path);
+    }
+
+    maw_walk_free(&result);
+
+    r = maw_walk(".testenv/nonexistent", &result);
+    MAW_ASSERT_EQ(RESULT_ERR_INTERNAL, r, desc);
+
+    return true;
+}
+
+static bool test_match(const char *desc) {
+    int r;
+    bool ok;
+    Matcher matcher = {0};
+    MatchResult result = {0};
+    MetadataEntry entries[] = {
+        {.pattern = "blue"},
+        {.pattern = "blue/*2.m4a"},
+        {.pattern = "red/audio_red_1.m4a"},
+        {.pattern = "./blue/*blue_2.m4a"},
+        {.pattern = "*/ten-minutes.m4a"},
+    };
+
+    for (size_t i = 0; i < sizeof(entries) / sizeof(MetadataEntry); i++) {
+        r = maw_match_add(&matcher, &entries[i]);
+        MAW_ASSERT_EQ(RESULT_OK, r, entries[i].pattern);
+    }
+
+    // Every matching entry, in configuration order
+    r = maw_match_path(&matcher, "blue/audio_blue_2.m4a", &result);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = result.count == 3 && result.indices[0] == 0 &&
+         result.indices[1] == 1 && result.indices[2] == 3;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    r = maw_match_path(&matcher, "blue/ten-minutes.m4a", &result);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = result.count == 2 && result.indices[0] == 0 && result.indices[1] == 4;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    // Wildcard patterns do not match paths beneath a match
+    r = maw_match_path(&matcher, "red/audio_red_1.m4a/nested.m4a", &result);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = result.count == 1 && result.indices[0] == 2;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    r = maw_match_path(&matcher, "red/audio_red_2.m4a", &result);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    ok = result.count == 0;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    maw_match_result_free(&result);
+    maw_match_free(&matcher);
+
+    return true;
+}
+
+static bool test_state(const char *desc) {
+    int r;
+    int unchanged;
+    struct stat s;
+    const char *state_path = ".testenv/state/maw.state";
+    char filepath[] = ".testenv/state.file";
+    int fd;
+    bool ok;
+    MawState state = {0};
+    Metadata metadata = {.title = "State", .album = "", .artist = NULL};
+    MediaFile mediafile = {.path = filepath, .metadata = &metadata};
+    MediaFiles mediafiles = {.items = &mediafile, .count = 1};
+    struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+                                {.tv_sec = 1, .tv_nsec = 0}};
+
+    fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+    MAW_ASSERT_EQ(true, ok, desc);
+    (void)close(fd);
+    r = stat(filepath, &s);
+    MAW_ASSERT_EQ(0, r, desc);
+    mediafile.size = s.st_size;
+    mediafile.dev = s.st_dev;
+    mediafile.ino = s.st_ino;
+    mediafile.mtime_ns = (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+
+    // Nothing is unchanged without a previous run
+    (void)unlink(state_path);
+    r = maw_state_load(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    unchanged = (int)maw_state_mark(&state, &mediafiles);
+    MAW_ASSERT_EQ(0, unchanged, desc);
+
+    mediafile.done = true;
+    r = maw_state_record(&state, &mediafiles);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_state_save(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    maw_state_free(&state);
+
+    r = maw_state_load(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    MAW_ASSERT_EQ(1, (int)state.count, desc);
+    unchanged = (int)maw_state_mark(&state, &mediafiles);
+    MAW_ASSERT_EQ(1, unchanged, desc);
+
+    // Changes to the desired metadata or the file itself are detected
+    metadata.album = NULL;
+    unchanged = (int)maw_state_mark(&state, &mediafiles);
+    MAW_ASSERT_EQ(0, unchanged, desc);
+    metadata.album = "";
+
+    r = utimensat(AT_FDCWD, filepath, times, 0);
+    MAW_ASSERT_EQ(0, r, desc);
+    r = stat(filepath, &s);
+    MAW_ASSERT_EQ(0, r, desc);
+    mediafile.mtime_ns = (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+    unchanged = (int)maw_state_mark(&state, &mediafiles);
+    MAW_ASSERT_EQ(0, unchanged, desc);
+
+    maw_state_free(&state);
+    (void)unlink(filepath);
+
+    return true;
+}
+
+// Files that are named after their title need an update when they are renamed,
+// even though the inode, size and mtime stay the same
+static bool test_state_rename(const char *desc) {
+    int r;
+    int unchanged;
+    int fd;
+    bool ok;
+    struct stat s;
+    const char *state_path = ".testenv/state/maw.state";
+    char filepath[] = ".testenv/state_rename.m4a";
+    char renamed[] = ".testenv/state_renamed.m4a";
+    MawState state = {0};
+    Metadata metadata = {.title = NULL, .album = "", .artist = NULL};
+    MediaFile mediafile = {.path = filepath, .metadata = &metadata};
+    MediaFiles mediafiles = {.items = &mediafile, .count = 1};
+
+    fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0;
+    MAW_ASSERT_EQ(true, ok, desc);
+    (void)close(fd);
+    r = stat(filepath, &s);
+    MAW_ASSERT_EQ(0, r, desc);
+    mediafile.size = s.st_size;
+    mediafile.dev = s.st_dev;
+    mediafile.ino = s.st_ino;
+    mediafile.mtime_ns = (int64_t)s.st_mtime * 1000000000 + STAT_MTIME_NSEC(s);
+
+    (void)unlink(state_path);
+    r = maw_state_load(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    (void)maw_state_mark(&state, &mediafiles);
+    mediafile.done = true;
+    r = maw_state_record(&state, &mediafiles);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    r = maw_state_save(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    maw_state_free(&state);
+
+    r = rename(filepath, renamed);
+    MAW_ASSERT_EQ(0, r, desc);
+    mediafile.path = renamed;
+
+    r = maw_state_load(state_path, &state);
+    MAW_ASSERT_EQ(RESULT_OK, r, desc);
+    unchanged = (int)maw_state_mark(&state, &mediafiles);
+    MAW_ASSERT_EQ(0, unchanged, desc);
+
+    maw_state_free(&state);
+    (void)unlink(renamed);
+    (void)unlink(state_path);
+
+    return true;
+}
+
 static bool test_hash(const char *desc) {
     uint32_t digest;
     const char *data = "ABC";
@@ -599,6 +1443,50 @@ static bool test_hash(const char *desc) {
     return true;
 }
 
+static bool test_arena(const char *desc) {
+    bool ok;
+    MawArena arena = {0};
+    MawInterner interner = {.arena = &arena};
+    char value[16];
+    char *artist;
+    char *album;
+    char *large;
+
+    // Identical strings share storage regardless of where they are copied from
+    (void)snprintf(value, sizeof value, "Artist");
+    artist = maw_intern(&interner, "Artist");
+    ok = artist != NULL && artist == maw_intern(&interner, value) &&
+         artist != value;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    album = maw_intern(&interner, "Album");
+    ok = album != NULL && album != artist && STR_EQ("Album", album);
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    // Interned strings keep their address when the table grows
+    for (int i = 0; i < 1000; i++) {
+        (void)snprintf(value, sizeof value, "%d", i);
+        ok = maw_intern(&interner, value) != NULL;
+        MAW_ASSERT_EQ(true, ok, desc);
+    }
+    ok = maw_intern(&interner, "Artist") == artist &&
+         maw_intern(&interner, "Album") == album;
+    MAW_ASSERT_EQ(true, ok, desc);
+    MAW_ASSERT_EQ(1002, (int)interner.count, desc);
+
+    // Allocations larger than a block are zeroed and aligned
+    large = maw_arena_alloc(&arena, 2 * MAW_ARENA_BLOCK_SIZE);
+    ok = large != NULL && large[0] == 0 &&
+         large[2 * MAW_ARENA_BLOCK_SIZE - 1] == 0 &&
+         (uintptr_t)large % MAW_ARENA_ALIGN == 0;
+    MAW_ASSERT_EQ(true, ok, desc);
+
+    maw_interner_free(&interner);
+    maw_arena_free(&arena);
+
+    return true;
+}
+
 // Runner //////////////////////////////////////////////////////////////////////
 
 // clang-format off
@@ -612,12 +1500,24 @@ static struct Testcase testcases[] = {
     {.desc = "Dual video streams", .fn = test_dual_video},
     {.desc = "Threads ok", .fn = test_threads_ok},
     {.desc = "Threads error", .fn = test_threads_error},
+    {.desc = "Threads idle", .fn = test_threads_idle},
+    {.desc = "Threads pipeline", .fn = test_threads_pipeline},
+    {.desc = "Threads auto", .fn = test_threads_auto},
+    {.desc = "Threads device limit", .fn = test_threads_device_limit},
     {.desc = "YAML ok", .fn = test_cfg_ok},
     {.desc = "YAML key missing value", .fn = test_cfg_key_missing_value},
     {.desc = "YAML invalid", .fn = test_cfg_error},
+    {.desc = "YAML config cache", .fn = test_cfg_cache},
     {.desc = "FNV-1a Hash", .fn = test_hash},
+    {.desc = "Arena and string interning", .fn = test_arena},
+    {.desc = "Link files", .fn = test_linkfile},
+    {.desc = "Directory walk", .fn = test_walk},
+    {.desc = "Pattern matching", .fn = test_match},
+    {.desc = "State cache", .fn = test_state},
+    {.desc = "State after rename", .fn = test_state_rename},
     {.desc = "Update command", .fn = test_update},
     {.desc = "Update override cover", .fn = test_update_override},
+    {.desc = "Update single files", .fn = test_update_scoped},
     {.desc = "Playlists command", .fn = test_playlists},
     {.desc = "NOOP metadata", .fn = test_noop},
     {.desc = "NOOP metadata clean", .fn = test_noop_clean},
@@ -625,8 +1525,18 @@ static struct Testcase testcases[] = {
     {.desc = "NOOP Replace cover", .fn = test_noop_replace_cover},
     {.desc = "NOOP Crop cover", .fn = test_noop_cover_crop},
     {.desc = "NOOP Crop no cover on source", .fn = test_noop_nocover_crop},
+    {.desc = "Crop reuse", .fn = test_crop_reuse},
     {.desc = "NOOP cover clear configuration", .fn = test_noop_cover_clear},
     {.desc = "NOOP Crop unsupported dimensions", .fn = test_noop_crop_unsupported},
+    {.desc = "Patch metadata in place", .fn = test_patch_inplace},
+    {.desc = "Patch metadata in place faststart", .fn = test_patch_inplace_faststart},
+    {.desc = "Header probe", .fn = test_probe},
+    {.desc = "Fingerprint", .fn = test_fingerprint},
+    {.desc = "Dry run plan", .fn = test_plan},
+    {.desc = "Output tree", .fn = test_output_tree},
+    {.desc = "Keep file mode", .fn = test_keep_mode},
+    {.desc = "Cover cache", .fn = test_cover_cache},
+    {.desc = "Crop cache", .fn = test_crop_cache},
 };
 // clang-format on
 
@@ -665,9 +1575,13 @@ int run_tests(const char *match_testcase) {
                         testcases[i].desc);
             else
                 fprintf(tfd, "not ok %d - %s\n", i, testcases[i].desc);
+            maw_av_thread_free();
+            maw_cover_cache_free();
             return EXIT_FAILURE; // XXX
         }
     }
 
+    maw_av_thread_free();
+    maw_cover_cache_free();
     return EXIT_SUCCESS;
 }
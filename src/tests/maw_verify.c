@@ -1,6 +1,7 @@
 #include "maw/tests/maw_verify.h"
 #include "maw/av.h"
 #include "maw/log.h"
+#include "maw/mp4.h"
 #include "maw/utils.h"
 
 static bool maw_verify_cover(const AVFormatContext *fmt_ctx,
@@ -84,7 +85,8 @@ bool maw_verify(const MediaFile *mediafile) {
                  strcmp(entry->key, "major_brand") != 0 &&
                  strcmp(entry->key, "minor_version") != 0 &&
                  strcmp(entry->key, "compatible_brands") != 0 &&
-                 strcmp(entry->key, "encoder") != 0) {
+                 strcmp(entry->key, "encoder") != 0 &&
+                 strcmp(entry->key, MP4_FINGERPRINT_NAME) != 0) {
             MAW_LOGF(MAW_ERROR, "%s: Unexpected unclean field: %s",
                      mediafile->path, entry->key);
             goto end;
@@ -166,3 +168,27 @@ end:
     free(data);
     return ok;
 }
+
+// Copy the fingerprint that maw wrote to the file into `out`
+bool maw_verify_fingerprint(const char *path, char *out, size_t size) {
+    int r;
+    bool ok = false;
+    AVFormatContext *fmt_ctx = NULL;
+    const AVDictionaryEntry *entry = NULL;
+
+    if ((r = avformat_open_input(&fmt_ctx, path, NULL, NULL))) {
+        MAW_AVERROR(r, path, NULL);
+        goto end;
+    }
+
+    entry = av_dict_get(fmt_ctx->metadata, MP4_FINGERPRINT_NAME, NULL, 0);
+    if (entry == NULL) {
+        MAW_LOGF(MAW_ERROR, "%s: No fingerprint found", path);
+        goto end;
+    }
+
+    ok = strlcpy(out, entry->value, size) < size;
+end:
+    avformat_close_input(&fmt_ctx);
+    return ok;
+}
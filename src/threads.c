@@ -1,13 +1,40 @@
 #include "maw/threads.h"
 #include "maw/log.h"
 #include "maw/update.h"
+#include "maw/utils.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 static void maw_clock_measure(time_t);
-static void *maw_threads_worker(void *);
+static uint64_t maw_threads_cost(const MediaFile *mediafile);
+static int maw_threads_cost_cmp(const void *a, const void *b);
+static int maw_threads_location_cmp(const void *a, const void *b);
+static void maw_threads_device_order(WorkQueue *queue, DeviceQueue *device);
+static int maw_threads_queue_init(WorkQueue *queue);
+static bool maw_threads_queue_pop(WorkQueue *queue, size_t *index);
+static void maw_threads_queue_done(WorkQueue *queue, size_t index);
+static int maw_threads_rewrite_init(RewriteQueue *rewrites, size_t capacity);
+static bool maw_threads_rewrite_push(RewriteQueue *rewrites, size_t index);
+static bool maw_threads_rewrite_pop(RewriteQueue *rewrites, size_t *index);
+static void maw_threads_rewrite_close(RewriteQueue *rewrites, size_t count);
+static void maw_threads_rewrite_detach(RewriteQueue *rewrites,
+                                       WorkQueue *queue);
+static size_t maw_threads_nproc(void);
+static void maw_threads_stage_init(ThreadStage *stage, const char *name,
+                                   size_t thread_count, size_t size,
+                                   bool by_bytes);
+static void maw_threads_stage_wait(ThreadContext *ctx);
+static void maw_threads_stage_account(ThreadContext *ctx, uint64_t bytes);
+static void maw_threads_stage_leave(ThreadContext *ctx);
+static void maw_threads_stage_adjust(ThreadStage *stage, double elapsed);
+static void maw_threads_control(ThreadControl *control);
+static void *maw_threads_probe_worker(void *);
+static void *maw_threads_rewrite_worker(void *);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -27,32 +54,515 @@ static void maw_clock_measure(time_t start_time) {
     }
 }
 
-static void *maw_threads_worker(void *arg) {
+// Estimate the time needed to process a media file, only the relative order
+// matters.
+static uint64_t maw_threads_cost(const MediaFile *mediafile) {
+    uint64_t cost = mediafile->size > 0 ? (uint64_t)mediafile->size : 0;
+
+    if (mediafile->metadata != NULL &&
+        mediafile->metadata->cover_policy == COVER_POLICY_CROP)
+        cost += MAW_THREADS_CROP_COST;
+
+    return cost;
+}
+
+// Group by device, then sort by descending cost, ties keep their original
+// order
+static int maw_threads_cost_cmp(const void *a, const void *b) {
+    const WorkItem *lhs = a;
+    const WorkItem *rhs = b;
+
+    if (lhs->dev != rhs->dev)
+        return lhs->dev < rhs->dev ? -1 : 1;
+    if (lhs->cost != rhs->cost)
+        return lhs->cost < rhs->cost ? 1 : -1;
+    if (lhs->index != rhs->index)
+        return lhs->index < rhs->index ? -1 : 1;
+    return 0;
+}
+
+// Sort by ascending location, ties keep their original order
+static int maw_threads_location_cmp(const void *a, const void *b) {
+    const WorkItem *lhs = a;
+    const WorkItem *rhs = b;
+
+    if (lhs->location != rhs->location)
+        return lhs->location < rhs->location ? -1 : 1;
+    if (lhs->index != rhs->index)
+        return lhs->index < rhs->index ? -1 : 1;
+    return 0;
+}
+
+// Seeks dominate on spinning disks, process the files of a rotational device
+// in one pass over the disk. The physical offset of the first extent is used
+// when the filesystem supports FIEMAP, otherwise the inode number, which
+// roughly follows the allocation order on most filesystems.
+static void maw_threads_device_order(WorkQueue *queue, DeviceQueue *device) {
+    bool physical = true;
+    WorkItem *item;
+
+    device->rotational = isrotational(device->dev);
+    if (!device->rotational)
+        return;
+
+    for (size_t i = device->start; i < device->end && physical; i++) {
+        item = &queue->items[i];
+        if (physical_offset(queue->mediafiles[item->index].path,
+                            &item->location) != RESULT_OK)
+            physical = false;
+    }
+
+    if (!physical) {
+        for (size_t i = device->start; i < device->end; i++) {
+            item = &queue->items[i];
+            item->location = (uint64_t)queue->mediafiles[item->index].ino;
+        }
+    }
+
+    MAW_LOGF(MAW_DEBUG, "Ordering %zu file(s) on rotational device %ju by %s",
+             device->end - device->start, (uintmax_t)device->dev,
+             physical ? "physical offset" : "inode");
+
+    qsort(&queue->items[device->start], device->end - device->start,
+          sizeof(WorkItem), maw_threads_location_cmp);
+}
+
+// Order the jobs so that the largest ones start first and the small ones fill
+// the gaps at the end of the run. Each device gets its own slice of the queue
+// so that jobs can be spread over all devices, slices of rotational devices
+// are ordered by location instead.
+static int maw_threads_queue_init(WorkQueue *queue) {
+    size_t d = 0;
+
+    queue->items = calloc(queue->size, sizeof(WorkItem));
+    if (queue->items == NULL && queue->size > 0) {
+        MAW_PERROR("calloc");
+        return RESULT_ERR_INTERNAL;
+    }
+
+    for (size_t i = 0; i < queue->size; i++) {
+        queue->items[i].cost = maw_threads_cost(&queue->mediafiles[i]);
+        queue->items[i].dev = queue->mediafiles[i].dev;
+        queue->items[i].index = i;
+    }
+
+    qsort(queue->items, queue->size, sizeof(WorkItem), maw_threads_cost_cmp);
+
+    queue->device_count = 0;
+    for (size_t i = 0; i < queue->size; i++) {
+        if (i == 0 || queue->items[i].dev != queue->items[i - 1].dev)
+            queue->device_count++;
+    }
+
+    queue->devices = calloc(queue->device_count, sizeof(DeviceQueue));
+    if (queue->devices == NULL && queue->device_count > 0) {
+        MAW_PERROR("calloc");
+        return RESULT_ERR_INTERNAL;
+    }
+
+    for (size_t i = 0; i < queue->size; i++) {
+        if (i > 0 && queue->items[i].dev != queue->items[i - 1].dev) {
+            queue->devices[d].end = i;
+            d++;
+        }
+        if (i == 0 || queue->items[i].dev != queue->items[i - 1].dev) {
+            queue->devices[d].dev = queue->items[i].dev;
+            queue->devices[d].start = i;
+            queue->devices[d].next = i;
+        }
+    }
+    if (queue->device_count > 0)
+        queue->devices[d].end = queue->size;
+
+    for (size_t i = 0; i < queue->device_count; i++)
+        maw_threads_device_order(queue, &queue->devices[i]);
+
+    return RESULT_OK;
+}
+
+// Hand out the index of the next media file to process, blocks while all
+// devices with pending jobs are at their limit. Returns false once the queue
+// is empty.
+static bool maw_threads_queue_pop(WorkQueue *queue, size_t *index) {
+    bool pending;
+    DeviceQueue *device;
+    DeviceQueue *best;
+
+    if (pthread_mutex_lock(&queue->lock) != 0)
+        return false;
+
+    for (;;) {
+        best = NULL;
+        pending = false;
+
+        for (size_t i = 0; i < queue->device_count; i++) {
+            device = &queue->devices[i];
+            if (device->next == device->end)
+                continue;
+
+            pending = true;
+            if (queue->device_limit > 0 &&
+                device->inflight >= queue->device_limit)
+                continue;
+
+            // Keep every device busy, then prefer the most expensive job
+            if (best == NULL || device->inflight < best->inflight ||
+                (device->inflight == best->inflight &&
+                 queue->items[device->next].cost >
+                     queue->items[best->next].cost))
+                best = device;
+        }
+
+        if (best != NULL || !pending)
+            break;
+
+        (void)pthread_cond_wait(&queue->available, &queue->lock);
+    }
+
+    if (best != NULL) {
+        *index = queue->items[best->next].index;
+        best->next++;
+        best->inflight++;
+    }
+
+    (void)pthread_mutex_unlock(&queue->lock);
+    return best != NULL;
+}
+
+// Release the device slot of a media file returned by
+// `maw_threads_queue_pop()`
+static void maw_threads_queue_done(WorkQueue *queue, size_t index) {
+    (void)pthread_mutex_lock(&queue->lock);
+
+    for (size_t i = 0; i < queue->device_count; i++) {
+        if (queue->devices[i].dev == queue->mediafiles[index].dev) {
+            queue->devices[i].inflight--;
+            break;
+        }
+    }
+
+    (void)pthread_cond_broadcast(&queue->available);
+    (void)pthread_mutex_unlock(&queue->lock);
+}
+
+static int maw_threads_rewrite_init(RewriteQueue *rewrites, size_t capacity) {
+    rewrites->items = calloc(capacity, sizeof(size_t));
+    if (rewrites->items == NULL) {
+        MAW_PERROR("calloc");
+        return RESULT_ERR_INTERNAL;
+    }
+    rewrites->capacity = capacity;
+    return RESULT_OK;
+}
+
+// Queue a media file for the rewrite stage, blocks while the queue is full.
+// Returns false if there are no rewrite threads left to handle it.
+static bool maw_threads_rewrite_push(RewriteQueue *rewrites, size_t index) {
+    bool ok = false;
+
+    if (pthread_mutex_lock(&rewrites->lock) != 0)
+        return false;
+
+    while (rewrites->count == rewrites->capacity && rewrites->consumers > 0)
+        (void)pthread_cond_wait(&rewrites->not_full, &rewrites->lock);
+
+    if (rewrites->consumers > 0) {
+        rewrites->items[(rewrites->head + rewrites->count) %
+                        rewrites->capacity] = index;
+        rewrites->count++;
+        (void)pthread_cond_signal(&rewrites->not_empty);
+        ok = true;
+    }
+
+    (void)pthread_mutex_unlock(&rewrites->lock);
+    return ok;
+}
+
+// Take the next media file to rewrite, blocks until one is available.
+// Returns false once the queue is empty and all probe threads are done.
+static bool maw_threads_rewrite_pop(RewriteQueue *rewrites, size_t *index) {
+    bool ok = false;
+
+    if (pthread_mutex_lock(&rewrites->lock) != 0)
+        return false;
+
+    while (rewrites->count == 0 && rewrites->producers > 0)
+        (void)pthread_cond_wait(&rewrites->not_empty, &rewrites->lock);
+
+    if (rewrites->count > 0) {
+        *index = rewrites->items[rewrites->head];
+        rewrites->head = (rewrites->head + 1) % rewrites->capacity;
+        rewrites->count--;
+        (void)pthread_cond_signal(&rewrites->not_full);
+        ok = true;
+    }
+
+    (void)pthread_mutex_unlock(&rewrites->lock);
+    return ok;
+}
+
+// Called when `count` probe threads will not push anything else
+static void maw_threads_rewrite_close(RewriteQueue *rewrites, size_t count) {
+    (void)pthread_mutex_lock(&rewrites->lock);
+    rewrites->producers -= count;
+    if (rewrites->producers == 0)
+        (void)pthread_cond_broadcast(&rewrites->not_empty);
+    (void)pthread_mutex_unlock(&rewrites->lock);
+}
+
+// Called when a rewrite thread exits, probe threads must not wait for a queue
+// that nobody empties. Media files left in the queue by the last rewrite
+// thread give their device slots back.
+static void maw_threads_rewrite_detach(RewriteQueue *rewrites,
+                                       WorkQueue *queue) {
+    (void)pthread_mutex_lock(&rewrites->lock);
+    rewrites->consumers--;
+    if (rewrites->consumers == 0) {
+        while (rewrites->count > 0) {
+            maw_threads_queue_done(queue, rewrites->items[rewrites->head]);
+            rewrites->head = (rewrites->head + 1) % rewrites->capacity;
+            rewrites->count--;
+        }
+        (void)pthread_cond_broadcast(&rewrites->not_full);
+    }
+    (void)pthread_mutex_unlock(&rewrites->lock);
+}
+
+static size_t maw_threads_nproc(void) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    return nproc > 0 ? (size_t)nproc : 1;
+}
+
+static void maw_threads_stage_init(ThreadStage *stage, const char *name,
+                                   size_t thread_count, size_t size,
+                                   bool by_bytes) {
+    size_t nproc;
+
+    stage->name = name;
+    stage->by_bytes = by_bytes;
+    stage->direction = 1;
+
+    if (thread_count == MAW_THREADS_AUTO) {
+        nproc = maw_threads_nproc();
+        stage->spawned = nproc * MAW_THREADS_AUTO_MAX_FACTOR;
+        stage->active = nproc;
+        stage->adaptive = true;
+    }
+    else {
+        stage->spawned = thread_count;
+        stage->active = thread_count;
+    }
+
+    // There is no point in starting more threads than there are jobs
+    if (stage->spawned > size)
+        stage->spawned = size > 0 ? size : 1;
+    if (stage->active > stage->spawned)
+        stage->active = stage->spawned;
+    if (stage->spawned == 1)
+        stage->adaptive = false;
+}
+
+// Park the calling thread while its slot is above the active thread limit
+static void maw_threads_stage_wait(ThreadContext *ctx) {
+    (void)pthread_mutex_lock(&ctx->control->lock);
+    while (!ctx->stage->closed &&
+           ctx->slot >= ctx->stage->active + ctx->stage->failed)
+        (void)pthread_cond_wait(&ctx->control->changed, &ctx->control->lock);
+    (void)pthread_mutex_unlock(&ctx->control->lock);
+}
+
+static void maw_threads_stage_account(ThreadContext *ctx, uint64_t bytes) {
+    (void)pthread_mutex_lock(&ctx->control->lock);
+    ctx->stage->files++;
+    ctx->stage->bytes += bytes;
+    (void)pthread_mutex_unlock(&ctx->control->lock);
+}
+
+// Called when a thread exits. Once one thread runs out of work the limit no
+// longer matters, parked threads are released so that they can exit. A failed
+// thread only hands its slot over to a parked one, the remaining jobs are
+// still processed under the limit.
+static void maw_threads_stage_leave(ThreadContext *ctx) {
+    (void)pthread_mutex_lock(&ctx->control->lock);
+    if (ctx->exit_ok)
+        ctx->stage->closed = true;
+    else
+        ctx->stage->failed++;
+    ctx->stage->running--;
+    (void)pthread_cond_broadcast(&ctx->control->changed);
+    (void)pthread_mutex_unlock(&ctx->control->lock);
+}
+
+// Hill climbing: keep moving the thread limit in the same direction while the
+// throughput improves, turn around when it drops.
+static void maw_threads_stage_adjust(ThreadStage *stage, double elapsed) {
+    uint64_t amount = stage->by_bytes ? stage->bytes : stage->files;
+    double rate = (double)(amount - stage->last_amount) / elapsed;
+    size_t active = stage->active;
+
+    stage->last_amount = amount;
+
+    // Nothing finished in this window, e.g. the rewrite stage is waiting for
+    // the probe stage or a single large file is being processed.
+    if (!stage->adaptive || stage->closed || rate <= 0)
+        return;
+
+    if (rate < stage->last_rate * (1.0 - MAW_THREADS_TOLERANCE))
+        stage->direction = -stage->direction;
+    stage->last_rate = rate;
+
+    if (stage->direction > 0 && active + stage->failed < stage->spawned)
+        active++;
+    else if (stage->direction < 0 && active > 1)
+        active--;
+    else
+        stage->direction = -stage->direction;
+
+    if (active != stage->active) {
+        MAW_LOGF(MAW_DEBUG, "Adjusting %s threads: %zu -> %zu (%.1f %s/s)",
+                 stage->name, stage->active, active,
+                 stage->by_bytes ? rate / (1024 * 1024) : rate,
+                 stage->by_bytes ? "MB" : "files");
+        stage->active = active;
+    }
+}
+
+// Measure the throughput of each stage over consecutive windows until all
+// threads have exited.
+static void maw_threads_control(ThreadControl *control) {
+    int r;
+    struct timespec deadline;
+    struct timespec start, now;
+    double elapsed;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+
+    (void)pthread_mutex_lock(&control->lock);
+    while (control->probe.running + control->rewrite.running > 0) {
+        (void)clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += MAW_THREADS_WINDOW_MS / 1000;
+        deadline.tv_nsec += (MAW_THREADS_WINDOW_MS % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        r = pthread_cond_timedwait(&control->changed, &control->lock,
+                                   &deadline);
+        if (r != ETIMEDOUT)
+            continue;
+
+        (void)clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (double)(now.tv_sec - start.tv_sec) +
+                  (double)(now.tv_nsec - start.tv_nsec) / 1e9;
+        start = now;
+
+        maw_threads_stage_adjust(&control->probe, elapsed);
+        maw_threads_stage_adjust(&control->rewrite, elapsed);
+        (void)pthread_cond_broadcast(&control->changed);
+    }
+    (void)pthread_mutex_unlock(&control->lock);
+}
+
+// Probe stage: cheap header reads that decide if a file needs to be rewritten
+static void *maw_threads_probe_worker(void *arg) {
     int r;
     ThreadContext *ctx = (ThreadContext *)arg;
     unsigned long tid = (unsigned long)pthread_self();
     size_t i;
     size_t noop_done = 0;
+    size_t queued = 0;
+
+    MAW_LOGF(MAW_DEBUG, "Thread #%lu started: probe", tid);
+
+    // Pull jobs from the shared queue until it is empty, threads that get
+    // small files simply process more of them.
+    for (;;) {
+        maw_threads_stage_wait(ctx);
+        if (!maw_threads_queue_pop(ctx->queue, &i))
+            break;
+
+        // Files that need to be rewritten keep their device slot until the
+        // rewrite is done
+        r = maw_update_check(&ctx->queue->mediafiles[i]);
+        if (r == RESULT_OK && maw_threads_rewrite_push(ctx->rewrites, i)) {
+            queued++;
+        }
+        else if (r == RESULT_OK) {
+            MAW_LOGF(MAW_ERROR, "%s: No rewrite threads left",
+                     ctx->queue->mediafiles[i].path);
+            maw_threads_queue_done(ctx->queue, i);
+            goto end;
+        }
+        else if (r == RESULT_NOOP) {
+            r = maw_update_noop(&ctx->queue->mediafiles[i], ctx->dry_run);
+            maw_threads_queue_done(ctx->queue, i);
+            if (r != RESULT_NOOP)
+                goto end;
+            ctx->queue->mediafiles[i].done = true;
+            noop_done++;
+        }
+        else {
+            maw_threads_queue_done(ctx->queue, i);
+            goto end;
+        }
+        maw_threads_stage_account(ctx, 0);
+    }
+
+    ctx->exit_ok = true;
+end:
+    maw_threads_rewrite_close(ctx->rewrites, 1);
+    maw_threads_stage_leave(ctx);
+    if (!ctx->exit_ok) {
+        MAW_LOGF(MAW_ERROR, "Thread #%lu: failed [%zu queued] [%zu noop(s)]",
+                 tid, queued, noop_done);
+    }
+    else {
+        MAW_LOGF(MAW_INFO, "Thread #%lu: ok [%zu queued] [%zu noop(s)]", tid,
+                 queued, noop_done);
+    }
+    return NULL;
+}
+
+// Rewrite stage: large sequential reads and writes, usually fewer threads
+static void *maw_threads_rewrite_worker(void *arg) {
+    int r;
+    ThreadContext *ctx = (ThreadContext *)arg;
+    unsigned long tid = (unsigned long)pthread_self();
+    MediaFile *mediafile;
+    size_t i;
+    size_t noop_done = 0;
     size_t done = 0;
 
-    MAW_LOGF(MAW_DEBUG, "Thread #%lu started: [%zu,%zu]", tid, ctx->index_start,
-             ctx->index_end);
+    MAW_LOGF(MAW_DEBUG, "Thread #%lu started: rewrite", tid);
 
-    for (i = ctx->index_start; i < ctx->index_end; i++) {
-        r = maw_update(&ctx->mediafiles[i], ctx->dry_run);
+    for (;;) {
+        maw_threads_stage_wait(ctx);
+        if (!maw_threads_rewrite_pop(ctx->rewrites, &i))
+            break;
+
+        mediafile = &ctx->queue->mediafiles[i];
+        r = maw_update_apply(mediafile, ctx->dry_run);
+        maw_threads_queue_done(ctx->queue, i);
         if (r == RESULT_OK) {
+            mediafile->done = true;
             done++;
         }
         else if (r == RESULT_NOOP) {
+            mediafile->done = true;
             noop_done++;
         }
         else {
             goto end;
         }
+        maw_threads_stage_account(
+            ctx, mediafile->size > 0 ? (uint64_t)mediafile->size : 0);
     }
 
     ctx->exit_ok = true;
 end:
+    maw_threads_rewrite_detach(ctx->rewrites, ctx->queue);
+    maw_threads_stage_leave(ctx);
     if (!ctx->exit_ok) {
         MAW_LOGF(MAW_ERROR, "Thread #%lu: failed [%zu change(s)] [%zu noop(s)]",
                  tid, done, noop_done);
@@ -65,18 +575,66 @@ end:
 }
 
 // Return non-zero if at least one thread fails
-int maw_threads_launch(MediaFile mediafiles[], size_t size, size_t thread_count,
-                       bool dry_run) {
+int maw_threads_launch(MediaFile mediafiles[], size_t size,
+                       const MawArguments *args) {
     int status = -1;
     int r = RESULT_ERR_INTERNAL;
     pthread_t *threads = NULL;
     ThreadContext *thread_ctxs = NULL;
     time_t start_time;
-    size_t increment;
-    size_t leftover;
+    size_t thread_count;
+    size_t probes_spawned = 0;
+    WorkQueue queue = {
+        .mediafiles = mediafiles,
+        .items = NULL,
+        .size = size,
+        .devices = NULL,
+        .device_count = 0,
+        .device_limit = args->device_limit,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .available = PTHREAD_COND_INITIALIZER,
+    };
+    RewriteQueue rewrites = {
+        .items = NULL,
+        .capacity = 0,
+        .head = 0,
+        .count = 0,
+        .producers = 0,
+        .consumers = 0,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .not_empty = PTHREAD_COND_INITIALIZER,
+        .not_full = PTHREAD_COND_INITIALIZER,
+    };
+    ThreadControl control = {
+        .probe = {0},
+        .rewrite = {0},
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+    };
 
     start_time = time(NULL);
 
+    // Probes are small random reads, count files. Rewrites are large
+    // sequential reads and writes, count bytes.
+    maw_threads_stage_init(&control.probe, "probe", args->thread_count, size,
+                           false);
+    maw_threads_stage_init(&control.rewrite, "rewrite",
+                           args->rewrite_thread_count > 0
+                               ? args->rewrite_thread_count
+                               : args->thread_count,
+                           size, true);
+    // Both stages run at the same time, by default only a fraction of the
+    // jobs rewrite. In auto mode this is only the starting point.
+    if (args->rewrite_thread_count == 0) {
+        control.rewrite.active /= MAW_THREADS_REWRITE_DIVISOR;
+        if (control.rewrite.active == 0)
+            control.rewrite.active = 1;
+        if (!control.rewrite.adaptive)
+            control.rewrite.spawned = control.rewrite.active;
+    }
+    thread_count = control.rewrite.spawned + control.probe.spawned;
+    rewrites.producers = control.probe.spawned;
+
     threads = calloc(thread_count, sizeof(pthread_t));
     if (threads == NULL) {
         MAW_PERROR("calloc");
@@ -89,32 +647,81 @@ int maw_threads_launch(MediaFile mediafiles[], size_t size, size_t thread_count,
         goto end;
     }
 
-    increment = size / thread_count;
-    leftover = size % thread_count;
+    r = maw_threads_queue_init(&queue);
+    if (r != 0)
+        goto end;
+
+    r = maw_threads_rewrite_init(&rewrites, control.rewrite.spawned *
+                                                MAW_THREADS_REWRITE_BACKLOG);
+    if (r != 0)
+        goto end;
+
+    MAW_LOGF(MAW_INFO,
+             "Launching %zu/%zu probe thread(s) and %zu/%zu rewrite thread(s): "
+             "%zu job item(s) on %zu device(s)",
+             control.probe.active, control.probe.spawned,
+             control.rewrite.active, control.rewrite.spawned, size,
+             queue.device_count);
 
-    MAW_LOGF(MAW_INFO, "Launching %zu thread(s): %zu job item(s)", thread_count,
-             size);
+    // Start the rewrite threads first, they wait for the probe threads
     for (size_t i = 0; i < thread_count; i++) {
+        bool probe = i >= control.rewrite.spawned;
+
         thread_ctxs[i].spawned = false;
         thread_ctxs[i].exit_ok = false;
-        thread_ctxs[i].mediafiles = mediafiles;
-        thread_ctxs[i].dry_run = dry_run;
-        thread_ctxs[i].index_start = increment * i;
-        thread_ctxs[i].index_end = i == thread_count - 1
-                                       ? increment * (i + 1) + leftover
-                                       : increment * (i + 1);
-
-        r = pthread_create(&threads[i], NULL, maw_threads_worker,
+        thread_ctxs[i].queue = &queue;
+        thread_ctxs[i].rewrites = &rewrites;
+        thread_ctxs[i].control = &control;
+        thread_ctxs[i].stage = probe ? &control.probe : &control.rewrite;
+        thread_ctxs[i].slot = probe ? i - control.rewrite.spawned : i;
+        thread_ctxs[i].dry_run = args->dry_run;
+
+        if (!probe) {
+            (void)pthread_mutex_lock(&rewrites.lock);
+            rewrites.consumers++;
+            (void)pthread_mutex_unlock(&rewrites.lock);
+        }
+        (void)pthread_mutex_lock(&control.lock);
+        thread_ctxs[i].stage->running++;
+        (void)pthread_mutex_unlock(&control.lock);
+
+        r = pthread_create(&threads[i], NULL,
+                           probe ? maw_threads_probe_worker
+                                 : maw_threads_rewrite_worker,
                            (void *)(&thread_ctxs[i]));
         if (r != 0) {
             MAW_LOGF(MAW_ERROR, "pthread_create: %s", strerror(r));
+            if (!probe)
+                maw_threads_rewrite_detach(&rewrites, &queue);
+            (void)pthread_mutex_lock(&control.lock);
+            thread_ctxs[i].stage->running--;
+            (void)pthread_mutex_unlock(&control.lock);
             goto end;
         }
         thread_ctxs[i].spawned = true;
+        if (probe)
+            probes_spawned++;
     }
 
+    if (control.probe.adaptive || control.rewrite.adaptive)
+        maw_threads_control(&control);
+
     status = 0;
 end:
+    // Probe threads that were never started will not push anything
+    if (probes_spawned < control.probe.spawned)
+        maw_threads_rewrite_close(&rewrites,
+                                  control.probe.spawned - probes_spawned);
+
+    // Release parked threads if not all threads could be started
+    if (status != 0) {
+        (void)pthread_mutex_lock(&control.lock);
+        control.probe.closed = true;
+        control.rewrite.closed = true;
+        (void)pthread_cond_broadcast(&control.changed);
+        (void)pthread_mutex_unlock(&control.lock);
+    }
+
     if (thread_ctxs != NULL) {
         for (size_t i = 0; i < thread_count; i++) {
             if (!thread_ctxs[i].spawned)
@@ -135,6 +742,16 @@ end:
 
     free(thread_ctxs);
     free(threads);
+    free(queue.items);
+    free(queue.devices);
+    free(rewrites.items);
+    (void)pthread_mutex_destroy(&queue.lock);
+    (void)pthread_cond_destroy(&queue.available);
+    (void)pthread_mutex_destroy(&rewrites.lock);
+    (void)pthread_cond_destroy(&rewrites.not_empty);
+    (void)pthread_cond_destroy(&rewrites.not_full);
+    (void)pthread_mutex_destroy(&control.lock);
+    (void)pthread_cond_destroy(&control.changed);
 
     if (status == 0) {
         maw_clock_measure(start_time);
@@ -2,248 +2,455 @@
 #include "maw/av.h"
 #include "maw/cfg.h"
 #include "maw/log.h"
+#include "maw/match.h"
 #include "maw/maw.h"
 #include "maw/utils.h"
+#include "maw/walk.h"
 
-#include <dirent.h>
-#include <glob.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
 static void maw_update_merge_metadata(const Metadata *original, Metadata *new);
-static bool maw_update_add(const char *filepath, Metadata *metadata,
-                           MediaFile mediafiles[MAW_MAX_FILES],
-                           size_t *mediafiles_count);
-static bool maw_update_should_alloc(MawArguments *args,
-                                    MetadataEntry *metadata_entry);
+static size_t *maw_update_find(const MediaFiles *mediafiles, const char *path,
+                               uint64_t digest);
+static bool maw_update_reserve(MediaFiles *mediafiles);
+static bool maw_update_add(const char *filepath, const struct stat *s,
+                           Metadata *metadata, MediaFiles *mediafiles);
+static int maw_update_add_matches(Matcher *matcher, const char *path,
+                                  size_t music_dir_len, const struct stat *s,
+                                  MatchResult *match_result,
+                                  MediaFiles *mediafiles);
+static int maw_update_walk(Matcher *matcher, const char *root,
+                           size_t music_dir_len, MatchResult *match_result,
+                           MediaFiles *mediafiles);
+static bool maw_update_is_beneath(const char *path, const char *dir);
+static int maw_update_load_scoped(const MawConfig *cfg,
+                                  const MawArguments *args, Matcher *matcher,
+                                  MatchResult *match_result,
+                                  MediaFiles *mediafiles);
+static int maw_update_output_paths(const MawConfig *cfg, const char *output_dir,
+                                   MediaFiles *mediafiles);
 
 ////////////////////////////////////////////////////////////////////////////////
 
 // Merge the metadata from `original` into `new`.
 // If a metadata field is set in `original` AND unset it `new`, use the
-// `original` value, otherwise keep the new value.
+// `original` value, otherwise keep the new value. Strings are owned by the
+// configuration and are shared rather than copied.
 static void maw_update_merge_metadata(const Metadata *original, Metadata *new) {
     if (original->title != NULL && new->title == NULL) {
-        new->title = strdup(original->title);
+        new->title = original->title;
     }
     if (original->album != NULL && new->album == NULL) {
-        new->album = strdup(original->album);
+        new->album = original->album;
     }
     if (original->artist != NULL && new->artist == NULL) {
-        new->artist = strdup(original->artist);
+        new->artist = original->artist;
     }
     // Reuse the original value if the `new` item does not specify anything
     if (original->cover_policy != COVER_POLICY_UNSPECIFIED &&
         new->cover_policy == COVER_POLICY_UNSPECIFIED) {
         new->cover_policy = original->cover_policy;
         if (new->cover_policy == COVER_POLICY_PATH) {
-            new->cover_path = strdup(original->cover_path);
+            new->cover_path = original->cover_path;
         }
     }
 }
 
-static bool maw_update_add(const char *filepath, Metadata *metadata,
-                           MediaFile mediafiles[MAW_MAX_FILES],
-                           size_t *mediafiles_count) {
+// Returns the slot for `path` in the hash set, either the slot of the
+// existing media file or the free slot where it should be inserted.
+static size_t *maw_update_find(const MediaFiles *mediafiles, const char *path,
+                               uint64_t digest) {
+    size_t mask = mediafiles->slot_count - 1;
+    size_t i = (size_t)digest & mask;
+    const MediaFile *mediafile;
+
+    for (;;) {
+        if (mediafiles->slots[i] == 0)
+            return &mediafiles->slots[i];
+
+        // Only compare the full path if the digests match
+        mediafile = &mediafiles->items[mediafiles->slots[i] - 1];
+        if (mediafile->path_digest == digest && STR_EQ(mediafile->path, path))
+            return &mediafiles->slots[i];
+
+        i = (i + 1) & mask;
+    }
+}
+
+// Make room for one more media file, the hash set is kept at most half full
+static bool maw_update_reserve(MediaFiles *mediafiles) {
+    MediaFile *items;
+    size_t *slots;
+    size_t capacity;
+    size_t slot_count;
+    size_t *slot;
+
+    if (mediafiles->count == mediafiles->capacity) {
+        capacity = mediafiles->capacity > 0 ? mediafiles->capacity * 2
+                                            : MAW_MEDIAFILES_INITIAL_SIZE;
+        items = realloc(mediafiles->items, capacity * sizeof(MediaFile));
+        if (items == NULL) {
+            MAW_PERROR("realloc");
+            return false;
+        }
+        mediafiles->items = items;
+        mediafiles->capacity = capacity;
+    }
+
+    if ((mediafiles->count + 1) * 2 > mediafiles->slot_count) {
+        slot_count = mediafiles->slot_count > 0
+                         ? mediafiles->slot_count * 2
+                         : MAW_MEDIAFILES_INITIAL_SIZE * 2;
+        slots = calloc(slot_count, sizeof(size_t));
+        if (slots == NULL) {
+            MAW_PERROR("calloc");
+            return false;
+        }
+
+        free(mediafiles->slots);
+        mediafiles->slots = slots;
+        mediafiles->slot_count = slot_count;
+
+        for (size_t i = 0; i < mediafiles->count; i++) {
+            slot = maw_update_find(mediafiles, mediafiles->items[i].path,
+                                   mediafiles->items[i].path_digest);
+            *slot = i + 1;
+        }
+    }
+
+    return true;
+}
+
+// The `s` argument is optional, the file is only stat:ed if it is NULL
+static bool maw_update_add(const char *filepath, const struct stat *s,
+                           Metadata *metadata, MediaFiles *mediafiles) {
     MediaFile *latest;
-    uint32_t digest;
+    uint64_t digest;
+    size_t *slot;
+    struct stat file_stat;
 
-    if (*mediafiles_count > MAW_MAX_FILES) {
-        MAW_LOGF(MAW_ERROR, "Cannot process more than %d file(s)",
-                 MAW_MAX_FILES);
+    if (!maw_update_reserve(mediafiles))
         return false;
-    }
 
-    digest = hash(filepath);
+    digest = hash64(filepath, strlen(filepath));
+    slot = maw_update_find(mediafiles, filepath, digest);
 
-    for (size_t i = 0; i < *mediafiles_count; i++) {
-        if (mediafiles[i].path_digest == digest) {
-            maw_update_merge_metadata(mediafiles[i].metadata, metadata);
-            mediafiles[i].metadata = metadata;
-            MAW_LOGF(MAW_DEBUG, "Replaced: %s", mediafiles[i].path);
-            return true;
+    if (*slot != 0) {
+        latest = &mediafiles->items[*slot - 1];
+        maw_update_merge_metadata(latest->metadata, metadata);
+        latest->metadata = metadata;
+        MAW_LOGF(MAW_DEBUG, "Replaced: %s", latest->path);
+        return true;
+    }
+
+    if (s == NULL) {
+        if (stat(filepath, &file_stat) != 0) {
+            MAW_PERRORF("stat", filepath);
+            return false;
         }
+        s = &file_stat;
     }
 
-    *mediafiles_count += 1;
-    latest = &mediafiles[*mediafiles_count - 1];
+    latest = &mediafiles->items[mediafiles->count];
+    memset(latest, 0, sizeof(MediaFile));
     latest->path = strdup(filepath);
-    latest->path_digest = hash(filepath);
+    if (latest->path == NULL) {
+        MAW_PERROR("strdup");
+        return false;
+    }
+    latest->size = s->st_size;
+    latest->dev = s->st_dev;
+    latest->ino = s->st_ino;
+    latest->mtime_ns = (int64_t)s->st_mtime * 1000000000 + STAT_MTIME_NSEC(*s);
+    latest->path_digest = digest;
     latest->metadata = metadata;
+    mediafiles->count++;
+    *slot = mediafiles->count;
     MAW_LOGF(MAW_DEBUG, "Added: %s", latest->path);
 
     return true;
 }
 
-// If paths were provided on the command line, only add the sections
-// that have a matching prefix
-static bool maw_update_should_alloc(MawArguments *args,
-                                    MetadataEntry *metadata_entry) {
-    size_t patlen;
-    size_t arglen;
-
-    // Include all entries by default
-    if (args->cmd_args_count == 0) {
-        return true;
+// Apply the entries that match `path` in configuration order
+static int maw_update_add_matches(Matcher *matcher, const char *path,
+                                  size_t music_dir_len, const struct stat *s,
+                                  MatchResult *match_result,
+                                  MediaFiles *mediafiles) {
+    int r;
+    MetadataEntry *metadata_entry;
+
+    r = maw_match_path(matcher, path + music_dir_len, match_result);
+    if (r != 0)
+        return r;
+
+    for (size_t i = 0; i < match_result->count; i++) {
+        metadata_entry =
+            matcher->entries[match_result->indices[i]].metadata_entry;
+        if (!maw_update_add(path, s, &metadata_entry->value, mediafiles))
+            return RESULT_ERR_INTERNAL;
     }
 
-    patlen = strlen(metadata_entry->pattern);
+    return RESULT_OK;
+}
+
+static int maw_update_walk(Matcher *matcher, const char *root,
+                           size_t music_dir_len, MatchResult *match_result,
+                           MediaFiles *mediafiles) {
+    int r = RESULT_ERR_INTERNAL;
+    WalkResult walk_result = {0};
+    const WalkEntry *walk_entry;
 
-    for (int i = 0; i < args->cmd_args_count; i++) {
-        // The exact path provided on the command line
-        if (STR_EQ(metadata_entry->pattern, args->cmd_args[i]))
-            return true;
+    r = maw_walk(root, &walk_result);
+    if (r != 0)
+        goto end;
 
-        // A path *beneath* the path provided on the command line
-        if (STR_HAS_PREFIX(metadata_entry->pattern, args->cmd_args[i])) {
-            arglen = strlen(args->cmd_args[i]);
-            if (patlen > arglen && metadata_entry->pattern[arglen] == '/')
-                return true;
-        }
+    for (size_t i = 0; i < walk_result.count; i++) {
+        walk_entry = &walk_result.entries[i];
+        r = maw_update_add_matches(matcher, walk_entry->path, music_dir_len,
+                                   &walk_entry->stat, match_result, mediafiles);
+        if (r != 0)
+            goto end;
     }
 
-    return false;
+    r = RESULT_OK;
+end:
+    maw_walk_free(&walk_result);
+    return r;
 }
 
-// Given our *cfg, create a MediaFile[] that we can feed to the job launcher.
-// Later matches in the config file will take precedence!
-int maw_update_load(MawConfig *cfg, MawArguments *args,
-                    MediaFile mediafiles[MAW_MAX_FILES],
-                    size_t *mediafiles_count) {
+// Both paths are normalized, an empty path is the music directory itself
+static bool maw_update_is_beneath(const char *path, const char *dir) {
+    size_t dirlen = strlen(dir);
+
+    if (dirlen == 0)
+        return true;
+
+    return STR_HAS_PREFIX_SIZE(path, dir, dirlen) &&
+           (path[dirlen] == '\0' || path[dirlen] == '/');
+}
+
+// Only the paths provided on the command line are visited. The entries that
+// apply to each path are looked up in the matcher before anything is read
+// from disk, paths that no entry applies to are skipped. Paths beneath
+// another path from the command line are skipped as well so that no file is
+// visited twice.
+static int maw_update_load_scoped(const MawConfig *cfg,
+                                  const MawArguments *args, Matcher *matcher,
+                                  MatchResult *match_result,
+                                  MediaFiles *mediafiles) {
     int r = RESULT_ERR_INTERNAL;
-    MetadataEntry *metadata_entry = NULL;
-    DIR *dir = NULL;
-    struct dirent *entry;
+    char(*scopes)[MAW_PATH_MAX] = NULL;
+    char path[MAW_PATH_MAX];
+    size_t music_dir_len = strlen(cfg->music_dir) + 1;
+    size_t count = (size_t)args->cmd_args_count;
+    size_t selected;
+    bool skip;
     struct stat s;
-    glob_t glob_result;
-    char complete_pattern[MAW_PATH_MAX];
-    char filepath[MAW_PATH_MAX];
-    size_t music_dir_idx;
-    bool ok;
-    bool has_glob_result = false;
 
-    MAW_STRLCPY(complete_pattern, cfg->music_dir);
-    MAW_STRLCAT(complete_pattern, "/");
-    music_dir_idx = strlen(complete_pattern);
+    scopes = calloc(count, sizeof *scopes);
+    if (scopes == NULL) {
+        MAW_PERROR("calloc");
+        goto end;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        r = maw_match_normalize(args->cmd_args[i], scopes[i], sizeof scopes[i]);
+        if (r != 0)
+            goto end;
+    }
 
-    TAILQ_FOREACH(metadata_entry, &(cfg->metadata_head), entry) {
-        ok = maw_update_should_alloc(args, metadata_entry);
-        if (!ok) {
-            MAW_LOGF(MAW_DEBUG, "Skipping: %s", metadata_entry->pattern);
+    for (size_t i = 0; i < count; i++) {
+        skip = false;
+        for (size_t j = 0; j < count && !skip; j++) {
+            // The first of two identical paths is kept
+            skip = j != i && maw_update_is_beneath(scopes[i], scopes[j]) &&
+                   (j < i || !STR_EQ(scopes[i], scopes[j]));
+        }
+        if (skip) {
+            MAW_LOGF(MAW_DEBUG, "Already included: %s", args->cmd_args[i]);
             continue;
         }
 
-        // Keep the leading path across iterations and append the new pattern
-        complete_pattern[music_dir_idx] = '\0';
-        MAW_STRLCAT(complete_pattern, metadata_entry->pattern);
-
-        if (strchr(complete_pattern, '*') != NULL) {
-            r = glob(complete_pattern, GLOB_TILDE, NULL, &glob_result);
-            if (r != 0) {
-                if (r == GLOB_NOMATCH) {
-                    MAW_LOGF(MAW_WARN, "glob: no matches for %s",
-                             complete_pattern);
-                }
-                else {
-                    MAW_LOGF(MAW_ERROR, "glob: %s: error code %d",
-                             complete_pattern, r);
-                    goto end;
-                }
-            }
-            has_glob_result = true;
-
-            for (size_t i = 0; i < glob_result.gl_pathc; i++) {
-                if (!maw_update_add(glob_result.gl_pathv[i],
-                                    &metadata_entry->value, mediafiles,
-                                    mediafiles_count))
-                    goto end;
-            }
+        r = maw_match_select(matcher, scopes[i], &selected);
+        if (r != 0)
+            goto end;
+        r = RESULT_ERR_INTERNAL;
+
+        if (selected == 0) {
+            MAW_LOGF(MAW_WARN, "%s: Not covered by the configuration",
+                     args->cmd_args[i]);
+            continue;
+        }
+        MAW_LOGF(MAW_DEBUG, "%s: %zu entries apply", args->cmd_args[i],
+                 selected);
+
+        MAW_STRLCPY(path, cfg->music_dir);
+        if (scopes[i][0] != '\0') {
+            MAW_STRLCAT(path, "/");
+            MAW_STRLCAT(path, scopes[i]);
+        }
+
+        if (stat(path, &s) != 0) {
+            MAW_PERRORF("stat", path);
+            goto end;
+        }
+
+        if (S_ISDIR(s.st_mode)) {
+            r = maw_update_walk(matcher, path, music_dir_len, match_result,
+                                mediafiles);
+        }
+        else if (S_ISREG(s.st_mode)) {
+            r = maw_update_add_matches(matcher, path, music_dir_len, &s,
+                                       match_result, mediafiles);
         }
         else {
-            r = stat(complete_pattern, &s);
-            if (r != 0) {
-                MAW_PERRORF("stat", complete_pattern);
-                goto end;
-            }
-
-            if (S_ISREG(s.st_mode)) {
-                if (!maw_update_add(complete_pattern, &metadata_entry->value,
-                                    mediafiles, mediafiles_count))
-                    goto end;
-            }
-            else if (S_ISDIR(s.st_mode)) {
-                if ((dir = opendir(complete_pattern)) == NULL) {
-                    MAW_PERRORF("opendir", complete_pattern);
-                    goto end;
-                }
-
-                while ((entry = readdir(dir)) != NULL) {
-                    if (entry->d_type != DT_REG) {
-                        continue;
-                    }
-                    if (entry->d_name[0] == '.') {
-                        continue;
-                    }
-                    MAW_STRLCPY(filepath, complete_pattern);
-                    MAW_STRLCAT(filepath, "/");
-                    MAW_STRLCAT(filepath, entry->d_name);
-                    if (!maw_update_add(filepath, &metadata_entry->value,
-                                        mediafiles, mediafiles_count)) {
-                        goto end;
-                    }
-                }
-                (void)closedir(dir);
-                dir = NULL;
-            }
+            MAW_LOGF(MAW_WARN, "%s: Not a file or directory", path);
+            r = RESULT_OK;
         }
+        if (r != 0)
+            goto end;
     }
 
     r = RESULT_OK;
 end:
-    if (has_glob_result)
-        globfree(&glob_result);
-    if (dir != NULL)
-        (void)closedir(dir);
+    free(scopes);
     return r;
 }
 
-void maw_update_dump(MediaFile mediafiles[MAW_MAX_FILES], size_t count) {
+// Place each media file at the same relative path below `output_dir`
+static int maw_update_output_paths(const MawConfig *cfg, const char *output_dir,
+                                   MediaFiles *mediafiles) {
+    int r = RESULT_ERR_INTERNAL;
+    char path[MAW_PATH_MAX];
+    char music_dir[MAW_PATH_MAX];
+    size_t music_dir_len = strlen(cfg->music_dir);
+    MediaFile *mediafile;
+
+    // Output files inside the music directory would be picked up by the
+    // next run
+    if (realpath(cfg->music_dir, music_dir) != NULL &&
+        realpath(output_dir, path) != NULL && STR_HAS_PREFIX(path, music_dir) &&
+        (path[strlen(music_dir)] == '/' || path[strlen(music_dir)] == '\0')) {
+        MAW_LOGF(MAW_ERROR, "%s: Output directory is inside of %s", output_dir,
+                 cfg->music_dir);
+        goto end;
+    }
+
+    for (size_t i = 0; i < mediafiles->count; i++) {
+        mediafile = &mediafiles->items[i];
+        // All paths come from the walk of the music directory
+        MAW_STRLCPY(path, output_dir);
+        MAW_STRLCAT(path, mediafile->path + music_dir_len);
+
+        mediafile->output_path = strdup(path);
+        if (mediafile->output_path == NULL) {
+            MAW_PERROR("strdup");
+            goto end;
+        }
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Given our *cfg, create a MediaFile[] that we can feed to the job launcher.
+// All patterns are compiled into one matcher and the music directory, or the
+// paths provided on the command line, are only walked once. Later matches in
+// the config file will take precedence!
+int maw_update_load(MawConfig *cfg, MawArguments *args,
+                    MediaFiles *mediafiles) {
+    int r = RESULT_ERR_INTERNAL;
+    MetadataEntry *metadata_entry = NULL;
+    Matcher matcher = {0};
+    MatchResult match_result = {0};
+
+    TAILQ_FOREACH(metadata_entry, &(cfg->metadata_head), entry) {
+        r = maw_match_add(&matcher, metadata_entry);
+        if (r != 0)
+            goto end;
+    }
+
+    if (matcher.entry_count == 0) {
+        r = RESULT_OK;
+        goto end;
+    }
+
+    if (args->cmd_args_count > 0) {
+        r = maw_update_load_scoped(cfg, args, &matcher, &match_result,
+                                   mediafiles);
+    }
+    else {
+        r = maw_update_walk(&matcher, cfg->music_dir,
+                            strlen(cfg->music_dir) + 1, &match_result,
+                            mediafiles);
+    }
+    if (r != 0)
+        goto end;
+
+    r = maw_match_check(&matcher, cfg->music_dir);
+    if (r != 0)
+        goto end;
+
+    if (args->output_dir != NULL) {
+        r = maw_update_output_paths(cfg, args->output_dir, mediafiles);
+        if (r != 0)
+            goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    maw_match_result_free(&match_result);
+    maw_match_free(&matcher);
+    return r;
+}
+
+void maw_update_dump(const MediaFiles *mediafiles) {
+    const MediaFile *mediafile;
+
     printf("{\n");
-    for (size_t i = 0; i < count; i++) {
-        printf("  \"%s\": {\n", mediafiles[i].path);
+    for (size_t i = 0; i < mediafiles->count; i++) {
+        mediafile = &mediafiles->items[i];
+        printf("  \"%s\": {\n", mediafile->path);
         printf("    \"" MAW_CFG_KEY_TITLE "\": \"%s\",\n",
-               mediafiles[i].metadata->title);
+               mediafile->metadata->title);
         printf("    \"" MAW_CFG_KEY_ALBUM "\": \"%s\",\n",
-               mediafiles[i].metadata->album);
+               mediafile->metadata->album);
         printf("    \"" MAW_CFG_KEY_ARTIST "\": \"%s\",\n",
-               mediafiles[i].metadata->artist);
+               mediafile->metadata->artist);
         printf("    \"" MAW_CFG_KEY_COVER "\": \"%s\",\n",
-               MAW_COVER_TOSTR(mediafiles[i].metadata));
-        printf(
-            "    \"" MAW_CFG_KEY_CLEAN "\": \"%s\"\n",
-            maw_cfg_clean_policy_tostr(mediafiles[i].metadata->clean_policy));
-        printf(i == count - 1 ? "  }\n" : "  },\n");
+               MAW_COVER_TOSTR(mediafile->metadata));
+        printf("    \"" MAW_CFG_KEY_CLEAN "\": \"%s\"\n",
+               maw_cfg_clean_policy_tostr(mediafile->metadata->clean_policy));
+        printf(i == mediafiles->count - 1 ? "  }\n" : "  },\n");
     }
     printf("}\n");
 }
 
-void maw_update_free(MediaFile mediafiles[MAW_MAX_FILES], size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        free((void *)mediafiles[i].path);
+void maw_update_free(MediaFiles *mediafiles) {
+    for (size_t i = 0; i < mediafiles->count; i++) {
+        free((void *)mediafiles->items[i].path);
+        free(mediafiles->items[i].output_path);
     }
+    free(mediafiles->items);
+    free(mediafiles->slots);
+    mediafiles->items = NULL;
+    mediafiles->slots = NULL;
+    mediafiles->count = 0;
+    mediafiles->capacity = 0;
+    mediafiles->slot_count = 0;
 }
 
-int maw_update(const MediaFile *mediafile, bool dry_run) {
+// First stage of an update: check the configuration and probe the container
+// header. Returns `RESULT_NOOP` if the file is known to be up to date and
+// `RESULT_OK` if it needs to go through `maw_update_apply()`.
+int maw_update_check(const MediaFile *mediafile) {
     int r = RESULT_ERR_INTERNAL;
-    char tmpfile[MAW_PATH_MAX];
-    char *tmpdir;
-    int tmphandle;
-    MawAVContext *ctx = NULL;
     const char *ext;
 
-    tmpfile[0] = '\0';
-
     // Check argument sanity
     if (mediafile == NULL || mediafile->metadata == NULL ||
         mediafile->path == NULL) {
@@ -267,6 +474,13 @@ int maw_update(const MediaFile *mediafile, bool dry_run) {
         goto end;
     }
 
+    if (mediafile->unchanged) {
+        MAW_LOGF(MAW_DEBUG, "%s: Unchanged since the last run",
+                 mediafile->path);
+        r = RESULT_NOOP;
+        goto end;
+    }
+
     ext = extname(mediafile->path);
 
     if (ext == NULL || (!STR_EQ("mp4", ext) && !STR_EQ("m4a", ext))) {
@@ -275,14 +489,155 @@ int maw_update(const MediaFile *mediafile, bool dry_run) {
         goto end;
     }
 
-    // Define temp location for output file under TMPDIR, this allows
-    // for easy overrides to speed up execution if /tmp is on another device.
-    tmpdir = getenv("TMPDIR");
-    if (tmpdir == NULL)
-        tmpdir = "/tmp";
+    // Most files are already up to date, only build the full libav context
+    // when the container header does not show that.
+    r = maw_av_probe(mediafile);
+    if (r == RESULT_NOOP) {
+        MAW_LOGF(MAW_DEBUG, "%s: No changes needed", mediafile->path);
+        goto end;
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
 
-    MAW_STRLCPY(tmpfile, tmpdir);
-    MAW_STRLCAT(tmpfile, "/maw.XXXXXX.");
+// Print the verdict of a dry run for one media file, one line per file:
+//  noop    <path>
+//  change  <path>  <change>[,<change>...]
+void maw_update_report(const MediaFile *mediafile, unsigned int changes) {
+    char fields[128];
+
+    if (changes == 0) {
+        printf("noop\t%s\n", mediafile->path);
+        return;
+    }
+
+    fields[0] = '\0';
+    for (unsigned int change = 0x1; change <= MAW_AV_CHANGE_LAST;
+         change <<= 1) {
+        if ((changes & change) == 0)
+            continue;
+        if (fields[0] != '\0')
+            MAW_STRLCAT_SIZE(fields, ",", sizeof fields);
+        MAW_STRLCAT_SIZE(fields, maw_av_change_tostr((enum MawAVChange)change),
+                         sizeof fields);
+    }
+end:
+    printf("change\t%s\t%s\n", mediafile->path, fields);
+}
+
+// Called for media files that need no changes. They are reported during a dry
+// run and placed in the output tree, if there is one, without copying them.
+int maw_update_noop(const MediaFile *mediafile, bool dry_run) {
+    int r = RESULT_ERR_INTERNAL;
+    enum LinkStrategy strategy;
+
+    if (dry_run) {
+        maw_update_report(mediafile, 0);
+        r = RESULT_NOOP;
+        goto end;
+    }
+
+    if (mediafile->output_path != NULL) {
+        r = mkparents(mediafile->output_path, 0755);
+        if (r != 0)
+            goto end;
+
+        r = linkfile(mediafile->path, mediafile->output_path, &strategy);
+        if (r != 0)
+            goto end;
+    }
+
+    r = RESULT_NOOP;
+end:
+    return r;
+}
+
+// Second stage of an update: remux the file (or patch it in place) and
+// replace the original. Should only be called after `maw_update_check()`.
+int maw_update_apply(const MediaFile *mediafile, bool dry_run) {
+    int r = RESULT_ERR_INTERNAL;
+    char tmpfile[MAW_PATH_MAX];
+    char *slash;
+    size_t dirlen;
+    int tmphandle = -1;
+    struct stat s;
+    MawAVContext *ctx = NULL;
+    const char *ext;
+    unsigned int changes;
+    // The input file is replaced unless there is an output tree
+    const char *target = mediafile->output_path != NULL ? mediafile->output_path
+                                                        : mediafile->path;
+
+    tmpfile[0] = '\0';
+
+    // A dry run only reads the input file, there is no output file
+    if (dry_run) {
+        r = maw_av_plan(mediafile, &changes);
+        if (r == RESULT_OK) {
+            maw_update_report(mediafile, changes);
+        }
+        else if (r == RESULT_NOOP) {
+            r = maw_update_noop(mediafile, true);
+        }
+        goto end;
+    }
+
+    ext = extname(mediafile->path);
+
+    if (stat(mediafile->path, &s) != 0) {
+        MAW_PERRORF("stat", mediafile->path);
+        goto end;
+    }
+
+    // Initialize libav contexts, the output format is guessed from the name
+    // of the target file, the output file is only created if it is needed
+    ctx = maw_av_init_context(mediafile, target);
+    if (ctx == NULL)
+        goto end;
+
+    // Metadata only changes can be written directly to the input file, the
+    // input file is left as is when there is an output tree
+    ctx->patch_inplace = mediafile->output_path == NULL;
+
+    r = maw_av_prepare(ctx);
+    if (r == RESULT_NOOP) {
+        MAW_LOGF(MAW_DEBUG, "%s: No changes needed", mediafile->path);
+        r = maw_update_noop(mediafile, false);
+        goto end;
+    }
+    else if (r != RESULT_OK) {
+        goto end;
+    }
+
+    if (ctx->patched) {
+        MAW_LOGF(MAW_DEBUG, "%s: Patched in place", mediafile->path);
+        goto end;
+    }
+    r = RESULT_ERR_INTERNAL;
+
+    if (mediafile->output_path != NULL) {
+        r = mkparents(mediafile->output_path, 0755);
+        if (r != 0)
+            goto end;
+        r = RESULT_ERR_INTERNAL;
+    }
+
+    // Create the output file as a hidden sibling of the target file, it can
+    // then always be renamed over the target file, i.e. there is no need to
+    // copy it across devices. Hidden files are skipped by `maw_update_load()`.
+    slash = strrchr(target, '/');
+    if (slash != NULL) {
+        dirlen = (size_t)(slash - target) + 1;
+        if (dirlen >= sizeof tmpfile) {
+            MAW_LOGF(MAW_ERROR, "%s: Path too long", target);
+            goto end;
+        }
+        memcpy(tmpfile, target, dirlen);
+        tmpfile[dirlen] = '\0';
+    }
+    MAW_STRLCAT(tmpfile, ".maw.XXXXXX.");
     MAW_STRLCAT(tmpfile, ext);
 
     // +1 for the last '.'
@@ -290,47 +645,70 @@ int maw_update(const MediaFile *mediafile, bool dry_run) {
 
     if (tmphandle < 0) {
         MAW_PERRORF("mkstemps", tmpfile);
+        tmpfile[0] = '\0';
         goto end;
     }
-    (void)close(tmphandle);
 
-    MAW_LOGF(MAW_DEBUG, "%s -> %s", mediafile->path, tmpfile);
+    // Keep the permissions of the input file after the rename
+    if (fchmod(tmphandle, s.st_mode & 07777) != 0) {
+        MAW_PERRORF("fchmod", tmpfile);
+        goto end;
+    }
 
-    // Initialize libav contexts
-    ctx = maw_av_init_context(mediafile, tmpfile);
-    if (ctx == NULL)
+#ifdef __linux__
+    // Reserve space for the output file up front, it will be roughly the same
+    // size as the input file. Not supported on all filesystems.
+    if (fallocate(tmphandle, FALLOC_FL_KEEP_SIZE, 0, s.st_size) != 0 &&
+        errno != EOPNOTSUPP && errno != ENOSYS) {
+        MAW_PERRORF("fallocate", tmpfile);
         goto end;
+    }
+#endif
+
+    MAW_LOGF(MAW_DEBUG, "%s -> %s", mediafile->path, tmpfile);
 
     // Remux the input file
+    ctx->output_filepath = tmpfile;
     r = maw_av_remux(ctx);
+    if (r != RESULT_OK)
+        goto end;
+    r = RESULT_ERR_INTERNAL;
 
-    if (r == RESULT_OK && !dry_run) {
-        // Replace the input file with the output file
-        if (on_same_device(tmpfile, mediafile->path)) {
-            r = rename(tmpfile, mediafile->path);
-            if (r != 0) {
-                MAW_PERRORF("rename", tmpfile);
-                goto end;
-            }
-        }
-        else {
-            r = movefile(tmpfile, mediafile->path);
-            if (r != 0)
-                goto end;
-        }
+    // Release any preallocated space beyond the end of the output
+    if (fstat(tmphandle, &s) != 0) {
+        MAW_PERRORF("fstat", tmpfile);
+        goto end;
     }
-    else if (r == RESULT_NOOP) {
-        MAW_LOGF(MAW_DEBUG, "%s: No changes needed", mediafile->path);
+    if (ftruncate(tmphandle, s.st_size) != 0) {
+        MAW_PERRORF("ftruncate", tmpfile);
         goto end;
     }
-    else {
+
+    // Replace the target file with the output file
+    if (rename(tmpfile, target) != 0) {
+        MAW_PERRORF("rename", tmpfile);
         goto end;
     }
+    tmpfile[0] = '\0';
 
     r = RESULT_OK;
 end:
+    if (tmphandle >= 0)
+        (void)close(tmphandle);
     if (tmpfile[0] != '\0')
         (void)unlink(tmpfile);
     maw_av_free_context(ctx);
     return r;
 }
+
+int maw_update(const MediaFile *mediafile, bool dry_run) {
+    int r = RESULT_ERR_INTERNAL;
+
+    r = maw_update_check(mediafile);
+    if (r == RESULT_NOOP)
+        return maw_update_noop(mediafile, dry_run);
+    if (r != RESULT_OK)
+        return r;
+
+    return maw_update_apply(mediafile, dry_run);
+}
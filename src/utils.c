@@ -8,6 +8,23 @@
 #include <string.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/sysmacros.h>
+#endif
+
+#ifdef __linux__
+static bool copy_unsupported(int err);
+#endif
+static int copyfd(int src_fd, int dst_fd, size_t size,
+                  enum LinkStrategy *strategy);
+
+////////////////////////////////////////////////////////////////////////////////
 
 size_t readfile(const char *filepath, char **out) {
     FILE *fp = NULL;
@@ -57,61 +74,279 @@ end:
     return read_bytes;
 }
 
-int movefile(const char *src, const char *dst) {
+const char *linkfile_strategy_tostr(enum LinkStrategy strategy) {
+    switch (strategy) {
+        CASE_RET(LINK_STRATEGY_NONE);
+        CASE_RET(LINK_STRATEGY_REFLINK);
+        CASE_RET(LINK_STRATEGY_LINK);
+        CASE_RET(LINK_STRATEGY_COPY_FILE_RANGE);
+        CASE_RET(LINK_STRATEGY_SENDFILE);
+        CASE_RET(LINK_STRATEGY_BUFFER);
+    }
+    return NULL;
+}
+
+#ifdef __linux__
+// Returns true if the error from an accelerated copy means that the next
+// strategy should be tried rather than giving up.
+static bool copy_unsupported(int err) {
+    return err == EXDEV || err == EINVAL || err == ENOSYS ||
+           err == EOPNOTSUPP || err == ENOTTY || err == EBADF;
+}
+#endif
+
+// Copy the contents of `src_fd` into the empty file `dst_fd`, using the
+// fastest method that the kernel supports for these files.
+static int copyfd(int src_fd, int dst_fd, size_t size,
+                  enum LinkStrategy *strategy) {
     int r = RESULT_ERR_INTERNAL;
-    size_t read_bytes = 0;
-    char buffer[BUFSIZ];
-    FILE *fp_src = NULL;
-    FILE *fp_dst = NULL;
+    char *buffer = NULL;
+    ssize_t read_bytes;
+    size_t copied = 0;
+#ifdef __linux__
+    ssize_t n;
+    off_t offset = 0;
 
-    fp_src = fopen(src, "r");
-    if (fp_src == NULL) {
-        MAW_PERRORF("fopen", src);
+    // Share the extents of the source file (btrfs, xfs, ...)
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        *strategy = LINK_STRATEGY_REFLINK;
+        r = RESULT_OK;
+        goto end;
+    }
+    else if (!copy_unsupported(errno)) {
+        MAW_PERROR("ioctl(FICLONE)");
         goto end;
     }
 
-    fp_dst = fopen(dst, "w");
-    if (fp_dst == NULL) {
-        MAW_PERRORF("fopen", dst);
+    // In-kernel copy, may still use reflinks or server side copies
+    while (copied < size) {
+        n = copy_file_range(src_fd, NULL, dst_fd, NULL, size - copied, 0);
+        if (n <= 0)
+            break;
+        copied += (size_t)n;
+    }
+    if (copied == size) {
+        *strategy = LINK_STRATEGY_COPY_FILE_RANGE;
+        r = RESULT_OK;
+        goto end;
+    }
+    else if (copied > 0 || !copy_unsupported(errno)) {
+        MAW_PERROR("copy_file_range");
         goto end;
     }
 
-    while ((read_bytes = fread(buffer, 1, BUFSIZ, fp_src)) > 0) {
-        MAW_WRITE(fileno(fp_dst), buffer, read_bytes);
+    // In-kernel copy through the page cache
+    while (copied < size) {
+        n = sendfile(dst_fd, src_fd, &offset, size - copied);
+        if (n <= 0)
+            break;
+        copied += (size_t)n;
     }
+    if (copied == size) {
+        *strategy = LINK_STRATEGY_SENDFILE;
+        r = RESULT_OK;
+        goto end;
+    }
+    else if (copied > 0 || !copy_unsupported(errno)) {
+        MAW_PERROR("sendfile");
+        goto end;
+    }
+#endif
 
-    fclose(fp_src);
-    fp_src = NULL;
+    buffer = malloc(MAW_COPY_BUFSIZE);
+    if (buffer == NULL) {
+        MAW_PERROR("malloc");
+        goto end;
+    }
 
-    r = unlink(src);
-    if (r != 0) {
-        MAW_PERRORF("unlink", src);
+    while ((read_bytes = read(src_fd, buffer, MAW_COPY_BUFSIZE)) > 0) {
+        MAW_WRITE(dst_fd, buffer, (size_t)read_bytes);
+        copied += (size_t)read_bytes;
+    }
+    if (read_bytes < 0) {
+        MAW_PERROR("read");
+        goto end;
+    }
+    if (copied != size) {
+        MAW_LOGF(MAW_ERROR, "short copy: %zu != %zu byte(s)", copied, size);
         goto end;
     }
 
+    *strategy = LINK_STRATEGY_BUFFER;
     r = RESULT_OK;
 end:
-    if (fp_src != NULL)
-        fclose(fp_src);
-    if (fp_dst != NULL)
-        fclose(fp_dst);
+    free(buffer);
     return r;
 }
 
-bool on_same_device(const char *path1, const char *path2) {
-    struct stat stat1, stat2;
+// Place `src` at `dst` without copying any data if possible: a reflink shares
+// the extents of `src` and a hard link its inode. The file is only copied if
+// neither is supported. An existing `dst` is replaced atomically.
+int linkfile(const char *src, const char *dst, enum LinkStrategy *strategy) {
+    int r = RESULT_ERR_INTERNAL;
+    char tmpfile[MAW_PATH_MAX];
+    const char *slash;
+    size_t dirlen = 0;
+    int src_fd = -1;
+    int tmp_fd = -1;
+    struct stat s;
+    struct stat d;
+
+    *strategy = LINK_STRATEGY_NONE;
+    tmpfile[0] = '\0';
 
-    if (stat(path1, &stat1) < 0) {
-        MAW_PERRORF("stat", path1);
-        return false;
+    src_fd = open(src, O_RDONLY);
+    if (src_fd < 0) {
+        MAW_PERRORF("open", src);
+        goto end;
     }
 
-    if (stat(path2, &stat2) < 0) {
-        MAW_PERRORF("stat", path2);
-        return false;
+    if (fstat(src_fd, &s) != 0) {
+        MAW_PERRORF("fstat", src);
+        goto end;
+    }
+
+    // Nothing to do if `dst` is already a hard link to `src`
+    if (stat(dst, &d) == 0 && d.st_dev == s.st_dev && d.st_ino == s.st_ino) {
+        *strategy = LINK_STRATEGY_LINK;
+        r = RESULT_OK;
+        goto end;
+    }
+
+    // Create the new file as a hidden sibling of `dst`
+    slash = strrchr(dst, '/');
+    if (slash != NULL) {
+        dirlen = (size_t)(slash - dst) + 1;
+        if (dirlen >= sizeof tmpfile) {
+            MAW_LOGF(MAW_ERROR, "%s: Path too long", dst);
+            goto end;
+        }
+        memcpy(tmpfile, dst, dirlen);
+    }
+    tmpfile[dirlen] = '\0';
+    MAW_STRLCAT(tmpfile, ".maw.XXXXXX");
+
+    tmp_fd = mkstemp(tmpfile);
+    if (tmp_fd < 0) {
+        MAW_PERRORF("mkstemp", tmpfile);
+        tmpfile[0] = '\0';
+        goto end;
     }
 
-    return stat1.st_dev == stat2.st_dev;
+#ifdef __linux__
+    if (ioctl(tmp_fd, FICLONE, src_fd) == 0) {
+        *strategy = LINK_STRATEGY_REFLINK;
+    }
+    else if (!copy_unsupported(errno)) {
+        MAW_PERROR("ioctl(FICLONE)");
+        goto end;
+    }
+#endif
+
+    if (*strategy == LINK_STRATEGY_NONE) {
+        (void)close(tmp_fd);
+        tmp_fd = -1;
+        if (unlink(tmpfile) != 0) {
+            MAW_PERRORF("unlink", tmpfile);
+            goto end;
+        }
+
+        if (link(src, tmpfile) == 0) {
+            *strategy = LINK_STRATEGY_LINK;
+        }
+        else if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+            MAW_PERRORF("link", src);
+            goto end;
+        }
+        else {
+            // Different filesystems, fall back to a copy
+            tmp_fd = open(tmpfile, O_WRONLY | O_CREAT | O_EXCL, 0600);
+            if (tmp_fd < 0) {
+                MAW_PERRORF("open", tmpfile);
+                tmpfile[0] = '\0';
+                goto end;
+            }
+            r = copyfd(src_fd, tmp_fd, (size_t)s.st_size, strategy);
+            if (r != 0) {
+                MAW_LOGF(MAW_ERROR, "%s: Failed to copy to %s", src, tmpfile);
+                goto end;
+            }
+            r = RESULT_ERR_INTERNAL;
+        }
+    }
+
+    // Hard links share the permissions of `src` already
+    if (tmp_fd >= 0 && fchmod(tmp_fd, s.st_mode & 07777) != 0) {
+        MAW_PERRORF("fchmod", tmpfile);
+        goto end;
+    }
+
+    if (rename(tmpfile, dst) != 0) {
+        MAW_PERRORF("rename", tmpfile);
+        goto end;
+    }
+    tmpfile[0] = '\0';
+
+    MAW_LOGF(MAW_DEBUG, "%s -> %s [%s]", src, dst,
+             linkfile_strategy_tostr(*strategy));
+    r = RESULT_OK;
+end:
+    if (src_fd >= 0)
+        (void)close(src_fd);
+    if (tmp_fd >= 0)
+        (void)close(tmp_fd);
+    if (tmpfile[0] != '\0')
+        (void)unlink(tmpfile);
+    return r;
+}
+
+// Create the missing parent directories of `path`
+int mkparents(const char *path, mode_t mode) {
+    int r = RESULT_ERR_INTERNAL;
+    char dir[MAW_PATH_MAX];
+
+    MAW_STRLCPY(dir, path);
+
+    for (char *c = dir + 1; *c != '\0'; c++) {
+        if (*c != '/')
+            continue;
+        *c = '\0';
+        if (mkdir(dir, mode) != 0 && errno != EEXIST) {
+            MAW_PERRORF("mkdir", dir);
+            goto end;
+        }
+        *c = '/';
+    }
+
+    r = RESULT_OK;
+end:
+    return r;
+}
+
+// Path to `name` in the cache directory of maw
+int cachepath(const char *name, char *out, size_t size) {
+    int r = RESULT_ERR_INTERNAL;
+    char *envvar = NULL;
+
+    envvar = getenv("XDG_CACHE_HOME");
+    if (envvar == NULL) {
+        envvar = getenv("HOME");
+        if (envvar == NULL) {
+            MAW_LOG(MAW_ERROR, "HOME is unset");
+            goto end;
+        }
+        MAW_STRLCPY_SIZE(out, envvar, size);
+        MAW_STRLCAT_SIZE(out, "/.cache/maw/", size);
+    }
+    else {
+        MAW_STRLCPY_SIZE(out, envvar, size);
+        MAW_STRLCAT_SIZE(out, "/maw/", size);
+    }
+    MAW_STRLCAT_SIZE(out, name, size);
+
+    r = RESULT_OK;
+end:
+    return r;
 }
 
 bool isfile(const char *path) {
@@ -124,6 +359,73 @@ bool isfile(const char *path) {
     return S_ISREG(s.st_mode);
 }
 
+// Check if a block device is backed by a spinning disk. Partitions do not
+// have a queue directory of their own, fall back to the parent device.
+bool isrotational(dev_t dev) {
+#ifdef __linux__
+    char path[MAW_PATH_MAX];
+    FILE *fp;
+    int c;
+
+    for (int i = 0; i < 2; i++) {
+        (void)snprintf(path, sizeof path,
+                       "/sys/dev/block/%u:%u/%squeue/rotational", major(dev),
+                       minor(dev), i == 0 ? "" : "../");
+        fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+
+        c = fgetc(fp);
+        (void)fclose(fp);
+        return c == '1';
+    }
+#else
+    (void)dev;
+#endif
+    return false;
+}
+
+// Physical offset of the first extent of a file on its device
+int physical_offset(const char *path, uint64_t *out) {
+    int r = RESULT_ERR_INTERNAL;
+#ifdef __linux__
+    int fd;
+    // Room for the header and one extent
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) /
+                     sizeof(uint64_t) +
+                 1];
+    struct fiemap *fm = (struct fiemap *)buf;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        MAW_PERRORF("open", path);
+        return RESULT_ERR_INTERNAL;
+    }
+
+    memset(buf, 0, sizeof buf);
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+
+    // Not supported by all filesystems, the caller has a fallback
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+        MAW_LOGF(MAW_DEBUG, "%s: FIEMAP: %s", path, strerror(errno));
+        goto end;
+    }
+    if (fm->fm_mapped_extents == 0)
+        goto end;
+
+    *out = fm->fm_extents[0].fe_physical;
+    r = RESULT_OK;
+end:
+    (void)close(fd);
+#else
+    (void)path;
+    (void)out;
+#endif
+    return r;
+}
+
 // Music/red/red1.m4a -> red1
 int basename_no_ext(const char *filepath, char *out, size_t outsize) {
     int r = RESULT_ERR_INTERNAL;
@@ -175,3 +477,32 @@ uint32_t hash(const char *str) {
 
     return digest;
 }
+
+// 64-bit FNV-1a over arbitrary data
+uint64_t hash64(const void *data, size_t size) {
+    return hash64_update(HASH64_INIT, data, size);
+}
+
+// Continue an FNV-1a digest with more data
+uint64_t hash64_update(uint64_t digest, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < size; i++) {
+        digest ^= bytes[i];
+        digest *= 1099511628211ULL;
+    }
+
+    return digest;
+}
+
+// Continue an FNV-1a digest with an optional string, a marker is added before
+// each string so that NULL and empty strings differ.
+uint64_t hash64_update_str(uint64_t digest, const char *s) {
+    unsigned char isset = s != NULL;
+
+    digest = hash64_update(digest, &isset, sizeof isset);
+    if (s != NULL) {
+        digest = hash64_update(digest, s, strlen(s) + 1);
+    }
+    return digest;
+}
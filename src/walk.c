@@ -0,0 +1,377 @@
+#include "maw/walk.h"
+#include "maw/log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifdef __linux__
+// Layout of the records returned by getdents64(2)
+struct WalkDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static int maw_walk_append(WalkResult *result, const char *path,
+                           const struct stat *s);
+static int maw_walk_merge(WalkContext *ctx, WalkResult *batch);
+static int maw_walk_push(WalkContext *ctx, const char *path);
+static int maw_walk_entry(WalkContext *ctx, int fd, const char *dirpath,
+                          const char *name, unsigned char type,
+                          WalkResult *batch);
+static int maw_walk_dir(WalkContext *ctx, const char *path);
+static int maw_walk_cmp(const void *a, const void *b);
+static void *maw_walk_worker(void *arg);
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int maw_walk_append(WalkResult *result, const char *path,
+                           const struct stat *s) {
+    WalkEntry *entries;
+    size_t capacity;
+
+    if (result->count == result->capacity) {
+        capacity = result->capacity > 0 ? result->capacity * 2
+                                        : MAW_WALK_INITIAL_SIZE;
+        entries = realloc(result->entries, capacity * sizeof(WalkEntry));
+        if (entries == NULL) {
+            MAW_PERROR("realloc");
+            return RESULT_ERR_INTERNAL;
+        }
+        result->entries = entries;
+        result->capacity = capacity;
+    }
+
+    result->entries[result->count].path = strdup(path);
+    if (result->entries[result->count].path == NULL) {
+        MAW_PERROR("strdup");
+        return RESULT_ERR_INTERNAL;
+    }
+    result->entries[result->count].stat = *s;
+    result->count++;
+
+    return RESULT_OK;
+}
+
+// Move the files found in one directory into the shared result, the shared
+// lock is only taken once per directory.
+static int maw_walk_merge(WalkContext *ctx, WalkResult *batch) {
+    int r = RESULT_ERR_INTERNAL;
+    WalkResult *result = ctx->result;
+    WalkEntry *entries;
+    size_t capacity;
+
+    if (batch->count == 0)
+        return RESULT_OK;
+
+    (void)pthread_mutex_lock(&ctx->lock);
+
+    if (result->count + batch->count > result->capacity) {
+        capacity = result->capacity > 0 ? result->capacity
+                                        : MAW_WALK_INITIAL_SIZE;
+        while (capacity < result->count + batch->count)
+            capacity *= 2;
+
+        entries = realloc(result->entries, capacity * sizeof(WalkEntry));
+        if (entries == NULL) {
+            MAW_PERROR("realloc");
+            goto end;
+        }
+        result->entries = entries;
+        result->capacity = capacity;
+    }
+
+    memcpy(&result->entries[result->count], batch->entries,
+           batch->count * sizeof(WalkEntry));
+    result->count += batch->count;
+    batch->count = 0;
+
+    r = RESULT_OK;
+end:
+    (void)pthread_mutex_unlock(&ctx->lock);
+    return r;
+}
+
+static int maw_walk_push(WalkContext *ctx, const char *path) {
+    WalkDir *dir;
+
+    dir = calloc(1, sizeof(WalkDir));
+    if (dir == NULL) {
+        MAW_PERROR("calloc");
+        return RESULT_ERR_INTERNAL;
+    }
+    dir->path = strdup(path);
+    if (dir->path == NULL) {
+        MAW_PERROR("strdup");
+        free(dir);
+        return RESULT_ERR_INTERNAL;
+    }
+
+    (void)pthread_mutex_lock(&ctx->lock);
+    TAILQ_INSERT_TAIL(&ctx->dirs_head, dir, entry);
+    ctx->pending++;
+    (void)pthread_cond_signal(&ctx->changed);
+    (void)pthread_mutex_unlock(&ctx->lock);
+
+    return RESULT_OK;
+}
+
+// Hidden files are skipped, this includes the temporary files created by
+// `maw_update_apply()`. Symbolic links are not followed.
+static int maw_walk_entry(WalkContext *ctx, int fd, const char *dirpath,
+                          const char *name, unsigned char type,
+                          WalkResult *batch) {
+    char path[MAW_PATH_MAX];
+    struct stat s;
+    int n;
+
+    if (name[0] == '.')
+        return RESULT_OK;
+
+    n = snprintf(path, sizeof path, "%s/%s", dirpath, name);
+    if (n < 0 || (size_t)n >= sizeof path) {
+        MAW_LOGF(MAW_ERROR, "%s/%s: Path too long", dirpath, name);
+        return RESULT_ERR_INTERNAL;
+    }
+
+    // Not all filesystems fill in the file type
+    if (type == DT_UNKNOWN) {
+        if (fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno == ENOENT)
+                goto vanished;
+            MAW_PERRORF("fstatat", path);
+            return RESULT_ERR_INTERNAL;
+        }
+        type = S_ISDIR(s.st_mode)   ? DT_DIR
+               : S_ISREG(s.st_mode) ? DT_REG
+                                    : DT_UNKNOWN;
+    }
+
+    if (type == DT_DIR)
+        return maw_walk_push(ctx, path);
+
+    if (type != DT_REG)
+        return RESULT_OK;
+
+    if (fstatat(fd, name, &s, 0) != 0) {
+        if (errno == ENOENT)
+            goto vanished;
+        MAW_PERRORF("fstatat", path);
+        return RESULT_ERR_INTERNAL;
+    }
+
+    return maw_walk_append(batch, path, &s);
+vanished:
+    // Removed after the directory was read
+    MAW_LOGF(MAW_WARN, "%s: Skipping removed file", path);
+    return RESULT_OK;
+}
+
+static int maw_walk_dir(WalkContext *ctx, const char *path) {
+    int r = RESULT_ERR_INTERNAL;
+    int fd;
+    WalkResult batch = {0};
+#ifdef __linux__
+    // Aligned for the records
+    uint64_t buf[MAW_WALK_BUFSIZE / sizeof(uint64_t)];
+    const struct WalkDirent64 *dirent;
+    long n;
+#else
+    DIR *dir = NULL;
+    struct dirent *dirent;
+#endif
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && !STR_EQ(path, ctx->root)) {
+        MAW_LOGF(MAW_WARN, "%s: Skipping directory: %s", path,
+                 strerror(errno));
+        r = RESULT_OK;
+        goto end;
+    }
+    else if (fd < 0) {
+        MAW_PERRORF("open", path);
+        goto end;
+    }
+
+#ifdef __linux__
+    // Read entries in large batches, readdir(3) is limited to its own buffer
+    for (;;) {
+        n = syscall(SYS_getdents64, fd, buf, sizeof buf);
+        if (n < 0) {
+            MAW_PERRORF("getdents64", path);
+            goto end;
+        }
+        if (n == 0)
+            break;
+
+        for (long off = 0; off < n; off += dirent->d_reclen) {
+            dirent = (const struct WalkDirent64 *)((const char *)buf + off);
+            r = maw_walk_entry(ctx, fd, path, dirent->d_name, dirent->d_type,
+                               &batch);
+            if (r != 0)
+                goto end;
+        }
+    }
+#else
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        MAW_PERRORF("fdopendir", path);
+        goto end;
+    }
+
+    while ((dirent = readdir(dir)) != NULL) {
+        r = maw_walk_entry(ctx, fd, path, dirent->d_name, dirent->d_type,
+                           &batch);
+        if (r != 0)
+            goto end;
+    }
+#endif
+
+    r = maw_walk_merge(ctx, &batch);
+end:
+#ifndef __linux__
+    // Closes `fd`
+    if (dir != NULL) {
+        (void)closedir(dir);
+        fd = -1;
+    }
+#endif
+    if (fd >= 0)
+        (void)close(fd);
+    maw_walk_free(&batch);
+    return r;
+}
+
+static int maw_walk_cmp(const void *a, const void *b) {
+    const WalkEntry *lhs = a;
+    const WalkEntry *rhs = b;
+    return strcmp(lhs->path, rhs->path);
+}
+
+// Read directories from the shared queue until all directories have been
+// read, new sub-directories are pushed back onto the queue.
+static void *maw_walk_worker(void *arg) {
+    int r;
+    WalkContext *ctx = arg;
+    WalkDir *dir;
+
+    for (;;) {
+        (void)pthread_mutex_lock(&ctx->lock);
+        while (TAILQ_EMPTY(&ctx->dirs_head) && ctx->pending > 0 &&
+               !ctx->failed)
+            (void)pthread_cond_wait(&ctx->changed, &ctx->lock);
+
+        if (ctx->failed || TAILQ_EMPTY(&ctx->dirs_head)) {
+            (void)pthread_mutex_unlock(&ctx->lock);
+            break;
+        }
+
+        dir = TAILQ_FIRST(&ctx->dirs_head);
+        TAILQ_REMOVE(&ctx->dirs_head, dir, entry);
+        (void)pthread_mutex_unlock(&ctx->lock);
+
+        r = maw_walk_dir(ctx, dir->path);
+        free(dir->path);
+        free(dir);
+
+        (void)pthread_mutex_lock(&ctx->lock);
+        ctx->pending--;
+        if (r != 0)
+            ctx->failed = true;
+        if (ctx->pending == 0 || ctx->failed)
+            (void)pthread_cond_broadcast(&ctx->changed);
+        (void)pthread_mutex_unlock(&ctx->lock);
+    }
+
+    return NULL;
+}
+
+// Recursively collect all regular files beneath `root`
+int maw_walk(const char *root, WalkResult *result) {
+    int r = RESULT_ERR_INTERNAL;
+    pthread_t threads[MAW_WALK_THREADS];
+    size_t spawned = 0;
+    WalkDir *dir;
+    WalkContext ctx = {
+        .root = root,
+        .pending = 0,
+        .failed = false,
+        .result = result,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+    };
+
+    TAILQ_INIT(&ctx.dirs_head);
+    result->entries = NULL;
+    result->count = 0;
+    result->capacity = 0;
+
+    r = maw_walk_push(&ctx, root);
+    if (r != 0)
+        goto end;
+
+    for (size_t i = 0; i < MAW_WALK_THREADS; i++) {
+        r = pthread_create(&threads[i], NULL, maw_walk_worker, &ctx);
+        if (r != 0) {
+            MAW_LOGF(MAW_ERROR, "pthread_create: %s", strerror(r));
+            (void)pthread_mutex_lock(&ctx.lock);
+            ctx.failed = true;
+            (void)pthread_cond_broadcast(&ctx.changed);
+            (void)pthread_mutex_unlock(&ctx.lock);
+            break;
+        }
+        spawned++;
+    }
+
+    for (size_t i = 0; i < spawned; i++) {
+        r = pthread_join(threads[i], NULL);
+        if (r != 0) {
+            MAW_LOGF(MAW_ERROR, "pthread_join: %s", strerror(r));
+            ctx.failed = true;
+        }
+    }
+
+    if (ctx.failed) {
+        r = RESULT_ERR_INTERNAL;
+        goto end;
+    }
+
+    // The order that directories are read in is not deterministic
+    qsort(result->entries, result->count, sizeof(WalkEntry), maw_walk_cmp);
+    MAW_LOGF(MAW_DEBUG, "%s: Found %zu file(s)", root, result->count);
+
+    r = RESULT_OK;
+end:
+    while ((dir = TAILQ_FIRST(&ctx.dirs_head)) != NULL) {
+        TAILQ_REMOVE(&ctx.dirs_head, dir, entry);
+        free(dir->path);
+        free(dir);
+    }
+    if (r != RESULT_OK)
+        maw_walk_free(result);
+    (void)pthread_mutex_destroy(&ctx.lock);
+    (void)pthread_cond_destroy(&ctx.changed);
+    return r;
+}
+
+void maw_walk_free(WalkResult *result) {
+    for (size_t i = 0; i < result->count; i++) {
+        free(result->entries[i].path);
+    }
+    free(result->entries);
+    result->entries = NULL;
+    result->count = 0;
+    result->capacity = 0;
+}